@@ -0,0 +1,104 @@
+// Copyright (c) 2009 Satoshi Nakamoto
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+
+//
+// Times EvalScript on a few scripts that don't check signatures, so the
+// interpreter itself is what's measured, and counts how many times each
+// run calls operator new.  A script that stays within the stack's inline
+// slots should show 0.
+//
+//   bench_script [iterations]
+//
+
+#include "headers.h"
+
+// The wallet globals script.cpp links against, empty here
+map<vector<unsigned char>, CPrivKey> mapKeys;
+map<uint160, vector<unsigned char> > mapPubKeys;
+CCriticalSection cs_mapKeys;
+
+static int64 nAllocs = 0;
+
+void* operator new(size_t nSize)
+{
+    nAllocs++;
+    void* p = malloc(nSize ? nSize : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[](size_t nSize)
+{
+    return operator new(nSize);
+}
+
+void operator delete(void* p) throw()
+{
+    free(p);
+}
+
+void operator delete[](void* p) throw()
+{
+    free(p);
+}
+
+static vector<unsigned char> MakeBytes(unsigned int nSize, unsigned char ch)
+{
+    return vector<unsigned char>(nSize, ch);
+}
+
+static void Bench(const char* pszName, const CScript& script, const CTransaction& txTo, int nIterations)
+{
+    // Once outside the timing so a wrong script shows up
+    if (!EvalScript(script, txTo, 0))
+    {
+        printf("%-12s script failed\n", pszName);
+        return;
+    }
+
+    int64 nAllocsStart = nAllocs;
+    clock_t nStart = clock();
+    for (int i = 0; i < nIterations; i++)
+        EvalScript(script, txTo, 0);
+    double dSeconds = (double)(clock() - nStart) / CLOCKS_PER_SEC;
+    printf("%-12s %8.0f ns/run  %6.2f allocs/run\n", pszName, dSeconds * 1e9 / nIterations,
+           (double)(nAllocs - nAllocsStart) / nIterations);
+}
+
+int main(int argc, char* argv[])
+{
+    int nIterations = (argc > 1 ? atoi(argv[1]) : 200000);
+
+    CTransaction txTo;
+    txTo.vin.push_back(CTxIn(uint256(1), 0));
+    txTo.vout.push_back(CTxOut(1, CScript() << OP_TRUE));
+
+    // The hash half of a pay to pubkey hash spend
+    vector<unsigned char> vchSig = MakeBytes(72, 0x30);
+    vector<unsigned char> vchPubKey = MakeBytes(65, 0x04);
+    CScript scriptHash;
+    scriptHash << vchSig << vchPubKey << OP_DUP << OP_HASH160 << Hash160(vchPubKey) << OP_EQUALVERIFY;
+    scriptHash << OP_2DROP << OP_1;
+    Bench("hash160", scriptHash, txTo, nIterations);
+
+    // Small number arithmetic
+    CScript scriptMath;
+    scriptMath << OP_1;
+    for (int i = 0; i < 20; i++)
+        scriptMath << OP_2 << OP_ADD << OP_DUP << OP_0 << OP_GREATERTHAN << OP_VERIFY;
+    scriptMath << CBigNum(41) << OP_NUMEQUAL;
+    Bench("arithmetic", scriptMath, txTo, nIterations);
+
+    // Stack shuffling and branches
+    CScript scriptStack;
+    for (int i = 0; i < 8; i++)
+        scriptStack << MakeBytes(33, i);
+    scriptStack << OP_2DUP << OP_ROT << OP_SWAP << OP_3 << OP_PICK << OP_TOALTSTACK << OP_OVER << OP_TUCK;
+    scriptStack << OP_1 << OP_IF << OP_DEPTH << OP_ELSE << OP_0 << OP_ENDIF << OP_FROMALTSTACK << OP_SIZE;
+    scriptStack << OP_4 << OP_ROLL << OP_CAT << OP_SIZE << OP_NIP;
+    Bench("stack", scriptStack, txTo, nIterations);
+
+    return 0;
+}
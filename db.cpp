@@ -24,6 +24,9 @@ DbEnv dbenv(0);
 // A key-value mapping indicating how many times a file is
 // used when opening a DB connection.
 static map<string, int> mapFileUseCount;
+// Db handles are opened once per file and shared by every CDB using it,
+// they're only closed by DBFlush once nothing has the file open.
+static map<string, Db*> mapDb;
 
 class CDBInit
 {
@@ -49,7 +52,7 @@ instance_of_cdbinit;
 /**
  * Constructor that creates a new instance of CDB.
  */
-CDB::CDB(const char* pszFile, const char* pszMode, bool fTxn) : pdb(NULL)
+CDB::CDB(const char* pszFile, const char* pszMode, bool fTxn) : pdb(NULL), fReadOnly(true), ssKeyBuf(SER_DISK), ssValueBuf(SER_DISK)
 {
     // This value will be used to indicate the success (0) or failure (>0)
     // of our attempts to open the 1) DB environment, and 2) the DB connection.
@@ -63,16 +66,12 @@ CDB::CDB(const char* pszFile, const char* pszMode, bool fTxn) : pdb(NULL)
     // or else there will be an error.
     bool fCreate = strchr(pszMode, 'c');
     // Indicates whether this database is being opened in read mode and NOT in write mode:
-    bool fReadOnly = (!strchr(pszMode, '+') && !strchr(pszMode, 'w'));
-    unsigned int nFlags = DB_THREAD;
+    fReadOnly = (!strchr(pszMode, '+') && !strchr(pszMode, 'w'));
+    // The handle is shared with writers, so it's never opened DB_RDONLY
+    // and always wraps operations outside a transaction in one:
+    unsigned int nFlags = DB_THREAD | DB_AUTO_COMMIT;
     if (fCreate)
         nFlags |= DB_CREATE;
-    else if (fReadOnly)
-        nFlags |= DB_RDONLY;
-
-    // If specified, wrap operations in a transaction:
-    if (!fReadOnly || fTxn)
-        nFlags |= DB_AUTO_COMMIT;
 
     /**
      * Acquire a lock before proceeding.
@@ -121,28 +120,32 @@ CDB::CDB(const char* pszFile, const char* pszMode, bool fTxn) : pdb(NULL)
         // Set CDB's property for the filename to store/read data from:
         strFile = pszFile;
         ++mapFileUseCount[strFile];
-    }
 
-    // Make a new instance of the DB
-    pdb = new Db(&dbenv, 0);
+        // Use the file's open handle, or make one if this is the first use
+        pdb = mapDb[strFile];
+        if (pdb == NULL)
+        {
+            pdb = new Db(&dbenv, 0);
 
-    // Open the connection and return the success/failure status of the operation:
-    ret = pdb->open(NULL,      // Txn pointer
-                    pszFile,   // Filename
-                    "main",    // Logical db name
-                    DB_BTREE,  // Database type
-                    nFlags,    // Flags
-                    0);
+            // Open the connection and return the success/failure status of the operation:
+            ret = pdb->open(NULL,      // Txn pointer
+                            pszFile,   // Filename
+                            "main",    // Logical db name
+                            DB_BTREE,  // Database type
+                            nFlags,    // Flags
+                            0);
 
-    // The DB->open() method returns a non-zero error value on failure and 0 on success
-    if (ret > 0)
-    {
-        delete pdb;
-        pdb = NULL;
-        CRITICAL_BLOCK(cs_db)
-            --mapFileUseCount[strFile];
-        strFile = "";
-        throw runtime_error(strprintf("CDB() : can't open database file %s, error %d\n", pszFile, ret));
+            // The DB->open() method returns a non-zero error value on failure and 0 on success
+            if (ret > 0)
+            {
+                delete pdb;
+                pdb = NULL;
+                --mapFileUseCount[strFile];
+                strFile = "";
+                throw runtime_error(strprintf("CDB() : can't open database file %s, error %d\n", pszFile, ret));
+            }
+            mapDb[strFile] = pdb;
+        }
     }
 
     if (fCreate && !Exists(string("version")))
@@ -158,10 +161,19 @@ void CDB::Close()
     if (!vTxn.empty())
         vTxn.front()->abort();
     vTxn.clear();
-    pdb->close(0);
-    delete pdb;
+    // The handle stays open in mapDb for the next user
     pdb = NULL;
-    dbenv.txn_checkpoint(0, 0, 0);
+
+    // A checkpoint writes out dirty pages and syncs the log.  Read-only
+    // handles have nothing of their own to checkpoint, and while catching
+    // up the tx index is only made durable when the cache is flushed, so
+    // those settle for at most one a minute.
+    unsigned int nMinutes = 0;
+    if (fReadOnly)
+        nMinutes = 1;
+    if (strFile == "blkindex.dat" && IsInitialBlockDownload())
+        nMinutes = 1;
+    dbenv.txn_checkpoint(0, nMinutes, 0);
 
     CRITICAL_BLOCK(cs_db)
         --mapFileUseCount[strFile];
@@ -174,6 +186,13 @@ void DBFlush(bool fShutdown)
     // Flush log data to the actual data file
     //  on all files that are not in use
     printf("DBFlush(%s)\n", fShutdown ? "true" : "false");
+
+    // Write out the tx index cache first, cs_main keeps blocks from being
+    // connected while it's at it
+    if (!fClient)
+        CRITICAL_BLOCK(cs_main)
+            CTxDB().FlushCache();
+
     CRITICAL_BLOCK(cs_db)
     {
         dbenv.txn_checkpoint(0, 0, 0);
@@ -184,6 +203,17 @@ void DBFlush(bool fShutdown)
             int nRefCount = (*mi).second;
             if (nRefCount == 0)
             {
+                // The file can only be reset once its handle is closed
+                map<string, Db*>::iterator mid = mapDb.find(strFile);
+                if (mid != mapDb.end())
+                {
+                    if ((*mid).second)
+                    {
+                        (*mid).second->close(0);
+                        delete (*mid).second;
+                    }
+                    mapDb.erase(mid);
+                }
                 dbenv.lsn_reset(strFile.c_str(), 0);
                 mapFileUseCount.erase(mi++);
             }
@@ -210,17 +240,285 @@ void DBFlush(bool fShutdown)
 // CTxDB
 //
 
+// While catching up, flush after this many new best blocks even if the
+// cache isn't full.  Once caught up every new best block is flushed.
+static const int TXDB_CACHE_MAX_BLOCKS = 500;
+
+class CTxIndexCacheEntry
+{
+public:
+    CTxIndex txindex;
+    bool fErased;
+    bool fDirty;
+};
+
+class CTxDBChanges
+{
+public:
+    map<uint256, CTxIndexCacheEntry> mapTxIndex;
+    map<uint256, CDiskBlockIndex> mapBlockIndex;
+    set<uint256> setBlockIndexErased;
+    bool fBestChain;
+    uint256 hashBestChain;
+    unsigned int nBestChainTime;
+
+    CTxDBChanges()
+    {
+        fBestChain = false;
+        nBestChainTime = 0;
+    }
+};
+
+// The shared cache holds tx index entries read from disk and every
+// committed change that hasn't been flushed yet.  Block index and best
+// chain records are only held until they're flushed.  hashBestChain only
+// ever reaches the database together with the changes that led to it, so
+// after a crash the database is behind but consistent, and the blocks
+// after it are downloaded again.
+static CCriticalSection cs_txdbcache;
+static CTxDBChanges txdbcache;
+static unsigned int nTxDBCacheBytes = 0;
+static int nTxDBCacheBlocks = 0;
+
+static unsigned int GetCacheLimit()
+{
+    // In bytes, nDbCacheSize is in MB and already clamped where it's set
+    return (unsigned int)min(max(nDbCacheSize, MIN_DB_CACHE_SIZE), MAX_DB_CACHE_SIZE) * 1000000;
+}
+
+static unsigned int GetCacheEntrySize(const CTxIndexCacheEntry& entry)
+{
+    // Rough, counting the map node
+    return sizeof(uint256) + sizeof(entry) + 32 + entry.txindex.vchSpent.size();
+}
+
+static void SetCacheEntry(const uint256& hash, const CTxIndexCacheEntry& entry)
+{
+    // Caller holds cs_txdbcache
+    map<uint256, CTxIndexCacheEntry>::iterator mi = txdbcache.mapTxIndex.find(hash);
+    if (mi != txdbcache.mapTxIndex.end())
+    {
+        nTxDBCacheBytes -= GetCacheEntrySize((*mi).second);
+        (*mi).second = entry;
+    }
+    else
+    {
+        txdbcache.mapTxIndex.insert(make_pair(hash, entry));
+    }
+    nTxDBCacheBytes += GetCacheEntrySize(entry);
+}
+
+CTxDB::CTxDB(const char* pszMode, bool fTxn) : CDB(!fClient ? "blkindex.dat" : NULL, pszMode, fTxn)
+{
+    pchanges = NULL;
+}
+
+CTxDB::~CTxDB()
+{
+    delete pchanges;
+}
+
+CTxDBChanges& CTxDB::GetChanges()
+{
+    // Inside a transaction changes are kept back until it commits, outside
+    // one they go straight to the shared cache and cs_txdbcache is needed
+    if (vTxn.empty())
+        return txdbcache;
+    if (!pchanges)
+        pchanges = new CTxDBChanges();
+    return *pchanges;
+}
+
+bool CTxDB::TxnCommit()
+{
+    if (!CDB::TxnCommit())
+    {
+        if (vTxn.empty())
+        {
+            delete pchanges;
+            pchanges = NULL;
+        }
+        return false;
+    }
+    if (!vTxn.empty() || !pchanges)
+        return true;
+
+    // Outermost transaction committed, hand its changes to the shared cache
+    CRITICAL_BLOCK(cs_txdbcache)
+    {
+        foreach(const PAIRTYPE(const uint256, CTxIndexCacheEntry)& item, pchanges->mapTxIndex)
+            SetCacheEntry(item.first, item.second);
+        foreach(const PAIRTYPE(const uint256, CDiskBlockIndex)& item, pchanges->mapBlockIndex)
+        {
+            txdbcache.mapBlockIndex[item.first] = item.second;
+            txdbcache.setBlockIndexErased.erase(item.first);
+        }
+        foreach(const uint256& hash, pchanges->setBlockIndexErased)
+        {
+            txdbcache.mapBlockIndex.erase(hash);
+            txdbcache.setBlockIndexErased.insert(hash);
+        }
+        // Judged by the block this commit makes best, pindexBest hasn't
+        // moved to it yet
+        bool fCaughtUp = false;
+        if (pchanges->fBestChain)
+        {
+            txdbcache.fBestChain = true;
+            txdbcache.hashBestChain = pchanges->hashBestChain;
+            nTxDBCacheBlocks++;
+            fCaughtUp = !IsInitialBlockDownload(pchanges->nBestChainTime);
+        }
+        delete pchanges;
+        pchanges = NULL;
+
+        if (nTxDBCacheBlocks >= TXDB_CACHE_MAX_BLOCKS || nTxDBCacheBytes >= GetCacheLimit() || fCaughtUp)
+            WriteCache();
+    }
+    return true;
+}
+
+bool CTxDB::TxnAbort()
+{
+    // Nested transactions aren't used here, all of it goes
+    delete pchanges;
+    pchanges = NULL;
+    return CDB::TxnAbort();
+}
+
+bool CTxDB::FlushCache()
+{
+    CRITICAL_BLOCK(cs_txdbcache)
+        return WriteCache();
+    return false;
+}
+
+bool CTxDB::WriteCache()
+{
+    // Caller holds cs_txdbcache.  Everything dirty goes in one transaction.
+    if (!pdb || !vTxn.empty())
+        return false;
+    if (!CDB::TxnBegin())
+        return error("CTxDB::WriteCache() : TxnBegin failed");
+
+    int nWritten = 0;
+    bool fOk = true;
+    for (map<uint256, CTxIndexCacheEntry>::iterator mi = txdbcache.mapTxIndex.begin(); mi != txdbcache.mapTxIndex.end() && fOk; ++mi)
+    {
+        CTxIndexCacheEntry& entry = (*mi).second;
+        if (!entry.fDirty)
+            continue;
+        if (entry.fErased)
+            fOk = Erase(make_pair(string("txindex"), (*mi).first));
+        else
+            fOk = Write(make_pair(string("txindex"), (*mi).first), entry.txindex);
+        nWritten++;
+    }
+    foreach(const PAIRTYPE(const uint256, CDiskBlockIndex)& item, txdbcache.mapBlockIndex)
+        if (fOk)
+            fOk = Write(make_pair(string("blockindex"), item.first), item.second);
+    foreach(const uint256& hash, txdbcache.setBlockIndexErased)
+        if (fOk)
+            fOk = Erase(make_pair(string("blockindex"), hash));
+    if (fOk && txdbcache.fBestChain)
+        fOk = Write(string("hashBestChain"), txdbcache.hashBestChain);
+
+    if (!fOk || !CDB::TxnCommit())
+    {
+        // Nothing's lost, it all stays dirty for next time
+        CDB::TxnAbort();
+        return error("CTxDB::WriteCache() : write failed");
+    }
+    printf("CTxDB::WriteCache() : wrote %d tx index, %d block index records\n", nWritten, (int)(txdbcache.mapBlockIndex.size() + txdbcache.setBlockIndexErased.size()));
+
+    // Everything left is clean now
+    map<uint256, CTxIndexCacheEntry>::iterator mi = txdbcache.mapTxIndex.begin();
+    while (mi != txdbcache.mapTxIndex.end())
+    {
+        if ((*mi).second.fErased)
+        {
+            nTxDBCacheBytes -= GetCacheEntrySize((*mi).second);
+            txdbcache.mapTxIndex.erase(mi++);
+        }
+        else
+        {
+            (*mi).second.fDirty = false;
+            mi++;
+        }
+    }
+    txdbcache.mapBlockIndex.clear();
+    txdbcache.setBlockIndexErased.clear();
+    txdbcache.fBestChain = false;
+    nTxDBCacheBlocks = 0;
+
+    // Drop entries until it's down to half size
+    mi = txdbcache.mapTxIndex.begin();
+    unsigned int nCacheLimit = GetCacheLimit();
+    while (nTxDBCacheBytes > nCacheLimit / 2 && mi != txdbcache.mapTxIndex.end())
+    {
+        nTxDBCacheBytes -= GetCacheEntrySize((*mi).second);
+        txdbcache.mapTxIndex.erase(mi++);
+    }
+    return true;
+}
+
 bool CTxDB::ReadTxIndex(uint256 hash, CTxIndex& txindex)
 {
     assert(!fClient);
     txindex.SetNull();
-    return Read(make_pair(string("tx"), hash), txindex);
+
+    // Our own uncommitted changes come first
+    if (pchanges)
+    {
+        map<uint256, CTxIndexCacheEntry>::iterator mi = pchanges->mapTxIndex.find(hash);
+        if (mi != pchanges->mapTxIndex.end())
+        {
+            if ((*mi).second.fErased)
+                return false;
+            txindex = (*mi).second.txindex;
+            return true;
+        }
+    }
+
+    CRITICAL_BLOCK(cs_txdbcache)
+    {
+        map<uint256, CTxIndexCacheEntry>::iterator mi = txdbcache.mapTxIndex.find(hash);
+        if (mi != txdbcache.mapTxIndex.end())
+        {
+            if ((*mi).second.fErased)
+                return false;
+            txindex = (*mi).second.txindex;
+            return true;
+        }
+
+        // Read it from disk and keep it.  The lock stays held so a commit
+        // can't put a newer version in the cache in the meantime.
+        if (!Read(make_pair(string("txindex"), hash), txindex))
+            return false;
+        if (nTxDBCacheBytes < GetCacheLimit())
+        {
+            CTxIndexCacheEntry entry;
+            entry.txindex = txindex;
+            entry.fErased = false;
+            entry.fDirty = false;
+            SetCacheEntry(hash, entry);
+        }
+    }
+    return true;
 }
 
 bool CTxDB::UpdateTxIndex(uint256 hash, const CTxIndex& txindex)
 {
     assert(!fClient);
-    return Write(make_pair(string("tx"), hash), txindex);
+    CTxIndexCacheEntry entry;
+    entry.txindex = txindex;
+    entry.fErased = false;
+    entry.fDirty = true;
+    if (!vTxn.empty())
+        GetChanges().mapTxIndex[hash] = entry;
+    else
+        CRITICAL_BLOCK(cs_txdbcache)
+            SetCacheEntry(hash, entry);
+    return true;
 }
 
 bool CTxDB::AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeight)
@@ -230,7 +528,7 @@ bool CTxDB::AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeigh
     // Add to tx index
     uint256 hash = tx.GetHash();
     CTxIndex txindex(pos, tx.vout.size());
-    return Write(make_pair(string("tx"), hash), txindex);
+    return UpdateTxIndex(hash, txindex);
 }
 
 bool CTxDB::EraseTxIndex(const CTransaction& tx)
@@ -238,13 +536,30 @@ bool CTxDB::EraseTxIndex(const CTransaction& tx)
     assert(!fClient);
     uint256 hash = tx.GetHash();
 
-    return Erase(make_pair(string("tx"), hash));
+    CTxIndexCacheEntry entry;
+    entry.fErased = true;
+    entry.fDirty = true;
+    if (!vTxn.empty())
+        GetChanges().mapTxIndex[hash] = entry;
+    else
+        CRITICAL_BLOCK(cs_txdbcache)
+            SetCacheEntry(hash, entry);
+    return true;
 }
 
 bool CTxDB::ContainsTx(uint256 hash)
 {
     assert(!fClient);
-    return Exists(make_pair(string("tx"), hash));
+    if (pchanges && pchanges->mapTxIndex.count(hash))
+        return !pchanges->mapTxIndex[hash].fErased;
+    CRITICAL_BLOCK(cs_txdbcache)
+    {
+        map<uint256, CTxIndexCacheEntry>::iterator mi = txdbcache.mapTxIndex.find(hash);
+        if (mi != txdbcache.mapTxIndex.end())
+            return !(*mi).second.fErased;
+        return Exists(make_pair(string("txindex"), hash));
+    }
+    return false;
 }
 
 bool CTxDB::ReadOwnerTxes(uint160 hash160, int nMinHeight, vector<CTransaction>& vtx)
@@ -258,13 +573,13 @@ bool CTxDB::ReadOwnerTxes(uint160 hash160, int nMinHeight, vector<CTransaction>&
         return false;
 
     unsigned int fFlags = DB_SET_RANGE;
+    CDataStream ssKey;
+    CDataStream ssValue;
     loop
     {
         // Read next record
-        CDataStream ssKey;
         if (fFlags == DB_SET_RANGE)
             ssKey << string("owner") << hash160 << CDiskTxPos(0, 0, 0);
-        CDataStream ssValue;
         int ret = ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
         fFlags = DB_NEXT;
         if (ret == DB_NOTFOUND)
@@ -321,22 +636,50 @@ bool CTxDB::ReadDiskTx(COutPoint outpoint, CTransaction& tx)
 
 bool CTxDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
 {
-    return Write(make_pair(string("blockindex"), blockindex.GetBlockHash()), blockindex);
+    uint256 hash = blockindex.GetBlockHash();
+    CRITICAL_BLOCK(cs_txdbcache)
+    {
+        CTxDBChanges& changes = GetChanges();
+        changes.mapBlockIndex[hash] = blockindex;
+        changes.setBlockIndexErased.erase(hash);
+    }
+    return true;
 }
 
 bool CTxDB::EraseBlockIndex(uint256 hash)
 {
-    return Erase(make_pair(string("blockindex"), hash));
+    CRITICAL_BLOCK(cs_txdbcache)
+    {
+        CTxDBChanges& changes = GetChanges();
+        changes.mapBlockIndex.erase(hash);
+        changes.setBlockIndexErased.insert(hash);
+    }
+    return true;
 }
 
 bool CTxDB::ReadHashBestChain(uint256& hashBestChain)
 {
+    CRITICAL_BLOCK(cs_txdbcache)
+    {
+        if (txdbcache.fBestChain)
+        {
+            hashBestChain = txdbcache.hashBestChain;
+            return true;
+        }
+    }
     return Read(string("hashBestChain"), hashBestChain);
 }
 
-bool CTxDB::WriteHashBestChain(uint256 hashBestChain)
+bool CTxDB::WriteHashBestChain(uint256 hashBestChain, unsigned int nBestChainTime)
 {
-    return Write(string("hashBestChain"), hashBestChain);
+    CRITICAL_BLOCK(cs_txdbcache)
+    {
+        CTxDBChanges& changes = GetChanges();
+        changes.fBestChain = true;
+        changes.hashBestChain = hashBestChain;
+        changes.nBestChainTime = nBestChainTime;
+    }
+    return true;
 }
 
 CBlockIndex* InsertBlockIndex(uint256 hash)
@@ -361,6 +704,95 @@ CBlockIndex* InsertBlockIndex(uint256 hash)
     return pindexNew;
 }
 
+//
+// Tx index record as it was kept under "tx", with the position of the
+// spending transaction for each output
+//
+class CTxIndexOld
+{
+public:
+    CDiskTxPos pos;
+    vector<CDiskTxPos> vSpent;
+
+    IMPLEMENT_SERIALIZE
+    (
+        if (!(nType & SER_GETHASH))
+            READWRITE(nVersion);
+        READWRITE(pos);
+        READWRITE(vSpent);
+    )
+};
+
+bool CTxDB::UpgradeTxIndex()
+{
+    // Convert the old "tx" records to "txindex" ones a batch at a time.  Each
+    // batch is written and erased in one transaction, so if it's interrupted
+    // the next start just carries on with what's left.
+    int nUpgraded = 0;
+    loop
+    {
+        Dbc* pcursor = GetCursor();
+        if (!pcursor)
+            return false;
+
+        vector<pair<uint256, CTxIndex> > vUpgrade;
+        unsigned int fFlags = DB_SET_RANGE;
+        CDataStream ssKey;
+        CDataStream ssValue;
+        while (vUpgrade.size() < 1000)
+        {
+            if (fFlags == DB_SET_RANGE)
+                ssKey << make_pair(string("tx"), uint256(0));
+            int ret = ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
+            fFlags = DB_NEXT;
+            if (ret == DB_NOTFOUND)
+                break;
+            else if (ret != 0)
+            {
+                pcursor->close();
+                return false;
+            }
+
+            string strType;
+            ssKey >> strType;
+            if (strType != "tx")
+                break;
+            uint256 hash;
+            ssKey >> hash;
+            CTxIndexOld txindexOld;
+            ssValue >> txindexOld;
+
+            CTxIndex txindex(txindexOld.pos, txindexOld.vSpent.size());
+            for (int i = 0; i < txindexOld.vSpent.size(); i++)
+                txindex.SetSpent(i, !txindexOld.vSpent[i].IsNull());
+            vUpgrade.push_back(make_pair(hash, txindex));
+        }
+        // Cursor has to be out of the way before writing
+        pcursor->close();
+        if (vUpgrade.empty())
+            break;
+
+        if (!TxnBegin())
+            return error("CTxDB::UpgradeTxIndex() : TxnBegin failed");
+        foreach(const PAIRTYPE(uint256, CTxIndex)& item, vUpgrade)
+        {
+            if (!Write(make_pair(string("txindex"), item.first), item.second) ||
+                !Erase(make_pair(string("tx"), item.first)))
+            {
+                TxnAbort();
+                return error("CTxDB::UpgradeTxIndex() : write failed");
+            }
+        }
+        if (!TxnCommit())
+            return error("CTxDB::UpgradeTxIndex() : TxnCommit failed");
+        nUpgraded += vUpgrade.size();
+    }
+
+    if (nUpgraded > 0)
+        printf("CTxDB::UpgradeTxIndex() : converted %d tx index records\n", nUpgraded);
+    return true;
+}
+
 bool CTxDB::LoadBlockIndex()
 {
     // Get cursor
@@ -369,13 +801,13 @@ bool CTxDB::LoadBlockIndex()
         return false;
 
     unsigned int fFlags = DB_SET_RANGE;
+    CDataStream ssKey;
+    CDataStream ssValue;
     loop
     {
         // Read next record
-        CDataStream ssKey;
         if (fFlags == DB_SET_RANGE)
             ssKey << make_pair(string("blockindex"), uint256(0));
-        CDataStream ssValue;
         int ret = ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
         fFlags = DB_NEXT;
         if (ret == DB_NOTFOUND)
@@ -551,6 +983,7 @@ bool CWalletDB::LoadWallet(vector<unsigned char>& vchDefaultKeyRet)
     //// todo: shouldn't we catch exceptions and try to recover and continue?
     CRITICAL_BLOCK(cs_mapKeys)
     CRITICAL_BLOCK(cs_mapWallet)
+    CRITICAL_BLOCK(cs_mapKeyPool)
     {
         // Get cursor
         Dbc* pcursor = GetCursor();
@@ -561,7 +994,7 @@ bool CWalletDB::LoadWallet(vector<unsigned char>& vchDefaultKeyRet)
         {
             // Read next record
             CDataStream ssKey;
-            CDataStream ssValue;
+            CSecureDataStream ssValue;
             int ret = ReadAtCursor(pcursor, ssKey, ssValue);
             if (ret == DB_NOTFOUND)
                 break;
@@ -618,6 +1051,15 @@ bool CWalletDB::LoadWallet(vector<unsigned char>& vchDefaultKeyRet)
                 // Load the keys i own into memory:
                 mapKeys[vchPubKey] = vchPrivKey;
                 mapPubKeys[Hash160(vchPubKey)] = vchPubKey;
+                AddKeyToIndex(vchPubKey);
+            }
+            // A key generated ahead of time that hasn't been handed out yet,
+            // its private key is in a "key" record like any other:
+            else if (strType == "pool")
+            {
+                int64 nIndex;
+                ssKey >> nIndex;
+                ssValue >> mapKeyPool[nIndex];
             }
             // The public/private key I'll use to send myself spare change:
             else if (strType == "defaultkey")
@@ -632,6 +1074,11 @@ bool CWalletDB::LoadWallet(vector<unsigned char>& vchDefaultKeyRet)
                 ssKey >> strKey;
                 // Load settings into global state:
                 if (strKey == "fGenerateBitcoins")  ssValue >> fGenerateBitcoins;
+                if (strKey == "nMinerThreads")      ssValue >> nMinerThreads;
+                if (strKey == "fMinerPinThreads")   ssValue >> fMinerPinThreads;
+                if (strKey == "nScriptCheckThreads") ssValue >> nScriptCheckThreads;
+                if (strKey == "nKeyPoolSize")       ssValue >> nKeyPoolSize;
+                if (strKey == "nDbCacheSize")       ssValue >> nDbCacheSize;
                 if (strKey == "nTransactionFee")    ssValue >> nTransactionFee;
                 if (strKey == "addrIncoming")       ssValue >> addrIncoming;
             }
@@ -639,6 +1086,13 @@ bool CWalletDB::LoadWallet(vector<unsigned char>& vchDefaultKeyRet)
     }
 
     printf("fGenerateBitcoins = %d\n", fGenerateBitcoins);
+    printf("nMinerThreads = %d\n", nMinerThreads);
+    printf("fMinerPinThreads = %d\n", fMinerPinThreads);
+    printf("nScriptCheckThreads = %d\n", nScriptCheckThreads);
+    nKeyPoolSize = min(max(nKeyPoolSize, 0), MAX_KEY_POOL_SIZE);
+    printf("nKeyPoolSize = %d\n", nKeyPoolSize);
+    nDbCacheSize = min(max(nDbCacheSize, MIN_DB_CACHE_SIZE), MAX_DB_CACHE_SIZE);
+    printf("nDbCacheSize = %d\n", nDbCacheSize);
     printf("nTransactionFee = %I64d\n", nTransactionFee);
     printf("addrIncoming = %s\n", addrIncoming.ToString().c_str());
 
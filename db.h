@@ -12,6 +12,7 @@ class CUser;
 class CReview;
 class CAddress;
 class CWalletTx;
+class CTxDBChanges;
 
 extern map<string, string> mapAddressBook;
 extern bool fClient;
@@ -21,6 +22,13 @@ extern DbEnv dbenv;
 extern void DBFlush(bool fShutdown);
 
 
+// Data BDB hands back for a secure stream may be a private key, so it gets
+// wiped out of the read buffer once it's been unserialized.  Anything else
+// is left alone.
+inline void WipeDbt(const CDataStream*, Dbt&) { }
+inline void WipeDbt(const CSecureDataStream*, Dbt& dat) { memset(dat.get_data(), 0, dat.get_size()); }
+
+
 
 
 /**
@@ -33,7 +41,8 @@ extern void DBFlush(bool fShutdown);
  * Each instance of CDB represents a handler to the database. As such, copies of instances
  * of this class cannot be made, and the class cannot be used as the right-value in an
  * assignment. This class should instead just be instantiated (through a child class)
- * any time a new connection is needed.
+ * any time a new connection is needed.  That's cheap, the underlying Db handle for
+ * each file is opened once and shared by all the instances using it.
  * 
  */
 class CDB
@@ -52,6 +61,8 @@ protected:
     // is added, it is a child of the last added transaction in this vector
     // (if there is one).
     vector<DbTxn*> vTxn;
+    // Opened without write access:
+    bool fReadOnly;
 
     // The signature of the constructor:
     explicit CDB(const char* pszFile, const char* pszMode="r+", bool fTxn=false);
@@ -67,60 +78,64 @@ protected:
     // Read a value-value pair from the DB
     template<typename K, typename T>
     bool Read(const K& key, T& value)
+    {
+        return ReadStream<CDataStream>(key, value);
+    }
+
+    template<typename K, typename T>
+    bool Write(const K& key, const T& value, bool fOverwrite=true)
+    {
+        return WriteStream<CDataStream>(key, value, fOverwrite);
+    }
+
+    // Stream is the type the value goes through, CWalletDB uses
+    // CSecureDataStream for its private keys.  Keys are never secret.
+    template<typename Stream, typename K, typename T>
+    bool ReadStream(const K& key, T& value)
     {
         if (!pdb)
             return false;
 
         // Key
-        CDataStream ssKey(SER_DISK);
-        ssKey.reserve(1000);
-        ssKey << key;
-        Dbt datKey(&ssKey[0], ssKey.size());
+        ssKeyBuf.clear();
+        ssKeyBuf << key;
+        Dbt datKey(&ssKeyBuf[0], ssKeyBuf.size());
 
         // Read
         Dbt datValue;
-        datValue.set_flags(DB_DBT_MALLOC);
-        int ret = pdb->get(GetTxn(), &datKey, &datValue, 0);
-        memset(datKey.get_data(), 0, datKey.get_size());
-
-        // If nothing found in the DB for this key, return false
-        if (datValue.get_data() == NULL)
+        int ret = GetBuffered(datKey, datValue);
+        if (ret != 0)
             return false;
 
-        // Unserialize value
-        CDataStream ssValue((char*)datValue.get_data(), (char*)datValue.get_data() + datValue.get_size(), SER_DISK);
-        ssValue >> value;
-
-        // Clear and free memory
-        memset(datValue.get_data(), 0, datValue.get_size());
-        free(datValue.get_data());
-        return (ret == 0);
+        // Unserialize value straight out of the buffer, and clear it
+        // whether that works or throws
+        CDataStreamView ssValue(&vchValueBuf[0], &vchValueBuf[0] + datValue.get_size(), SER_DISK);
+        try
+        {
+            ssValue >> value;
+        }
+        catch (...)
+        {
+            WipeDbt((Stream*)NULL, datValue);
+            throw;
+        }
+        WipeDbt((Stream*)NULL, datValue);
+        return true;
     }
 
-    template<typename K, typename T>
-    bool Write(const K& key, const T& value, bool fOverwrite=true)
+    template<typename Stream, typename K, typename T>
+    bool WriteStream(const K& key, const T& value, bool fOverwrite=true)
     {
         if (!pdb)
             return false;
 
         // Key
-        CDataStream ssKey(SER_DISK);
-        ssKey.reserve(1000);
-        ssKey << key;
-        Dbt datKey(&ssKey[0], ssKey.size());
-
-        // Value
-        CDataStream ssValue(SER_DISK);
-        ssValue.reserve(10000);
-        ssValue << value;
-        Dbt datValue(&ssValue[0], ssValue.size());
+        ssKeyBuf.clear();
+        ssKeyBuf << key;
+        Dbt datKey(&ssKeyBuf[0], ssKeyBuf.size());
 
         // Write
-        int ret = pdb->put(GetTxn(), &datKey, &datValue, (fOverwrite ? 0 : DB_NOOVERWRITE));
-
-        // Clear memory in case it was a private key
-        memset(datKey.get_data(), 0, datKey.get_size());
-        memset(datValue.get_data(), 0, datValue.get_size());
+        int ret = PutValue(datKey, value, (fOverwrite ? 0 : DB_NOOVERWRITE), (Stream*)NULL);
         return (ret == 0);
     }
 
@@ -131,16 +146,12 @@ protected:
             return false;
 
         // Key
-        CDataStream ssKey(SER_DISK);
-        ssKey.reserve(1000);
-        ssKey << key;
-        Dbt datKey(&ssKey[0], ssKey.size());
+        ssKeyBuf.clear();
+        ssKeyBuf << key;
+        Dbt datKey(&ssKeyBuf[0], ssKeyBuf.size());
 
         // Erase
         int ret = pdb->del(GetTxn(), &datKey, 0);
-
-        // Clear memory
-        memset(datKey.get_data(), 0, datKey.get_size());
         return (ret == 0 || ret == DB_NOTFOUND);
     }
 
@@ -151,16 +162,12 @@ protected:
             return false;
 
         // Key
-        CDataStream ssKey(SER_DISK);
-        ssKey.reserve(1000);
-        ssKey << key;
-        Dbt datKey(&ssKey[0], ssKey.size());
+        ssKeyBuf.clear();
+        ssKeyBuf << key;
+        Dbt datKey(&ssKeyBuf[0], ssKeyBuf.size());
 
         // Exists
         int ret = pdb->exists(GetTxn(), &datKey, 0);
-
-        // Clear memory
-        memset(datKey.get_data(), 0, datKey.get_size());
         return (ret == 0);
     }
 
@@ -175,45 +182,114 @@ protected:
         return pcursor;
     }
 
-    int ReadAtCursor(Dbc* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags=DB_NEXT)
+    // Callers that keep ssKey and ssValue across calls don't allocate
+    // once the streams have grown to fit the largest record
+    template<typename Stream>
+    int ReadAtCursor(Dbc* pcursor, CDataStream& ssKey, Stream& ssValue, unsigned int fFlags=DB_NEXT)
     {
-        // Read at cursor
+        // Read at cursor into the buffers, the key and value passed in are
+        // where the cursor is set to for the flags that take them
+        bool fSetKey = (fFlags == DB_SET || fFlags == DB_SET_RANGE || fFlags == DB_GET_BOTH || fFlags == DB_GET_BOTH_RANGE);
+        bool fSetValue = (fFlags == DB_GET_BOTH || fFlags == DB_GET_BOTH_RANGE);
+        if (fSetKey)
+            SetBuffer(vchKeyBuf, ssKey);
+        if (fSetValue)
+            SetBuffer(vchValueBuf, ssValue);
         Dbt datKey;
-        if (fFlags == DB_SET || fFlags == DB_SET_RANGE || fFlags == DB_GET_BOTH || fFlags == DB_GET_BOTH_RANGE)
-        {
-            datKey.set_data(&ssKey[0]);
-            datKey.set_size(ssKey.size());
-        }
         Dbt datValue;
-        if (fFlags == DB_GET_BOTH || fFlags == DB_GET_BOTH_RANGE)
+        int ret;
+        loop
         {
-            datValue.set_data(&ssValue[0]);
-            datValue.set_size(ssValue.size());
+            PrepareBuffer(vchKeyBuf, datKey, fSetKey ? ssKey.size() : 0);
+            PrepareBuffer(vchValueBuf, datValue, fSetValue ? ssValue.size() : 0);
+            ret = pcursor->get(&datKey, &datValue, fFlags);
+            if (ret != DB_BUFFER_SMALL)
+                break;
+            // Nothing was read, grow whichever was short and try again
+            if (datKey.get_size() > vchKeyBuf.size())
+                vchKeyBuf.resize(datKey.get_size());
+            if (datValue.get_size() > vchValueBuf.size())
+                vchValueBuf.resize(datValue.get_size());
         }
-        datKey.set_flags(DB_DBT_MALLOC);
-        datValue.set_flags(DB_DBT_MALLOC);
-        int ret = pcursor->get(&datKey, &datValue, fFlags);
         if (ret != 0)
             return ret;
-        else if (datKey.get_data() == NULL || datValue.get_data() == NULL)
-            return 99999;
 
         // Convert to streams
         ssKey.SetType(SER_DISK);
         ssKey.clear();
-        ssKey.write((char*)datKey.get_data(), datKey.get_size());
+        ssKey.write(&vchKeyBuf[0], datKey.get_size());
         ssValue.SetType(SER_DISK);
         ssValue.clear();
-        ssValue.write((char*)datValue.get_data(), datValue.get_size());
+        ssValue.write(&vchValueBuf[0], datValue.get_size());
 
-        // Clear and free memory
-        memset(datKey.get_data(), 0, datKey.get_size());
-        memset(datValue.get_data(), 0, datValue.get_size());
-        free(datKey.get_data());
-        free(datValue.get_data());
+        // Clear memory
+        WipeDbt(&ssValue, datValue);
         return 0;
     }
 
+private:
+    // Scratch space reused by every read and write on this handle so a
+    // lookup doesn't have to allocate.  A CDB is only used by one thread.
+    CDataStream ssKeyBuf;
+    CDataStream ssValueBuf;
+    vector<char> vchKeyBuf;
+    vector<char> vchValueBuf;
+
+    template<typename Stream>
+    static void SetBuffer(vector<char>& vch, Stream& s)
+    {
+        if (vch.size() < s.size())
+            vch.resize(s.size());
+        if (!s.empty())
+            memcpy(&vch[0], &s[0], s.size());
+    }
+
+    static void PrepareBuffer(vector<char>& vch, Dbt& dat, unsigned int nSize)
+    {
+        if (vch.empty())
+            vch.resize(256);
+        dat.set_data(&vch[0]);
+        dat.set_size(nSize);
+        dat.set_ulen(vch.size());
+        dat.set_flags(DB_DBT_USERMEM);
+    }
+
+    // Reads the record for datKey into vchValueBuf, making it bigger and
+    // reading again if it didn't fit
+    int GetBuffered(Dbt& datKey, Dbt& datValue)
+    {
+        loop
+        {
+            PrepareBuffer(vchValueBuf, datValue, 0);
+            int ret = pdb->get(GetTxn(), &datKey, &datValue, 0);
+            if (ret != DB_BUFFER_SMALL)
+                return ret;
+            vchValueBuf.resize(datValue.get_size());
+        }
+    }
+
+    // Plain values are serialized into the reused buffer, secure ones into
+    // a stream of their own that wipes itself when it's freed
+    template<typename T>
+    int PutValue(Dbt& datKey, const T& value, unsigned int nFlags, CDataStream*)
+    {
+        ssValueBuf.clear();
+        ssValueBuf << value;
+        Dbt datValue(&ssValueBuf[0], ssValueBuf.size());
+        return pdb->put(GetTxn(), &datKey, &datValue, nFlags);
+    }
+
+    template<typename T>
+    int PutValue(Dbt& datKey, const T& value, unsigned int nFlags, CSecureDataStream*)
+    {
+        CSecureDataStream ssValue(SER_DISK);
+        ssValue.reserve(10000);
+        ssValue << value;
+        Dbt datValue(&ssValue[0], ssValue.size());
+        return pdb->put(GetTxn(), &datKey, &datValue, nFlags);
+    }
+
+protected:
     // Transaction handler that is used when reading/writing
     // so that a query can be added to a transaction.
     DbTxn* GetTxn()
@@ -298,14 +374,30 @@ public:
 
 
 
+/**
+ * Tx index entries, and the block index and best chain records that have to
+ * agree with them, go through a write-back cache shared by every CTxDB and
+ * reach the database in batches, see FlushCache.  Changes made inside a
+ * transaction are kept in pchanges and join the cache when it commits.
+ */
 class CTxDB : public CDB
 {
 public:
-    CTxDB(const char* pszMode="r+", bool fTxn=false) : CDB(!fClient ? "blkindex.dat" : NULL, pszMode, fTxn) { }
+    CTxDB(const char* pszMode="r+", bool fTxn=false);
+    ~CTxDB();
 private:
     CTxDB(const CTxDB&);
     void operator=(const CTxDB&);
+protected:
+    CTxDBChanges* pchanges;
+    CTxDBChanges& GetChanges();
+    bool WriteCache();
 public:
+    // Write-back cache
+    bool TxnCommit();
+    bool TxnAbort();
+    bool FlushCache();
+
     // Transaction-index related functions:
     bool ReadTxIndex(uint256 hash, CTxIndex& txindex);
     bool UpdateTxIndex(uint256 hash, const CTxIndex& txindex);
@@ -322,8 +414,9 @@ public:
     bool WriteBlockIndex(const CDiskBlockIndex& blockindex);
     bool EraseBlockIndex(uint256 hash);
     bool ReadHashBestChain(uint256& hashBestChain);
-    bool WriteHashBestChain(uint256 hashBestChain);
+    bool WriteHashBestChain(uint256 hashBestChain, unsigned int nBestChainTime);
     bool LoadBlockIndex();
+    bool UpgradeTxIndex();
 };
 
 
@@ -408,6 +501,19 @@ public:
 private:
     CWalletDB(const CWalletDB&);
     void operator=(const CWalletDB&);
+protected:
+    // Wallet records include private keys, they go through secure memory
+    template<typename K, typename T>
+    bool Read(const K& key, T& value)
+    {
+        return ReadStream<CSecureDataStream>(key, value);
+    }
+
+    template<typename K, typename T>
+    bool Write(const K& key, const T& value, bool fOverwrite=true)
+    {
+        return WriteStream<CSecureDataStream>(key, value, fOverwrite);
+    }
 public:
     bool ReadName(const string& strAddress, string& strName)
     {
@@ -464,6 +570,16 @@ public:
         return Write(string("defaultkey"), vchPubKey);
     }
 
+    bool WritePool(int64 nIndex, const vector<unsigned char>& vchPubKey)
+    {
+        return Write(make_pair(string("pool"), nIndex), vchPubKey);
+    }
+
+    bool ErasePool(int64 nIndex)
+    {
+        return Erase(make_pair(string("pool"), nIndex));
+    }
+
     template<typename T>
     bool ReadSetting(const string& strKey, T& value)
     {
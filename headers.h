@@ -49,12 +49,15 @@
 #include <boost/tuple/tuple_comparison.hpp>
 #include <boost/tuple/tuple_io.hpp>
 #include <boost/array.hpp>
+#include <boost/unordered_set.hpp>
 #pragma hdrstop
 using namespace std;
 using namespace boost;
 
 
 
+#include "sha.h"
+#include "secp256k1.h"
 #include "serialize.h"
 #include "uint256.h"
 #include "util.h"
@@ -45,12 +45,28 @@ class CKey
 protected:
     EC_KEY* pkey;
 
+    // The public key parsed for secp256k1.cpp, if it's in a form it takes
+    secp256k1::PubKey pubkeyNative;
+    bool fPubKeyNative;
+
 public:
     CKey()
     {
         pkey = EC_KEY_new_by_curve_name(NID_secp256k1);
         if (pkey == NULL)
             throw key_error("CKey::CKey() : EC_KEY_new_by_curve_name failed");
+        fPubKeyNative = false;
+    }
+
+    // Takes over one reference to an already set up key, such as one
+    // shared out of the pubkey cache, along with its native form if it has
+    // one.  It mustn't be changed through here.
+    CKey(EC_KEY* pkeyIn, const secp256k1::PubKey* ppubkeyNative)
+    {
+        pkey = pkeyIn;
+        fPubKeyNative = (ppubkeyNative != NULL);
+        if (fPubKeyNative)
+            pubkeyNative = *ppubkeyNative;
     }
 
     CKey(const CKey& b)
@@ -58,12 +74,16 @@ public:
         pkey = EC_KEY_dup(b.pkey);
         if (pkey == NULL)
             throw key_error("CKey::CKey(const CKey&) : EC_KEY_dup failed");
+        pubkeyNative = b.pubkeyNative;
+        fPubKeyNative = b.fPubKeyNative;
     }
 
     CKey& operator=(const CKey& b)
     {
         if (!EC_KEY_copy(pkey, b.pkey))
             throw key_error("CKey::operator=(const CKey&) : EC_KEY_copy failed");
+        pubkeyNative = b.pubkeyNative;
+        fPubKeyNative = b.fPubKeyNative;
         return (*this);
     }
 
@@ -74,8 +94,29 @@ public:
 
     void MakeNewKey()
     {
-        if (!EC_KEY_generate_key(pkey))
-            throw key_error("CKey::MakeNewKey() : EC_KEY_generate_key failed");
+        // Pick the private key here and work out the public key with
+        // secp256k1.cpp's fixed-base tables instead of EC_KEY_generate_key
+        unsigned char pchPrivKey[32];
+        unsigned char pchPubKey[65];
+        do
+        {
+            if (RAND_bytes(pchPrivKey, sizeof(pchPrivKey)) != 1)
+                throw key_error("CKey::MakeNewKey() : RAND_bytes failed");
+        }
+        while (!secp256k1::GetPubKey(pchPubKey, pchPrivKey));
+
+        BIGNUM* bn = BN_bin2bn(pchPrivKey, sizeof(pchPrivKey), NULL);
+        memset(pchPrivKey, 0, sizeof(pchPrivKey));
+        if (bn == NULL)
+            throw key_error("CKey::MakeNewKey() : BN_bin2bn failed");
+        bool fOk = EC_KEY_set_private_key(pkey, bn);
+        BN_clear_free(bn);
+        if (!fOk)
+            throw key_error("CKey::MakeNewKey() : EC_KEY_set_private_key failed");
+        const unsigned char* pbegin = pchPubKey;
+        if (!o2i_ECPublicKey(&pkey, &pbegin, sizeof(pchPubKey)))
+            throw key_error("CKey::MakeNewKey() : o2i_ECPublicKey failed");
+        fPubKeyNative = secp256k1::ParsePubKey(pubkeyNative, pchPubKey, sizeof(pchPubKey));
     }
 
     bool SetPrivKey(const CPrivKey& vchPrivKey)
@@ -83,6 +124,7 @@ public:
         const unsigned char* pbegin = &vchPrivKey[0];
         if (!d2i_ECPrivateKey(&pkey, &pbegin, vchPrivKey.size()))
             return false;
+        fPubKeyNative = false;
         return true;
     }
 
@@ -103,6 +145,7 @@ public:
         const unsigned char* pbegin = &vchPubKey[0];
         if (!o2i_ECPublicKey(&pkey, &pbegin, vchPubKey.size()))
             return false;
+        fPubKeyNative = secp256k1::ParsePubKey(pubkeyNative, &vchPubKey[0], vchPubKey.size());
         return true;
     }
 
@@ -132,6 +175,14 @@ public:
 
     bool Verify(uint256 hash, const vector<unsigned char>& vchSig)
     {
+        // Signatures that aren't strict DER are left to OpenSSL
+        if (fPubKeyNative)
+        {
+            int nResult = secp256k1::Verify(pubkeyNative, (unsigned char*)&hash, vchSig.empty() ? NULL : &vchSig[0], vchSig.size());
+            if (nResult != secp256k1::VERIFY_UNSUPPORTED)
+                return (nResult == secp256k1::VERIFY_VALID);
+        }
+
         // -1 = error, 0 = bad sig, 1 = good
         if (ECDSA_verify(0, (unsigned char*)&hash, sizeof(hash), &vchSig[0], vchSig.size(), pkey) != 1)
             return false;
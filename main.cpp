@@ -3,7 +3,6 @@
 // file license.txt or http://www.opensource.org/licenses/mit-license.php.
 
 #include "headers.h"
-#include "sha.h"
 
 
 
@@ -52,11 +51,19 @@ map<uint160, vector<unsigned char> > mapPubKeys;
 CCriticalSection cs_mapKeys;
 CKey keyUser;
 
+map<int64, vector<unsigned char> > mapKeyPool;
+CCriticalSection cs_mapKeyPool;
+
 string strSetDataDir;
 int nDropMessagesTest = 0;
 
 // Settings
 int fGenerateBitcoins;
+int nMinerThreads = 0;
+int fMinerPinThreads = false;
+int nScriptCheckThreads = 0;
+int nKeyPoolSize = 100;
+int nDbCacheSize = 25;
 int64 nTransactionFee = 0;
 CAddress addrIncoming;
 
@@ -97,6 +104,7 @@ bool AddKey(const CKey& key)
          * hash160 of the public key to the public key.
          */
         mapPubKeys[Hash160(key.GetPubKey())] = key.GetPubKey();
+        AddKeyToIndex(key.GetPubKey());
     }
     // Write the public and private key to the wallet.dat file:
     return CWalletDB().WriteKey(key.GetPubKey(), key.GetPrivKey());
@@ -108,6 +116,11 @@ bool AddKey(const CKey& key)
  */
 vector<unsigned char> GenerateNewKey()
 {
+    // Usually there's one waiting in the key pool
+    vector<unsigned char> vchPubKey;
+    if (GetKeyFromKeyPool(vchPubKey))
+        return vchPubKey;
+
     // Make the new key
     CKey key;
     key.MakeNewKey();
@@ -118,6 +131,85 @@ vector<unsigned char> GenerateNewKey()
     return key.GetPubKey();
 }
 
+/**
+ * The key pool is a stock of keys made ahead of time by ThreadKeyPool, so
+ * GenerateNewKey doesn't have to make one and write it out on the
+ * caller's thread.  Pool keys are already in mapKeys and wallet.dat like
+ * any other key, and each also has a "pool" record that's erased when
+ * it's handed out, oldest first.
+ */
+bool GetKeyFromKeyPool(vector<unsigned char>& vchPubKeyRet)
+{
+    int64 nIndex = 0;
+    CRITICAL_BLOCK(cs_mapKeyPool)
+    {
+        if (mapKeyPool.empty())
+            return false;
+        map<int64, vector<unsigned char> >::iterator mi = mapKeyPool.begin();
+        nIndex = (*mi).first;
+        vchPubKeyRet = (*mi).second;
+        mapKeyPool.erase(mi);
+    }
+    // A pool record whose private key is gone is no use either, erase it
+    // the same so it isn't loaded back next start
+    bool fHaveKey = false;
+    CRITICAL_BLOCK(cs_mapKeys)
+        fHaveKey = (mapKeys.count(vchPubKeyRet) > 0);
+    CWalletDB().ErasePool(nIndex);
+    return fHaveKey;
+}
+
+bool TopUpKeyPool()
+{
+    static int64 nNextIndex = 1;
+    loop
+    {
+        int64 nIndex = 0;
+        CRITICAL_BLOCK(cs_mapKeyPool)
+        {
+            if (mapKeyPool.size() >= (unsigned int)max(nKeyPoolSize, 0))
+                return true;
+            // Never reuse an index, its old record may not be erased yet
+            if (!mapKeyPool.empty())
+                nNextIndex = max(nNextIndex, (*mapKeyPool.rbegin()).first + 1);
+            nIndex = nNextIndex++;
+        }
+        if (fShutdown)
+            return true;
+
+        CKey key;
+        key.MakeNewKey();
+        if (!AddKey(key))
+            return false;
+        vector<unsigned char> vchPubKey = key.GetPubKey();
+        if (!CWalletDB().WritePool(nIndex, vchPubKey))
+            return false;
+        CRITICAL_BLOCK(cs_mapKeyPool)
+            mapKeyPool[nIndex] = vchPubKey;
+    }
+}
+
+void ThreadKeyPool(void* parg)
+{
+    vfThreadRunning[4] = true;
+    SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_BELOW_NORMAL);
+    loop
+    {
+        CheckForShutdown(4);
+        try
+        {
+            if (!TopUpKeyPool())
+                printf("ThreadKeyPool() : TopUpKeyPool failed\n");
+        }
+        CATCH_PRINT_EXCEPTION("ThreadKeyPool()")
+        for (int i = 0; i < 10; i++)
+        {
+            Sleep(100);
+            CheckForShutdown(4);
+        }
+    }
+}
+
 
 
 
@@ -760,6 +852,89 @@ bool CBlock::ReadFromDisk(const CBlockIndex* pblockindex, bool fReadTransactions
     return ReadFromDisk(pblockindex->nFile, pblockindex->nBlockPos, fReadTransactions);
 }
 
+/**
+ * A block's transactions split into nSlices slices for the bottom row of
+ * the merkle tree.  Each thread on it takes the next unclaimed slice until
+ * they're all gone.
+ */
+struct CMerkleLeafJob
+{
+    const vector<CTransaction>* pvtx;
+    uint256* phashOut;
+    int nSlices;
+    int nPerSlice;
+    volatile LONG nNext;
+};
+
+static void HashMerkleLeafSlices(void* parg)
+{
+    CMerkleLeafJob* pjob = (CMerkleLeafJob*)parg;
+    int nTx = pjob->pvtx->size();
+    loop
+    {
+        int nSlice = InterlockedIncrement(&pjob->nNext) - 1;
+        if (nSlice >= pjob->nSlices)
+            break;
+        int nEnd = min((nSlice + 1) * pjob->nPerSlice, nTx);
+        for (int i = nSlice * pjob->nPerSlice; i < nEnd; i++)
+            pjob->phashOut[i] = (*pjob->pvtx)[i].GetHash();
+    }
+}
+
+/**
+ * Fills phashOut with the hash of every transaction in vtx.  Big blocks
+ * are split across the calling thread and up to MAX_MERKLE_THREADS-1
+ * threads of the worker pool.
+ */
+void HashMerkleLeaves(const vector<CTransaction>& vtx, uint256* phashOut)
+{
+    int nTx = vtx.size();
+    int nThreads = 1;
+    if (nTx >= MERKLE_PARALLEL_MIN_TX)
+        nThreads = min(GetNumProcessors(), MAX_MERKLE_THREADS);
+
+    CMerkleLeafJob job;
+    job.pvtx = &vtx;
+    job.phashOut = phashOut;
+    job.nSlices = nThreads;
+    job.nPerSlice = (nTx + nThreads - 1) / nThreads;
+    job.nNext = 0;
+    RunOnWorkerPool(HashMerkleLeafSlices, &job, nThreads - 1);
+}
+
+uint256 CBlock::BuildMerkleTree() const
+{
+    vMerkleTree.clear();
+    vMerkleTree.resize(vtx.size());
+    if (!vtx.empty())
+        HashMerkleLeaves(vtx, &vMerkleTree[0]);
+    int j = 0;
+    /**
+     * Construct the tree by going through each level, which is half
+     * the size of the previous level.
+     */
+    for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
+    {
+        /**
+         * The pairs of nodes on a level already sit next to each other
+         * in vMerkleTree, 64 bytes per pair, so the whole level is
+         * hashed in one batch by the multi-lane SHA-256 kernel.
+         */
+        int nPairs = nSize / 2;
+        vMerkleTree.resize(j + nSize + (nSize + 1) / 2);
+        CryptoPP::SHA256Lanes::DoubleHash64((unsigned char*)&vMerkleTree[j + nSize], (const unsigned char*)&vMerkleTree[j], nPairs);
+
+        // An odd node out is paired with itself
+        if (nSize & 1)
+        {
+            const uint256& hashLast = vMerkleTree[j + nSize - 1];
+            vMerkleTree[j + nSize + nPairs] = Hash(BEGIN(hashLast), END(hashLast), BEGIN(hashLast), END(hashLast));
+        }
+        j += nSize;
+    }
+    return (vMerkleTree.empty() ? 0 : vMerkleTree.back());
+}
+
 uint256 GetOrphanRoot(const CBlock* pblock)
 {
     // Work back to the first block in the orphan chain
@@ -824,6 +999,19 @@ unsigned int GetNextWorkRequired(const CBlockIndex* pindexLast)
     return bnNew.GetCompact();
 }
 
+bool IsInitialBlockDownload(unsigned int nBestTime)
+{
+    // Still catching up as long as the best block is more than a day old
+    return (nBestTime < GetTime() - 24 * 60 * 60);
+}
+
+bool IsInitialBlockDownload()
+{
+    if (pindexBest == NULL)
+        return true;
+    return IsInitialBlockDownload(pindexBest->nTime);
+}
+
 
 
 
@@ -846,11 +1034,11 @@ bool CTransaction::DisconnectInputs(CTxDB& txdb)
             if (!txdb.ReadTxIndex(prevout.hash, txindex))
                 return error("DisconnectInputs() : ReadTxIndex failed");
 
-            if (prevout.n >= txindex.vSpent.size())
+            if (prevout.n >= txindex.nOutputs)
                 return error("DisconnectInputs() : prevout.n out of range");
 
             // Mark outpoint as not spent
-            txindex.vSpent[prevout.n].SetNull();
+            txindex.SetSpent(prevout.n, false);
 
             // Write back
             txdb.UpdateTxIndex(prevout.hash, txindex);
@@ -865,11 +1053,21 @@ bool CTransaction::DisconnectInputs(CTxDB& txdb)
 }
 
 
-bool CTransaction::ConnectInputs(CTxDB& txdb, map<uint256, CTxIndex>& mapTestPool, CDiskTxPos posThisTx, int nHeight, int64& nFees, bool fBlock, bool fMiner, int64 nMinFee)
+/**
+ * With pqueue the signature checks are only queued, and the caller has to
+ * Run() the queue before trusting the result.  Without it they're checked
+ * here before returning.
+ */
+bool CTransaction::ConnectInputs(CTxDB& txdb, map<uint256, CTxIndex>& mapTestPool, CDiskTxPos posThisTx, int nHeight, int64& nFees, bool fBlock, bool fMiner, int64 nMinFee, CScriptCheckQueue* pqueue)
 {
     // Take over previous transactions' spent pointers
     if (!IsCoinBase())
     {
+        CScriptCheckQueue queueLocal;
+        CScriptCheckQueue& queue = (pqueue ? *pqueue : queueLocal);
+        // Shared by the signature checks of all the inputs
+        const CSignatureHashCache* psighashcache = queue.AddSigHashCache(*this);
+
         int64 nValueIn = 0;
         for (int i = 0; i < vin.size(); i++)
         {
@@ -903,7 +1101,7 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, map<uint256, CTxIndex>& mapTestPoo
                     txPrev = mapTransactions[prevout.hash];
                 }
                 if (!fFound)
-                    txindex.vSpent.resize(txPrev.vout.size());
+                    txindex = CTxIndex(txindex.pos, txPrev.vout.size());
             }
             else
             {
@@ -912,8 +1110,8 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, map<uint256, CTxIndex>& mapTestPoo
                     return error("ConnectInputs() : %s ReadFromDisk prev tx %s failed", GetHash().ToString().substr(0,6).c_str(),  prevout.hash.ToString().substr(0,6).c_str());
             }
 
-            if (prevout.n >= txPrev.vout.size() || prevout.n >= txindex.vSpent.size())
-                return error("ConnectInputs() : %s prevout.n out of range %d %d %d", GetHash().ToString().substr(0,6).c_str(), prevout.n, txPrev.vout.size(), txindex.vSpent.size());
+            if (prevout.n >= txPrev.vout.size() || prevout.n >= txindex.nOutputs)
+                return error("ConnectInputs() : %s prevout.n out of range %d %d %d", GetHash().ToString().substr(0,6).c_str(), prevout.n, txPrev.vout.size(), txindex.nOutputs);
 
             // If prev is coinbase, check that it's matured
             if (txPrev.IsCoinBase())
@@ -922,15 +1120,15 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, map<uint256, CTxIndex>& mapTestPoo
                         return error("ConnectInputs() : tried to spend coinbase at depth %d", nBestHeight - pindex->nHeight);
 
             // Verify signature
-            if (!VerifySignature(txPrev, *this, i))
+            if (!queue.Add(txPrev, *this, i, psighashcache))
                 return error("ConnectInputs() : %s VerifySignature failed", GetHash().ToString().substr(0,6).c_str());
 
             // Check for conflicts
-            if (!txindex.vSpent[prevout.n].IsNull())
-                return fMiner ? false : error("ConnectInputs() : %s prev tx already used at %s", GetHash().ToString().substr(0,6).c_str(), txindex.vSpent[prevout.n].ToString().c_str());
+            if (txindex.IsSpent(prevout.n))
+                return fMiner ? false : error("ConnectInputs() : %s prev tx %s output %d already spent", GetHash().ToString().substr(0,6).c_str(), prevout.hash.ToString().substr(0,6).c_str(), prevout.n);
 
             // Mark outpoints as spent
-            txindex.vSpent[prevout.n] = posThisTx;
+            txindex.SetSpent(prevout.n, true);
 
             // Write back
             if (fBlock)
@@ -941,6 +1139,9 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, map<uint256, CTxIndex>& mapTestPoo
             nValueIn += txPrev.vout[prevout.n].nValue;
         }
 
+        if (!pqueue && !queueLocal.Run(1))
+            return error("ConnectInputs() : %s VerifySignature failed", GetHash().ToString().substr(0,6).c_str());
+
         // Tally transaction fees
         int64 nTxFee = nValueIn - GetValueOut();
         if (nTxFee < 0)
@@ -974,6 +1175,7 @@ bool CTransaction::ClientConnectInputs()
     // Take over previous transactions' spent pointers
     CRITICAL_BLOCK(cs_mapTransactions)
     {
+        CSignatureHashCache sighashcache(*this);
         int64 nValueIn = 0;
         for (int i = 0; i < vin.size(); i++)
         {
@@ -987,7 +1189,7 @@ bool CTransaction::ClientConnectInputs()
                 return false;
 
             // Verify signature
-            if (!VerifySignature(txPrev, *this, i))
+            if (!VerifySignature(txPrev, *this, i, 0, &sighashcache))
                 return error("ConnectInputs() : VerifySignature failed");
 
             ///// this is redundant with the mapNextTx stuff, not sure which I want to get rid of
@@ -1037,15 +1239,21 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex)
 
     map<uint256, CTxIndex> mapUnused;
     int64 nFees = 0;
+    CScriptCheckQueue queue;
     foreach(CTransaction& tx, vtx)
     {
         CDiskTxPos posThisTx(pindex->nFile, pindex->nBlockPos, nTxPos);
-        nTxPos += ::GetSerializeSize(tx, SER_DISK);
+        nTxPos += tx.GetTxSize();
 
-        if (!tx.ConnectInputs(txdb, mapUnused, posThisTx, pindex->nHeight, nFees, true, false))
+        if (!tx.ConnectInputs(txdb, mapUnused, posThisTx, pindex->nHeight, nFees, true, false, 0, &queue))
             return false;
     }
 
+    // Now verify every signature in the block at once
+    int nThreads = (nScriptCheckThreads > 0 ? nScriptCheckThreads : GetNumProcessors());
+    if (!queue.Run(min(nThreads, MAX_SCRIPTCHECK_THREADS)))
+        return error("ConnectBlock() : VerifySignature failed");
+
     if (vtx[0].GetValueOut() > GetBlockValue(nFees))
         return false;
 
@@ -1137,7 +1345,7 @@ bool Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
         foreach(const CTransaction& tx, block.vtx)
             vDelete.push_back(tx);
     }
-    if (!txdb.WriteHashBestChain(pindexNew->GetBlockHash()))
+    if (!txdb.WriteHashBestChain(pindexNew->GetBlockHash(), pindexNew->nTime))
         return error("Reorganize() : WriteHashBestChain failed");
 
     // Commit now because resurrecting could take some time
@@ -1195,12 +1403,12 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
         if (pindexGenesisBlock == NULL && hash == hashGenesisBlock)
         {
             pindexGenesisBlock = pindexNew;
-            txdb.WriteHashBestChain(hash);
+            txdb.WriteHashBestChain(hash, nTime);
         }
         else if (hashPrevBlock == hashBestChain)
         {
             // Adding to current best branch
-            if (!ConnectBlock(txdb, pindexNew) || !txdb.WriteHashBestChain(hash))
+            if (!ConnectBlock(txdb, pindexNew) || !txdb.WriteHashBestChain(hash, nTime))
             {
                 txdb.TxnAbort();
                 pindexNew->EraseBlockFromDisk();
@@ -1543,6 +1751,13 @@ FILE* AppendBlockFile(unsigned int& nFileRet)
 
 bool LoadBlockIndex(bool fAllowNew)
 {
+    //
+    // Convert tx index records from before the spent bitmap, this needs a
+    // handle that can write
+    //
+    if (!CTxDB("cr+").UpgradeTxIndex())
+        return error("LoadBlockIndex() : UpgradeTxIndex failed");
+
     //
     // Load block index
     //
@@ -1734,7 +1949,7 @@ bool AlreadyHave(CTxDB& txdb, const CInv& inv)
 
 bool ProcessMessages(CNode* pfrom)
 {
-    CDataStream& vRecv = pfrom->vRecv;
+    CDataQueue& vRecv = pfrom->vRecv;
     if (vRecv.empty())
         return true;
     printf("ProcessMessages(%d bytes)\n", vRecv.size());
@@ -1749,46 +1964,57 @@ bool ProcessMessages(CNode* pfrom)
 
     loop
     {
-        // Scan for message start
-        CDataStream::iterator pstart = search(vRecv.begin(), vRecv.end(), BEGIN(pchMessageStart), END(pchMessageStart));
-        if (vRecv.end() - pstart < sizeof(CMessageHeader))
+        // Scan for message start, a run of contiguous bytes at a time
+        unsigned int nSkipped = 0;
+        while (vRecv.size() >= sizeof(CMessageHeader))
         {
-            if (vRecv.size() > sizeof(CMessageHeader))
-            {
-                printf("\n\nPROCESSMESSAGE MESSAGESTART NOT FOUND\n\n");
-                vRecv.erase(vRecv.begin(), vRecv.end() - sizeof(CMessageHeader));
-            }
-            break;
+            vRecv.Linearize(sizeof(CMessageHeader));
+            unsigned int nRun;
+            const char* pbegin = vRecv.GetFront(nRun);
+            const char* pstart = search(pbegin, pbegin + nRun, BEGIN(pchMessageStart), END(pchMessageStart));
+            if (pstart == pbegin)
+                break;
+            // If it's not in this run, keep the tail in case it starts there
+            unsigned int nSkip = (pstart != pbegin + nRun ? pstart - pbegin : nRun - (sizeof(pchMessageStart) - 1));
+            vRecv.ignore(nSkip);
+            nSkipped += nSkip;
         }
-        if (pstart - vRecv.begin() > 0)
-            printf("\n\nPROCESSMESSAGE SKIPPED %d BYTES\n\n", pstart - vRecv.begin());
-        vRecv.erase(vRecv.begin(), pstart);
+        if (nSkipped > 0)
+            printf("\n\nPROCESSMESSAGE SKIPPED %d BYTES\n\n", nSkipped);
+        if (vRecv.size() < sizeof(CMessageHeader))
+            break;
 
-        // Read header
+        // Read header, it stays in vRecv until the whole message is there
         CMessageHeader hdr;
-        vRecv >> hdr;
+        const char* pchHeader = vRecv.Linearize(sizeof(hdr));
+        CDataStreamView vHeader(pchHeader, pchHeader + sizeof(hdr), vRecv.nType, vRecv.nVersion);
+        vHeader >> hdr;
         if (!hdr.IsValid())
         {
             printf("\n\nPROCESSMESSAGE: ERRORS IN HEADER %s\n\n\n", hdr.GetCommand().c_str());
+            vRecv.ignore(sizeof(hdr));
             continue;
         }
         string strCommand = hdr.GetCommand();
 
         // Message size
         unsigned int nMessageSize = hdr.nMessageSize;
-        if (nMessageSize > vRecv.size())
+        if (nMessageSize > vRecv.size() - sizeof(hdr))
         {
-            // Rewind and wait for rest of message
+            // Wait for rest of message, with room for it to arrive in one
+            // piece unless it's big enough that we'd rather copy it later
             ///// need a mechanism to give up waiting for overlong message size error
             printf("MESSAGE-BREAK\n");
-            vRecv.insert(vRecv.begin(), BEGIN(hdr), END(hdr));
+            vRecv.reserve(min((unsigned int)sizeof(hdr) + nMessageSize, (unsigned int)0x100000));
             Sleep(100);
             break;
         }
+        vRecv.ignore(sizeof(hdr));
 
-        // Copy message to its own buffer
-        CDataStream vMsg(vRecv.begin(), vRecv.begin() + nMessageSize, vRecv.nType, vRecv.nVersion);
-        vRecv.ignore(nMessageSize);
+        // Read the message where it sits in vRecv, cs_vRecv keeps it from
+        // being added to while we're at it
+        const char* pchMsg = vRecv.Linearize(nMessageSize);
+        CDataStreamView vMsg(pchMsg, pchMsg + nMessageSize, vRecv.nType, vRecv.nVersion);
 
         // Process message
         bool fRet = false;
@@ -1800,18 +2026,18 @@ bool ProcessMessages(CNode* pfrom)
             CheckForShutdown(2);
         }
         CATCH_PRINT_EXCEPTION("ProcessMessage()")
+        vRecv.ignore(nMessageSize);
         if (!fRet)
             printf("ProcessMessage(%s, %d bytes) from %s to %s FAILED\n", strCommand.c_str(), nMessageSize, pfrom->addr.ToString().c_str(), addrLocalHost.ToString().c_str());
     }
 
-    vRecv.Compact();
     return true;
 }
 
 
 
 
-bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
+bool ProcessMessage(CNode* pfrom, string strCommand, CDataStreamView& vRecv)
 {
     static map<unsigned int, vector<unsigned char> > mapReuseKey;
     printf("received: %-12s (%d bytes)  ", strCommand.c_str(), vRecv.size());
@@ -1992,7 +2218,7 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     else if (strCommand == "tx")
     {
         vector<uint256> vWorkQueue;
-        CDataStream vMsg(vRecv);
+        CDataStream vMsg(vRecv.begin(), vRecv.end(), vRecv.nType, vRecv.nVersion);
         CTransaction tx;
         vRecv >> tx;
 
@@ -2044,7 +2270,7 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
     else if (strCommand == "review")
     {
-        CDataStream vMsg(vRecv);
+        CDataStream vMsg(vRecv.begin(), vRecv.end(), vRecv.nType, vRecv.nVersion);
         CReview review;
         vRecv >> review;
 
@@ -2154,7 +2380,11 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             }
         }
         if (!tracker.IsNull())
-            tracker.fn(tracker.param1, vRecv);
+        {
+            CDataStream vMsg(vRecv.begin(), vRecv.end(), vRecv.nType, vRecv.nVersion);
+            tracker.fn(tracker.param1, vMsg);
+            vRecv.ignore(vRecv.size() - vMsg.size());
+        }
     }
 
 
@@ -2305,28 +2535,207 @@ void BlockSHA256(const void* pin, unsigned int nBlocks, void* pout)
     }
 }
 
+/**
+ * SHA-256 chaining state after the first 64 byte chunk of pin, in the
+ * word order CryptoPP::SHA256::Transform works in.  The first chunk of a
+ * block header doesn't contain nTime or nNonce, so the miner computes
+ * this once per block and only hashes the tail for each nonce.
+ */
+void SHA256Midstate(const void* pin, unsigned int* pstate)
+{
+    unsigned int* pinput = (unsigned int*)pin;
+    CryptoPP::SHA256::InitState(pstate);
+    if (*(char*)&detectlittleendian != 0)
+    {
+        unsigned int pbuf[16];
+        for (int i = 0; i < 16; i++)
+            pbuf[i] = ByteReverse(pinput[i]);
+        CryptoPP::SHA256::Transform(pstate, pbuf);
+    }
+    else
+        CryptoPP::SHA256::Transform(pstate, pinput);
+}
+
+/**
+ * Same as BlockSHA256 for nLanes equal length buffers at once, hashed
+ * side by side through the multi-lane SIMD kernel in sha.cpp.  If
+ * pmidstate is given every lane continues from that state, as returned
+ * by SHA256Midstate, instead of starting from the SHA-256 IV.
+ */
+void BlockSHA256Lanes(const void* const* ppin, unsigned int nBlocks, void* const* ppout, unsigned int nLanes, const unsigned int* pmidstate=NULL)
+{
+    assert(nLanes <= CryptoPP::SHA256Lanes::MAX_LANES);
+    unsigned int pbuf[CryptoPP::SHA256Lanes::MAX_LANES][16];
+    unsigned int* pstate[CryptoPP::SHA256Lanes::MAX_LANES];
+    const unsigned int* pdata[CryptoPP::SHA256Lanes::MAX_LANES];
+
+    for (int l = 0; l < nLanes; l++)
+    {
+        pstate[l] = (unsigned int*)ppout[l];
+        if (pmidstate)
+            memcpy(pstate[l], pmidstate, 8 * sizeof(unsigned int));
+        else
+            CryptoPP::SHA256::InitState(pstate[l]);
+    }
+
+    bool fLittleEndian = (*(char*)&detectlittleendian != 0);
+    for (int n = 0; n < nBlocks; n++)
+    {
+        for (int l = 0; l < nLanes; l++)
+        {
+            const unsigned int* pinput = (const unsigned int*)ppin[l] + n * 16;
+            if (fLittleEndian)
+            {
+                for (int i = 0; i < 16; i++)
+                    pbuf[l][i] = ByteReverse(pinput[i]);
+                pdata[l] = pbuf[l];
+            }
+            else
+                pdata[l] = pinput;
+        }
+        CryptoPP::SHA256Lanes::Transform(pstate, pdata, nLanes);
+    }
+
+    if (fLittleEndian)
+        for (int l = 0; l < nLanes; l++)
+            for (int i = 0; i < 8; i++)
+                pstate[l][i] = ByteReverse(pstate[l][i]);
+}
+
+
+/**
+ * The transactions for the next block, shared by all the miner threads so
+ * the memory pool is only walked once per change instead of once per
+ * thread.  Rebuilt when pindexBest or nTransactionsUpdated moves on.
+ */
+struct CMinerTemplate
+{
+    CBlockIndex* pindexPrev;
+    unsigned int nTransactionsUpdated;
+    unsigned int nBits;
+    int64 nFees;
+    vector<CTransaction> vtx;   // everything but the coinbase
+};
+
+static CMinerTemplate minerTemplate;
+static bool fMinerTemplateValid = false;
+static CCriticalSection cs_minerTemplate;
+
+array<double, MAX_MINER_THREADS> vMinerHashesPerSec;
+
+void GetMinerTemplate(CMinerTemplate& templateRet)
+{
+    CRITICAL_BLOCK(cs_minerTemplate)
+    {
+        if (!fMinerTemplateValid || minerTemplate.pindexPrev != pindexBest || minerTemplate.nTransactionsUpdated != nTransactionsUpdated)
+        {
+            CMinerTemplate& tmpl = minerTemplate;
+            tmpl.nTransactionsUpdated = nTransactionsUpdated;
+            tmpl.pindexPrev = pindexBest;
+            tmpl.nBits = GetNextWorkRequired(tmpl.pindexPrev);
+            tmpl.nFees = 0;
+            tmpl.vtx.clear();
+
+            // Collect the latest transactions into the block
+            CRITICAL_BLOCK(cs_main)
+            CRITICAL_BLOCK(cs_mapTransactions)
+            {
+                CTxDB txdb("r");
+                map<uint256, CTxIndex> mapTestPool;
+                vector<char> vfAlreadyAdded(mapTransactions.size());
+                bool fFoundSomething = true;
+                unsigned int nBlockSize = 0;
+                while (fFoundSomething && nBlockSize < MAX_SIZE/2)
+                {
+                    fFoundSomething = false;
+                    unsigned int n = 0;
+                    for (map<uint256, CTransaction>::iterator mi = mapTransactions.begin(); mi != mapTransactions.end(); ++mi, ++n)
+                    {
+                        if (vfAlreadyAdded[n])
+                            continue;
+                        CTransaction& tx = (*mi).second;
+                        if (tx.IsCoinBase() || !tx.IsFinal())
+                            continue;
+
+                        // Transaction fee requirements, mainly only needed for flood control
+                        // Under 10K (about 80 inputs) is free for first 100 transactions
+                        // Base rate is 0.01 per KB
+                        // (the +1 counts the coinbase every block starts with)
+                        int64 nMinFee = tx.GetMinFee(tmpl.vtx.size() + 1 < 100);
+
+                        map<uint256, CTxIndex> mapTestPoolTmp(mapTestPool);
+                        if (!tx.ConnectInputs(txdb, mapTestPoolTmp, CDiskTxPos(1,1,1), 0, tmpl.nFees, false, true, nMinFee))
+                            continue;
+                        swap(mapTestPool, mapTestPoolTmp);
+
+                        tmpl.vtx.push_back(tx);
+                        nBlockSize += tx.GetTxSize();
+                        vfAlreadyAdded[n] = true;
+                        fFoundSomething = true;
+                    }
+                }
+            }
+            fMinerTemplateValid = true;
+        }
+        templateRet = minerTemplate;
+    }
+}
+
+int GetMinerThreadCount()
+{
+    int nThreads = (nMinerThreads > 0 ? nMinerThreads : GetNumProcessors());
+    return max(1, min(nThreads, MAX_MINER_THREADS));
+}
+
+double GetHashesPerSec()
+{
+    double dTotal = 0;
+    for (int i = 0; i < MAX_MINER_THREADS; i++)
+        dTotal += vMinerHashesPerSec[i];
+    return dTotal;
+}
+
+// False on shutdown, once generation is switched off, or once a newer
+// start has taken over from this set of miners
+static bool KeepMining(int nGeneration)
+{
+    return (fGenerateBitcoins && !fShutdown && nGeneration == nBitcoinMinerGeneration);
+}
 
-bool BitcoinMiner()
+/**
+ * One mining worker out of nThreads.  Each worker builds its own block
+ * from the shared template with its own key and its own slice of the
+ * extraNonce space (nThread+1, nThread+1+nThreads, ...), so no two
+ * workers ever hash the same header.  Returns on shutdown instead of
+ * ending the thread so the caller can count it out of
+ * nBitcoinMinerThreads.  Also returns once a newer StartBitcoinMiner
+ * has moved nBitcoinMinerGeneration past nGeneration.
+ */
+bool BitcoinMiner(int nThread, int nThreads, int nGeneration)
 {
-    printf("BitcoinMiner started\n");
+    printf("BitcoinMiner thread %d of %d started, SHA-256 %s\n", nThread, nThreads, CryptoPP::SHA256Lanes::ImplementationName());
     SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_LOWEST);
+    if (fMinerPinThreads)
+        SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << (nThread % GetNumProcessors()));
 
     CKey key;
     key.MakeNewKey();
-    CBigNum bnExtraNonce = 0;
-    while (fGenerateBitcoins)
+    CBigNum bnExtraNonce = nThread + 1;
+    DWORD nHashTickStart = GetTickCount();
+    int64 nHashCount = 0;
+    while (KeepMining(nGeneration))
     {
         Sleep(50);
-        CheckForShutdown(3);
-        while (vNodes.empty())
-        {
+        while (vNodes.empty() && KeepMining(nGeneration))
             Sleep(1000);
-            CheckForShutdown(3);
-        }
+        if (!KeepMining(nGeneration))
+            break;
 
-        unsigned int nTransactionsUpdatedLast = nTransactionsUpdated;
-        CBlockIndex* pindexPrev = pindexBest;
-        unsigned int nBits = GetNextWorkRequired(pindexPrev);
+        CMinerTemplate tmpl;
+        GetMinerTemplate(tmpl);
+        unsigned int nTransactionsUpdatedLast = tmpl.nTransactionsUpdated;
+        CBlockIndex* pindexPrev = tmpl.pindexPrev;
+        unsigned int nBits = tmpl.nBits;
 
 
         //
@@ -2335,7 +2744,8 @@ bool BitcoinMiner()
         CTransaction txNew;
         txNew.vin.resize(1);
         txNew.vin[0].prevout.SetNull();
-        txNew.vin[0].scriptSig << nBits << ++bnExtraNonce;
+        txNew.vin[0].scriptSig << nBits << bnExtraNonce;
+        bnExtraNonce += nThreads;
         txNew.vout.resize(1);
         txNew.vout[0].scriptPubKey << key.GetPubKey() << OP_CHECKSIG;
 
@@ -2347,50 +2757,13 @@ bool BitcoinMiner()
         if (!pblock.get())
             return false;
 
-        // Add our coinbase tx as first transaction
+        // Add our coinbase tx as first transaction, then the template's
         pblock->vtx.push_back(txNew);
-
-        // Collect the latest transactions into the block
-        int64 nFees = 0;
-        CRITICAL_BLOCK(cs_main)
-        CRITICAL_BLOCK(cs_mapTransactions)
-        {
-            CTxDB txdb("r");
-            map<uint256, CTxIndex> mapTestPool;
-            vector<char> vfAlreadyAdded(mapTransactions.size());
-            bool fFoundSomething = true;
-            unsigned int nBlockSize = 0;
-            while (fFoundSomething && nBlockSize < MAX_SIZE/2)
-            {
-                fFoundSomething = false;
-                unsigned int n = 0;
-                for (map<uint256, CTransaction>::iterator mi = mapTransactions.begin(); mi != mapTransactions.end(); ++mi, ++n)
-                {
-                    if (vfAlreadyAdded[n])
-                        continue;
-                    CTransaction& tx = (*mi).second;
-                    if (tx.IsCoinBase() || !tx.IsFinal())
-                        continue;
-
-                    // Transaction fee requirements, mainly only needed for flood control
-                    // Under 10K (about 80 inputs) is free for first 100 transactions
-                    // Base rate is 0.01 per KB
-                    int64 nMinFee = tx.GetMinFee(pblock->vtx.size() < 100);
-
-                    map<uint256, CTxIndex> mapTestPoolTmp(mapTestPool);
-                    if (!tx.ConnectInputs(txdb, mapTestPoolTmp, CDiskTxPos(1,1,1), 0, nFees, false, true, nMinFee))
-                        continue;
-                    swap(mapTestPool, mapTestPoolTmp);
-
-                    pblock->vtx.push_back(tx);
-                    nBlockSize += ::GetSerializeSize(tx, SER_NETWORK);
-                    vfAlreadyAdded[n] = true;
-                    fFoundSomething = true;
-                }
-            }
-        }
+        pblock->vtx.insert(pblock->vtx.end(), tmpl.vtx.begin(), tmpl.vtx.end());
+        int64 nFees = tmpl.nFees;
         pblock->nBits = nBits;
         pblock->vtx[0].vout[0].nValue = pblock->GetBlockValue(nFees);
+        pblock->vtx[0].ClearCache();
         printf("\n\nRunning BitcoinMiner with %d transactions in block\n", pblock->vtx.size());
 
 
@@ -2413,7 +2786,7 @@ bool BitcoinMiner()
             uint256 hash1;
             unsigned char pchPadding1[64];
         }
-        tmp;
+        tmp, vtmp[CryptoPP::SHA256Lanes::MAX_LANES];
 
         tmp.block.nVersion       = pblock->nVersion;
         tmp.block.hashPrevBlock  = pblock->hashPrevBlock  = (pindexPrev ? pindexPrev->GetBlockHash() : 0);
@@ -2425,21 +2798,53 @@ bool BitcoinMiner()
         unsigned int nBlocks0 = FormatHashBlocks(&tmp.block, sizeof(tmp.block));
         unsigned int nBlocks1 = FormatHashBlocks(&tmp.hash1, sizeof(tmp.hash1));
 
+        /**
+         * The first 64 bytes (nVersion, hashPrevBlock and most of
+         * hashMerkleRoot) are the same for every nonce, so hash them once
+         * and only run the second chunk plus the second SHA-256 per nonce.
+         */
+        unsigned int midstate[8];
+        SHA256Midstate(&tmp.block, midstate);
+
+        /**
+         * Each SIMD lane gets its own copy of the buffer and hashes the
+         * nonce nNonce + lane, so one pass covers nLanes nonces.
+         */
+        unsigned int nLanes = CryptoPP::SHA256Lanes::Count();
+        const void* pblocktail[CryptoPP::SHA256Lanes::MAX_LANES];
+        void* phash1[CryptoPP::SHA256Lanes::MAX_LANES];
+        void* phash[CryptoPP::SHA256Lanes::MAX_LANES];
+        uint256 vhash[CryptoPP::SHA256Lanes::MAX_LANES];
+        for (int l = 0; l < nLanes; l++)
+        {
+            vtmp[l] = tmp;
+            pblocktail[l] = (char*)&vtmp[l].block + 64;
+            phash1[l] = &vtmp[l].hash1;
+            phash[l] = &vhash[l];
+        }
+
 
         //
         // Search
         //
         unsigned int nStart = GetTime();
         uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
-        uint256 hash;
         loop
         {
-            BlockSHA256(&tmp.block, nBlocks0, &tmp.hash1);
-            BlockSHA256(&tmp.hash1, nBlocks1, &hash);
+            for (int l = 0; l < nLanes; l++)
+                vtmp[l].block.nNonce = tmp.block.nNonce + l;
+            BlockSHA256Lanes(pblocktail, nBlocks0 - 1, phash1, nLanes, midstate);
+            BlockSHA256Lanes((const void* const*)phash1, nBlocks1, phash, nLanes);
 
+            int nFound = -1;
+            for (int l = 0; l < nLanes; l++)
+                if (vhash[l] <= hashTarget)
+                    nFound = l;
 
-            if (hash <= hashTarget)
+            if (nFound != -1)
             {
+                uint256 hash = vhash[nFound];
+                tmp.block.nNonce = vtmp[nFound].block.nNonce;
                 pblock->nNonce = tmp.block.nNonce;
                 assert(hash == pblock->GetHash());
 
@@ -2467,22 +2872,34 @@ bool BitcoinMiner()
             }
 
             // Update nTime every few seconds
-            if ((++tmp.block.nNonce & 0x3ffff) == 0)
+            tmp.block.nNonce += nLanes;
+            nHashCount += nLanes;
+            if ((tmp.block.nNonce & 0x3ffff) < nLanes)
             {
-                CheckForShutdown(3);
-                if (tmp.block.nNonce == 0)
+                DWORD nElapsed = GetTickCount() - nHashTickStart;
+                if (nElapsed > 4000)
+                {
+                    vMinerHashesPerSec[nThread] = 1000.0 * nHashCount / nElapsed;
+                    nHashTickStart += nElapsed;
+                    nHashCount = 0;
+                }
+
+                if (!KeepMining(nGeneration))
+                    break;
+                if (tmp.block.nNonce < nLanes)
                     break;
                 if (pindexPrev != pindexBest)
                     break;
                 if (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60)
                     break;
-                if (!fGenerateBitcoins)
-                    break;
                 tmp.block.nTime = pblock->nTime = max(pindexPrev->GetMedianTimePast()+1, GetAdjustedTime());
+                for (int l = 0; l < nLanes; l++)
+                    vtmp[l].block.nTime = tmp.block.nTime;
             }
         }
     }
 
+    vMinerHashesPerSec[nThread] = 0;
     return true;
 }
 
@@ -2713,6 +3130,7 @@ bool CreateTransaction(CScript scriptPubKey, int64 nValue, CWalletTx& wtxNew, in
                     for (int nOut = 0; nOut < pcoin->vout.size(); nOut++)
                         if (pcoin->vout[nOut].IsMine())
                             SignSignature(*pcoin, wtxNew, nIn++);
+                wtxNew.ClearCache();
 
                 // Check that enough fee is included
                 if (nFee < wtxNew.GetMinFee(true))
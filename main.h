@@ -18,6 +18,14 @@ static const unsigned int MAX_SIZE = 0x02000000;
 static const int64 COIN = 100000000;
 static const int64 CENT = 1000000;
 static const int COINBASE_MATURITY = 100;
+static const int MAX_MINER_THREADS = 64;
+static const int MAX_MERKLE_THREADS = 8;
+static const int MERKLE_PARALLEL_MIN_TX = 1000;
+static const int MAX_SCRIPTCHECK_THREADS = 64;
+static const int SCRIPTCHECK_PARALLEL_MIN_CHECKS = 16;
+static const int MIN_DB_CACHE_SIZE = 4;     // MB
+static const int MAX_DB_CACHE_SIZE = 1024;  // MB
+static const int MAX_KEY_POOL_SIZE = 10000;
 
 static const CBigNum bnProofOfWorkLimit(~uint256(0) >> 32);
 
@@ -36,9 +44,15 @@ extern CBlockIndex* pindexBest;
 extern unsigned int nTransactionsUpdated;
 extern string strSetDataDir;
 extern int nDropMessagesTest;
+extern array<double, MAX_MINER_THREADS> vMinerHashesPerSec;
 
 // Settings
 extern int fGenerateBitcoins;
+extern int nMinerThreads;
+extern int fMinerPinThreads;
+extern int nScriptCheckThreads;
+extern int nKeyPoolSize;
+extern int nDbCacheSize;
 extern int64 nTransactionFee;
 extern CAddress addrIncoming;
 
@@ -54,14 +68,21 @@ FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszM
 FILE* AppendBlockFile(unsigned int& nFileRet);
 bool AddKey(const CKey& key);
 vector<unsigned char> GenerateNewKey();
+bool GetKeyFromKeyPool(vector<unsigned char>& vchPubKeyRet);
+bool TopUpKeyPool();
+void ThreadKeyPool(void* parg);
 bool AddToWallet(const CWalletTx& wtxIn);
 void ReacceptWalletTransactions();
 void RelayWalletTransactions();
 bool LoadBlockIndex(bool fAllowNew=true);
+bool IsInitialBlockDownload(unsigned int nBestTime);
+bool IsInitialBlockDownload();
 void PrintBlockTree();
-bool BitcoinMiner();
+int GetMinerThreadCount();
+double GetHashesPerSec();
+bool BitcoinMiner(int nThread, int nThreads, int nGeneration);
 bool ProcessMessages(CNode* pfrom);
-bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv);
+bool ProcessMessage(CNode* pfrom, string strCommand, CDataStreamView& vRecv);
 bool SendMessages(CNode* pto);
 int64 GetBalance();
 bool CreateTransaction(CScript scriptPubKey, int64 nValue, CWalletTx& txNew, int64& nFeeRequiredRet);
@@ -370,7 +391,18 @@ public:
     vector<CTxOut> vout;
     int nLockTime;
 
+protected:
+    /**
+     * GetHash() and GetTxSize() results, worked out together on first use.
+     * Deserializing and SetNull() drop them; any other code that changes
+     * nVersion, vin, vout or nLockTime after the transaction may have been
+     * hashed has to call ClearCache() itself.
+     */
+    mutable uint256 hashCached;
+    mutable unsigned int nSizeCached;
+    mutable volatile LONG fCached;
 
+public:
     CTransaction()
     {
         SetNull();
@@ -378,6 +410,8 @@ public:
 
     IMPLEMENT_SERIALIZE
     (
+        if (fRead)
+            ClearCache();
         READWRITE(this->nVersion);
         nVersion = this->nVersion;
         READWRITE(vin);
@@ -391,6 +425,7 @@ public:
         vin.clear();
         vout.clear();
         nLockTime = 0;
+        ClearCache();
     }
 
     bool IsNull() const
@@ -398,11 +433,46 @@ public:
         return (vin.empty() && vout.empty());
     }
 
+    /**
+     * The txid, the double SHA-256 of the serialized transaction.  Only
+     * computed the first time it's asked for after a change.
+     */
     uint256 GetHash() const
     {
-        return SerializeHash(*this);
+        if (!fCached)
+            UpdateCache();
+        return hashCached;
     }
 
+    /**
+     * Serialized size in bytes, which is the same for SER_NETWORK,
+     * SER_DISK and SER_GETHASH.  Cached along with the hash.
+     */
+    unsigned int GetTxSize() const
+    {
+        if (!fCached)
+            UpdateCache();
+        return nSizeCached;
+    }
+
+    void ClearCache() const
+    {
+        fCached = 0;
+    }
+
+protected:
+    void UpdateCache() const
+    {
+        CHashWriter ss(SER_GETHASH);
+        ss << *this;
+        hashCached = ss.GetHash();
+        nSizeCached = ss.size();
+        // Full barrier, so another thread never sees the flag before the values
+        InterlockedExchange(&fCached, 1);
+    }
+
+public:
+
     bool IsFinal() const
     {
         if (nLockTime == 0 || nLockTime < nBestHeight)
@@ -530,7 +600,7 @@ public:
     int64 GetMinFee(bool fDiscount=false) const
     {
         // Base fee is 1 cent per kilobyte
-        unsigned int nBytes = ::GetSerializeSize(*this, SER_NETWORK);
+        unsigned int nBytes = GetTxSize();
         int64 nMinFee = (1 + (int64)nBytes / 1000) * CENT;
 
         // First 100 transactions in a block are free
@@ -608,7 +678,7 @@ public:
 
 
     bool DisconnectInputs(CTxDB& txdb);
-    bool ConnectInputs(CTxDB& txdb, map<uint256, CTxIndex>& mapTestPool, CDiskTxPos posThisTx, int nHeight, int64& nFees, bool fBlock, bool fMiner, int64 nMinFee=0);
+    bool ConnectInputs(CTxDB& txdb, map<uint256, CTxIndex>& mapTestPool, CDiskTxPos posThisTx, int nHeight, int64& nFees, bool fBlock, bool fMiner, int64 nMinFee=0, CScriptCheckQueue* pqueue=NULL);
     bool ClientConnectInputs();
 
     bool AcceptTransaction(CTxDB& txdb, bool fCheckInputs=true, bool* pfMissingInputs=NULL);
@@ -773,25 +843,28 @@ public:
 
 
 //
-// A txdb record that contains the disk location of a transaction and the
-// locations of transactions that spend its outputs.  vSpent is really only
-// used as a flag, but having the location is very helpful for debugging.
+// A txdb record that contains the disk location of a transaction and one
+// bit per output saying whether it's been spent.  Spending an output only
+// flips its bit, so the record stays a few bytes however many outputs the
+// transaction has.
 //
 class CTxIndex
 {
 public:
     CDiskTxPos pos;
-    vector<CDiskTxPos> vSpent;
+    unsigned int nOutputs;
+    vector<unsigned char> vchSpent;
 
     CTxIndex()
     {
         SetNull();
     }
 
-    CTxIndex(const CDiskTxPos& posIn, unsigned int nOutputs)
+    CTxIndex(const CDiskTxPos& posIn, unsigned int nOutputsIn)
     {
         pos = posIn;
-        vSpent.resize(nOutputs);
+        nOutputs = nOutputsIn;
+        vchSpent.resize((nOutputs + 7) / 8);
     }
 
     IMPLEMENT_SERIALIZE
@@ -799,13 +872,18 @@ public:
         if (!(nType & SER_GETHASH))
             READWRITE(nVersion);
         READWRITE(pos);
-        READWRITE(vSpent);
+        READWRITE(COMPACTSIZE(nOutputs));
+        if (fRead)
+            const_cast<CTxIndex*>(this)->vchSpent.resize((nOutputs + 7) / 8);
+        if (!vchSpent.empty())
+            READWRITE(REF(CFlatData((char*)&vchSpent[0], (char*)&vchSpent[0] + vchSpent.size())));
     )
 
     void SetNull()
     {
         pos.SetNull();
-        vSpent.clear();
+        nOutputs = 0;
+        vchSpent.clear();
     }
 
     bool IsNull()
@@ -813,14 +891,24 @@ public:
         return pos.IsNull();
     }
 
+    bool IsSpent(unsigned int n) const
+    {
+        return (vchSpent[n / 8] & (1 << (n % 8))) != 0;
+    }
+
+    void SetSpent(unsigned int n, bool fSpent)
+    {
+        if (fSpent)
+            vchSpent[n / 8] |= (1 << (n % 8));
+        else
+            vchSpent[n / 8] &= ~(1 << (n % 8));
+    }
+
     friend bool operator==(const CTxIndex& a, const CTxIndex& b)
     {
-        if (a.pos != b.pos || a.vSpent.size() != b.vSpent.size())
-            return false;
-        for (int i = 0; i < a.vSpent.size(); i++)
-            if (a.vSpent[i] != b.vSpent[i])
-                return false;
-        return true;
+        return (a.pos      == b.pos &&
+                a.nOutputs == b.nOutputs &&
+                a.vchSpent == b.vchSpent);
     }
 
     friend bool operator!=(const CTxIndex& a, const CTxIndex& b)
@@ -912,34 +1000,10 @@ public:
 
     /**
      * Constructs the merkle tree hash from all of the transactions.
+     * Leaves are hashed on several threads for big blocks and each
+     * level in batches through the multi-lane SHA-256 kernel.
      */
-    uint256 BuildMerkleTree() const
-    {
-        vMerkleTree.clear();
-        foreach(const CTransaction& tx, vtx)
-            vMerkleTree.push_back(tx.GetHash());
-        int j = 0;
-        /**
-         * Construct the tree by going through each level, which is half
-         * the size of the previous level.
-         */
-        for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
-        {
-            /**a
-             * Go through pairs of nodes at each level (think of a
-             * tree with two branches) and push the hash of the pair
-             * into the tree
-             */
-            for (int i = 0; i < nSize; i += 2)
-            {
-                int i2 = min(i+1, nSize-1);
-                vMerkleTree.push_back(Hash(BEGIN(vMerkleTree[j+i]),  END(vMerkleTree[j+i]),
-                                           BEGIN(vMerkleTree[j+i2]), END(vMerkleTree[j+i2])));
-            }
-            j += nSize;
-        }
-        return (vMerkleTree.empty() ? 0 : vMerkleTree.back());
-    }
+    uint256 BuildMerkleTree() const;
 
     vector<uint256> GetMerkleBranch(int nIndex) const
     {
@@ -965,12 +1029,12 @@ public:
     {
         if (nIndex == -1)
             return 0;
+        uint256 hashPair[2];
         foreach(const uint256& otherside, vMerkleBranch)
         {
-            if (nIndex & 1)
-                hash = Hash(BEGIN(otherside), END(otherside), BEGIN(hash), END(hash));
-            else
-                hash = Hash(BEGIN(hash), END(hash), BEGIN(otherside), END(otherside));
+            hashPair[(nIndex & 1) ? 1 : 0] = hash;
+            hashPair[(nIndex & 1) ? 0 : 1] = otherside;
+            CryptoPP::SHA256Lanes::DoubleHash64((unsigned char*)&hash, (const unsigned char*)&hashPair[0], 1);
             nIndex >>= 1;
         }
         return hash;
@@ -1376,3 +1440,5 @@ extern map<vector<unsigned char>, CPrivKey> mapKeys;
 extern map<uint160, vector<unsigned char> > mapPubKeys;
 extern CCriticalSection cs_mapKeys;
 extern CKey keyUser;
+extern map<int64, vector<unsigned char> > mapKeyPool;
+extern CCriticalSection cs_mapKeyPool;
@@ -24,6 +24,8 @@ CNode nodeLocalHost(INVALID_SOCKET, CAddress("127.0.0.1", nLocalServices));
 CNode* pnodeLocalHost = &nodeLocalHost;
 bool fShutdown = false;
 array<bool, 10> vfThreadRunning;
+volatile LONG nBitcoinMinerThreads = 0;
+volatile LONG nBitcoinMinerGeneration = 0;
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
 map<vector<unsigned char>, CAddress> mapAddresses;
@@ -617,14 +619,15 @@ void ThreadSocketHandler2(void* parg)
             {
                 TRY_CRITICAL_BLOCK(pnode->cs_vRecv)
                 {
-                    CDataStream& vRecv = pnode->vRecv;
-                    unsigned int nPos = vRecv.size();
-
-                    // typical socket buffer is 8K-64K
-                    const unsigned int nBufSize = 0x10000;
-                    vRecv.resize(nPos + nBufSize);
-                    int nBytes = recv(hSocket, &vRecv[nPos], nBufSize, 0);
-                    vRecv.resize(nPos + max(nBytes, 0));
+                    CDataQueue& vRecv = pnode->vRecv;
+
+                    // Receive straight into the free space at the back,
+                    // chunks are 64K like a typical socket buffer
+                    unsigned int nBufSize;
+                    char* pchBuf = vRecv.GetWriteBuffer(1, nBufSize);
+                    int nBytes = recv(hSocket, pchBuf, nBufSize, 0);
+                    if (nBytes > 0)
+                        vRecv.CommitWrite(nBytes);
                     if (nBytes == 0)
                     {
                         // socket closed gracefully
@@ -653,24 +656,34 @@ void ThreadSocketHandler2(void* parg)
             {
                 TRY_CRITICAL_BLOCK(pnode->cs_vSend)
                 {
-                    CDataStream& vSend = pnode->vSend;
-                    if (!vSend.empty())
+                    CDataQueue& vSend = pnode->vSend;
+                    while (!vSend.empty())
                     {
-                        int nBytes = send(hSocket, &vSend[0], vSend.size(), 0);
+                        // Send a chunk at a time until the socket stops
+                        // taking whole chunks
+                        unsigned int nSize;
+                        const char* pch = vSend.GetFront(nSize);
+                        int nBytes = send(hSocket, pch, nSize, 0);
                         if (nBytes > 0)
                         {
-                            vSend.erase(vSend.begin(), vSend.begin() + nBytes);
+                            vSend.ignore(nBytes);
+                            if ((unsigned int)nBytes < nSize)
+                                break;
                         }
                         else if (nBytes == 0)
                         {
                             if (pnode->ReadyToDisconnect())
                                 pnode->vSend.clear();
+                            break;
                         }
                         else
                         {
+                            if (WSAGetLastError() == WSAEWOULDBLOCK)
+                                break;
                             printf("send error %d\n", nBytes);
                             if (pnode->ReadyToDisconnect())
                                 pnode->vSend.clear();
+                            break;
                         }
                     }
                 }
@@ -920,18 +933,87 @@ void ThreadMessageHandler2(void* parg)
 
 
 
-//// todo: start one thread per processor, use getenv("NUMBER_OF_PROCESSORS")
+struct CMinerThreadArg
+{
+    int nThread;
+    int nThreads;
+    int nGeneration;
+};
+
+void ThreadBitcoinMinerWorker(void* parg)
+{
+    CMinerThreadArg arg = *(CMinerThreadArg*)parg;
+    delete (CMinerThreadArg*)parg;
+    try
+    {
+        bool fRet = BitcoinMiner(arg.nThread, arg.nThreads, arg.nGeneration);
+        printf("BitcoinMiner thread %d returned %s\n", arg.nThread, fRet ? "true" : "false");
+    }
+    CATCH_PRINT_EXCEPTION("BitcoinMiner()")
+    InterlockedDecrement(&nBitcoinMinerThreads);
+}
+
+// Runs miner thread 0 itself and starts the others, one per processor
+// unless nMinerThreads says otherwise.  Every miner thread is counted in
+// nBitcoinMinerThreads before it's started and counts itself out when it
+// leaves BitcoinMiner.
+//
+// Miners only look at fGenerateBitcoins between hashing rounds, so the
+// ones from an earlier start can still be running.  They see they're
+// from an old generation and stop, and this waits for that here instead
+// of in the UI, so there's never more than one set hashing.  If a newer
+// start comes along in the meantime this one gives way to it.
 void ThreadBitcoinMiner(void* parg)
 {
+    int nGeneration = *(int*)parg;
+    delete (int*)parg;
+    while (nBitcoinMinerThreads > 1 && nGeneration == nBitcoinMinerGeneration && !fShutdown)
+        Sleep(50);
+    if (nGeneration != nBitcoinMinerGeneration || fShutdown)
+    {
+        InterlockedDecrement(&nBitcoinMinerThreads);
+        return;
+    }
+
     vfThreadRunning[3] = true;
-    CheckForShutdown(3);
     try
     {
-        bool fRet = BitcoinMiner();
+        int nThreads = GetMinerThreadCount();
+        for (int i = 1; i < nThreads && !fShutdown; i++)
+        {
+            CMinerThreadArg* pargWorker = new CMinerThreadArg;
+            pargWorker->nThread = i;
+            pargWorker->nThreads = nThreads;
+            pargWorker->nGeneration = nGeneration;
+            InterlockedIncrement(&nBitcoinMinerThreads);
+            if (_beginthread(ThreadBitcoinMinerWorker, 0, pargWorker) == -1)
+            {
+                printf("Error: _beginthread(ThreadBitcoinMinerWorker) failed\n");
+                InterlockedDecrement(&nBitcoinMinerThreads);
+                delete pargWorker;
+            }
+        }
+
+        bool fRet = BitcoinMiner(0, nThreads, nGeneration);
         printf("BitcoinMiner returned %s\n\n\n", fRet ? "true" : "false");
     }
     CATCH_PRINT_EXCEPTION("BitcoinMiner()")
     vfThreadRunning[3] = false;
+    InterlockedDecrement(&nBitcoinMinerThreads);
+}
+
+// Doesn't wait for anything, safe to call from the UI thread
+bool StartBitcoinMiner()
+{
+    int nGeneration = InterlockedIncrement(&nBitcoinMinerGeneration);
+    InterlockedIncrement(&nBitcoinMinerThreads);
+    if (_beginthread(ThreadBitcoinMiner, 0, new int(nGeneration)) == -1)
+    {
+        printf("Error: _beginthread(ThreadBitcoinMiner) failed\n");
+        InterlockedDecrement(&nBitcoinMinerThreads);
+        return false;
+    }
+    return true;
 }
 
 
@@ -1067,7 +1149,7 @@ bool StopNode()
     fShutdown = true;
     nTransactionsUpdated++;
     int64 nStart = GetTime();
-    while (vfThreadRunning[0] || vfThreadRunning[2] || vfThreadRunning[3])
+    while (vfThreadRunning[0] || vfThreadRunning[2] || nBitcoinMinerThreads > 0 || vfThreadRunning[4])
     {
         if (GetTime() - nStart > 15)
             break;
@@ -1076,7 +1158,8 @@ bool StopNode()
     if (vfThreadRunning[0]) printf("ThreadSocketHandler still running\n");
     if (vfThreadRunning[1]) printf("ThreadOpenConnections still running\n");
     if (vfThreadRunning[2]) printf("ThreadMessageHandler still running\n");
-    if (vfThreadRunning[3]) printf("ThreadBitcoinMiner still running\n");
+    if (nBitcoinMinerThreads > 0) printf("%d BitcoinMiner threads still running\n", (int)nBitcoinMinerThreads);
+    if (vfThreadRunning[4]) printf("ThreadKeyPool still running\n");
     while (vfThreadRunning[2])
         Sleep(20);
     Sleep(50);
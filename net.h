@@ -30,6 +30,7 @@ CNode* ConnectNode(CAddress addrConnect, int64 nTimeout=0);
 void AbandonRequests(void (*fn)(void*, CDataStream&), void* param1);
 bool AnySubscribed(unsigned int nChannel);
 void ThreadBitcoinMiner(void* parg);
+bool StartBitcoinMiner();
 bool StartNode(string& strError=REF(string()));
 bool StopNode();
 void CheckForShutdown(int n);
@@ -417,6 +418,8 @@ extern CAddress addrLocalHost;
 extern CNode* pnodeLocalHost;
 extern bool fShutdown;
 extern array<bool, 10> vfThreadRunning;
+extern volatile LONG nBitcoinMinerThreads;
+extern volatile LONG nBitcoinMinerGeneration;
 extern vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
 extern map<vector<unsigned char>, CAddress> mapAddresses;
@@ -437,8 +440,8 @@ public:
     // socket
     uint64 nServices;
     SOCKET hSocket;
-    CDataStream vSend;
-    CDataStream vRecv;
+    CDataQueue vSend;
+    CDataQueue vRecv;
     CCriticalSection cs_vSend;
     CCriticalSection cs_vRecv;
     unsigned int nPushPos;
@@ -568,6 +571,9 @@ public:
         if (nPushPos != -1)
             AbortMessage();
         nPushPos = vSend.size();
+        // Header in one piece so it can be patched through a pointer
+        unsigned int nFree;
+        vSend.GetWriteBuffer(sizeof(CMessageHeader), nFree);
         vSend << CMessageHeader(pszCommand, 0);
         printf("sending: %-12s ", pszCommand);
     }
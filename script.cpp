@@ -4,7 +4,7 @@
 
 #include "headers.h"
 
-bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const CSignatureHashCache* psighashcache);
 
 
 
@@ -18,12 +18,337 @@ static const CBigNum bnFalse(0);
 static const CBigNum bnTrue(1);
 
 
-bool CastToBool(const valtype& vch)
+//
+// Interpreter stack
+//
+// EvalScript's stacks are arenas of CStackValue slots.  A value of up to
+// INLINE_SIZE bytes, which covers every signature, pubkey, hash and
+// number a normal script pushes, is kept inside its slot.  Popping only
+// marks the slot free, the next push reuses it along with any heap
+// buffer it grew, so a valid script runs without allocating as long as
+// it stays within INLINE_DEPTH values and INLINE_SIZE bytes each.
+//
+class CStackValue
+{
+public:
+    typedef unsigned char* iterator;
+    typedef const unsigned char* const_iterator;
+    enum { INLINE_SIZE = 80 };
+
+protected:
+    unsigned char* pch;
+    unsigned int nSize;
+    unsigned int nCapacity;
+    unsigned char pchInline[INLINE_SIZE];
+
+public:
+    CStackValue() : pch(pchInline), nSize(0), nCapacity(INLINE_SIZE) { }
+    explicit CStackValue(const valtype& vch) : pch(pchInline), nSize(0), nCapacity(INLINE_SIZE) { assign(vch.begin(), vch.end()); }
+    CStackValue(const CStackValue& b) : pch(pchInline), nSize(0), nCapacity(INLINE_SIZE) { assign(b.begin(), b.end()); }
+
+    ~CStackValue()
+    {
+        if (pch != pchInline)
+            delete[] pch;
+    }
+
+    CStackValue& operator=(const CStackValue& b)
+    {
+        if (this != &b)
+            assign(b.begin(), b.end());
+        return (*this);
+    }
+
+    unsigned int size() const       { return nSize; }
+    bool empty() const              { return (nSize == 0); }
+    iterator begin()                { return pch; }
+    iterator end()                  { return pch + nSize; }
+    const_iterator begin() const    { return pch; }
+    const_iterator end() const      { return pch + nSize; }
+    unsigned char& operator[](unsigned int i)       { return pch[i]; }
+    unsigned char operator[](unsigned int i) const  { return pch[i]; }
+    unsigned char& back()           { return pch[nSize-1]; }
+    unsigned char back() const      { return pch[nSize-1]; }
+    valtype getvch() const          { return valtype(begin(), end()); }
+
+    void reserve(unsigned int n)
+    {
+        if (n <= nCapacity)
+            return;
+        unsigned int nNewCapacity = max(n, 2 * nCapacity);
+        unsigned char* pchNew = new unsigned char[nNewCapacity];
+        memcpy(pchNew, pch, nSize);
+        if (pch != pchInline)
+            delete[] pch;
+        pch = pchNew;
+        nCapacity = nNewCapacity;
+    }
+
+    void resize(unsigned int n, unsigned char ch=0)
+    {
+        reserve(n);
+        if (n > nSize)
+            memset(pch + nSize, ch, n - nSize);
+        nSize = n;
+    }
+
+    void clear()
+    {
+        nSize = 0;
+    }
+
+    void push_back(unsigned char ch)
+    {
+        resize(nSize + 1, ch);
+    }
+
+    void pop_back()
+    {
+        nSize--;
+    }
+
+    template<typename T>
+    void assign(T first, T last)
+    {
+        unsigned int n = last - first;
+        nSize = 0;
+        reserve(n);
+        if (n > 0)
+            memcpy(pch, &first[0], n);
+        nSize = n;
+    }
+
+    void insert(iterator pos, const_iterator first, const_iterator last)
+    {
+        unsigned int nPos = pos - pch;
+        unsigned int n = last - first;
+        reserve(nSize + n);
+        memmove(pch + nPos + n, pch + nPos, nSize - nPos);
+        memcpy(pch + nPos, first, n);
+        nSize += n;
+    }
+
+    void erase(iterator first, iterator last)
+    {
+        memmove(first, last, end() - last);
+        nSize -= last - first;
+    }
+
+    // Moves b's value into this slot without copying a heap buffer, b is
+    // left empty.  Whatever this held is thrown away.
+    void Take(CStackValue& b)
+    {
+        if (pch != pchInline)
+            delete[] pch;
+        if (b.pch == b.pchInline)
+        {
+            memcpy(pchInline, b.pchInline, b.nSize);
+            pch = pchInline;
+            nCapacity = INLINE_SIZE;
+        }
+        else
+        {
+            pch = b.pch;
+            nCapacity = b.nCapacity;
+            b.pch = b.pchInline;
+            b.nCapacity = INLINE_SIZE;
+        }
+        nSize = b.nSize;
+        b.nSize = 0;
+    }
+
+    friend void swap(CStackValue& a, CStackValue& b)
+    {
+        if (&a == &b)
+            return;
+        CStackValue tmp;
+        tmp.Take(a);
+        a.Take(b);
+        b.Take(tmp);
+    }
+
+    friend bool operator==(const CStackValue& a, const CStackValue& b)
+    {
+        return (a.nSize == b.nSize && memcmp(a.pch, b.pch, a.nSize) == 0);
+    }
+};
+
+class CScriptStack
+{
+public:
+    typedef CStackValue* iterator;
+    enum { INLINE_DEPTH = 24 };
+
+protected:
+    CStackValue* pv;
+    unsigned int nSize;
+    unsigned int nCapacity;
+    CStackValue vInline[INLINE_DEPTH];
+
+    void Grow()
+    {
+        unsigned int nNewCapacity = 2 * nCapacity;
+        CStackValue* pvNew = new CStackValue[nNewCapacity];
+        for (unsigned int i = 0; i < nSize; i++)
+            pvNew[i].Take(pv[i]);
+        if (pv != vInline)
+            delete[] pv;
+        pv = pvNew;
+        nCapacity = nNewCapacity;
+    }
+
+private:
+    // Never copied, EvalScript hands its result out through pvStackRet
+    CScriptStack(const CScriptStack&);
+    CScriptStack& operator=(const CScriptStack&);
+
+public:
+    CScriptStack() : pv(vInline), nSize(0), nCapacity(INLINE_DEPTH) { }
+
+    ~CScriptStack()
+    {
+        if (pv != vInline)
+            delete[] pv;
+    }
+
+    unsigned int size() const   { return nSize; }
+    bool empty() const          { return (nSize == 0); }
+    iterator begin()            { return pv; }
+    iterator end()              { return pv + nSize; }
+    CStackValue& back()         { return pv[nSize-1]; }
+
+    CStackValue& at(unsigned int i)
+    {
+        if (i >= nSize)
+            throw std::out_of_range("CScriptStack::at() : out of range");
+        return pv[i];
+    }
+
+    // Returns the new top slot, empty but keeping any buffer it had
+    CStackValue& push_back()
+    {
+        if (nSize == nCapacity)
+            Grow();
+        CStackValue& top = pv[nSize++];
+        top.clear();
+        return top;
+    }
+
+    void push_back(const CStackValue& v)
+    {
+        if (nSize == nCapacity && &v >= pv && &v < pv + nSize)
+        {
+            CStackValue vCopy(v);
+            push_back() = vCopy;
+            return;
+        }
+        push_back() = v;
+    }
+
+    void push_back(const valtype& vch)
+    {
+        push_back().assign(vch.begin(), vch.end());
+    }
+
+    void pop_back()
+    {
+        if (nSize > 0)
+            nSize--;
+    }
+
+    // Removes [first, last), the freed slots go to the top of the arena
+    void erase(iterator first, iterator last)
+    {
+        unsigned int n = last - first;
+        for (iterator p = first; p + n < end(); p++)
+            swap(*p, *(p + n));
+        nSize -= n;
+    }
+
+    void erase(iterator pos)
+    {
+        erase(pos, pos + 1);
+    }
+
+    void insert(iterator pos, const CStackValue& v)
+    {
+        unsigned int nPos = pos - pv;
+        push_back(v);
+        for (unsigned int i = nSize - 1; i > nPos; i--)
+            swap(pv[i], pv[i-1]);
+    }
+};
+
+
+
+//
+// Script numbers are little-endian sign and magnitude, the same bytes
+// CBigNum's setvch/getvch use.  Numbers up to MAX_NATIVE_NUM_SIZE bytes
+// are done in int64 without touching OpenSSL.  Bigger ones, and the
+// "negative zero" encodings whose meaning is up to BN_mpi2bn, go through
+// CBigNum as before.
+//
+static const unsigned int MAX_NATIVE_NUM_SIZE = 4;
+
+bool GetNativeNum(const CStackValue& vch, int64& nRet)
+{
+    if (vch.size() > MAX_NATIVE_NUM_SIZE)
+        return false;
+    int64 n = 0;
+    for (unsigned int i = 0; i < vch.size(); i++)
+        n |= (int64)vch[i] << (8 * i);
+    if (!vch.empty() && (vch.back() & 0x80))
+    {
+        n &= ~((int64)0x80 << (8 * (vch.size() - 1)));
+        if (n == 0)
+            return false;
+        n = -n;
+    }
+    nRet = n;
+    return true;
+}
+
+// Sets vch to the same bytes as CBigNum(n).getvch()
+void SetNativeNum(CStackValue& vch, int64 n)
+{
+    unsigned char pch[sizeof(n) + 1];
+    unsigned int nSize = 0;
+    bool fNegative = (n < 0);
+    uint64 nAbs = (fNegative ? -(uint64)n : (uint64)n);
+    while (nAbs)
+    {
+        pch[nSize++] = nAbs & 0xff;
+        nAbs >>= 8;
+    }
+    // The top bit is the sign, add a byte if the magnitude needs it
+    if (nSize > 0)
+    {
+        if (pch[nSize-1] & 0x80)
+            pch[nSize++] = (fNegative ? 0x80 : 0);
+        else if (fNegative)
+            pch[nSize-1] |= 0x80;
+    }
+    vch.assign(pch, pch + nSize);
+}
+
+// Same as CBigNum(vch).getint()
+int GetStackInt(const CStackValue& vch)
 {
-    return (CBigNum(vch) != bnZero);
+    int64 n;
+    if (GetNativeNum(vch, n))
+        return (int)n;
+    return CBigNum(vch.getvch()).getint();
 }
 
-void MakeSameSize(valtype& vch1, valtype& vch2)
+bool CastToBool(const CStackValue& vch)
+{
+    int64 n;
+    if (GetNativeNum(vch, n))
+        return (n != 0);
+    return (CBigNum(vch.getvch()) != bnZero);
+}
+
+void MakeSameSize(CStackValue& vch1, CStackValue& vch2)
 {
     // Lengthen the shorter one
     if (vch1.size() < vch2.size())
@@ -42,9 +367,8 @@ void MakeSameSize(valtype& vch1, valtype& vch2)
 #define altstacktop(i)  (altstack.at(altstack.size()+(i)))
 
 bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType,
-                vector<vector<unsigned char> >* pvStackRet)
+                vector<vector<unsigned char> >* pvStackRet, const CSignatureHashCache* psighashcache)
 {
-    CAutoBN_CTX pctx;
     // This is the pointer for the current byte being evaluated
     CScript::const_iterator pc = script.begin();
     // This is the end of the script
@@ -64,9 +388,14 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
      * in the `false` portion of some conditional and should not execute the current
      * statement, if any.
      */
-    vector<bool> vfExec;
-    vector<valtype> stack;
-    vector<valtype> altstack;
+    // One byte per nested `if`, kept inline the same as a stack value
+    CStackValue vfExec;
+    // How many entries of vfExec are false, so fExec doesn't rescan it every opcode
+    int nExecFalse = 0;
+    CScriptStack stack;
+    CScriptStack altstack;
+    CScript::const_iterator pvchPush;
+    unsigned int nPushSize;
     if (pvStackRet)
         pvStackRet->clear();
 
@@ -80,21 +409,21 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
          * In otherwords, if any element of this vector is `false`, this
          * variable is also false.
          */
-        bool fExec = !count(vfExec.begin(), vfExec.end(), false);
+        bool fExec = (nExecFalse == 0);
 
         //
         // Read instruction
         //
         opcodetype opcode;
-        valtype vchPushValue;
-        if (!script.GetOp(pc, opcode, vchPushValue))
+        if (!script.GetOp(pc, opcode, pvchPush, nPushSize))
             return false;
 
         // If in the `true` portion of an `if` statement
         // and this is a byte with a value less than 78,
-        // push it onto the stack
+        // push it onto the stack.  The data goes straight from the
+        // script into the next free slot.
         if (fExec && opcode <= OP_PUSHDATA4)
-            stack.push_back(vchPushValue);
+            stack.push_back().assign(pvchPush, pvchPush + nPushSize);
         else if (fExec || (OP_IF <= opcode && opcode <= OP_ENDIF))
         switch (opcode)
         {
@@ -120,8 +449,7 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
             case OP_16:
             {
                 // ( -- value)
-                CBigNum bn((int)opcode - (int)(OP_1 - 1));
-                stack.push_back(bn.getvch());
+                SetNativeNum(stack.push_back(), (int)opcode - (int)(OP_1 - 1));
             }
             break;
 
@@ -134,8 +462,7 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
 
             case OP_VER:
             {
-                CBigNum bn(VERSION);
-                stack.push_back(bn.getvch());
+                SetNativeNum(stack.push_back(), VERSION);
             }
             break;
 
@@ -150,9 +477,9 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
                 {
                     if (stack.size() < 1)
                         return false;
-                    valtype& vch = stacktop(-1);
+                    CStackValue& vch = stacktop(-1);
                     if (opcode == OP_VERIF || opcode == OP_VERNOTIF)
-                        fValue = (CBigNum(VERSION) >= CBigNum(vch));
+                        fValue = (CBigNum(VERSION) >= CBigNum(vch.getvch()));
                     else
                         fValue = CastToBool(vch);
                     if (opcode == OP_NOTIF || opcode == OP_VERNOTIF)
@@ -160,6 +487,8 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
                     stack.pop_back();
                 }
                 vfExec.push_back(fValue);
+                if (!fValue)
+                    nExecFalse++;
             }
             break;
 
@@ -168,6 +497,7 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
                 if (vfExec.empty())
                     return false;
                 vfExec.back() = !vfExec.back();
+                nExecFalse += (vfExec.back() ? -1 : 1);
             }
             break;
 
@@ -177,6 +507,8 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
                     return false;
                 // `If` statement has ended so we can get rid of our
                 // ongoing tracking of its state via `vfExec`
+                if (!vfExec.back())
+                    nExecFalse--;
                 vfExec.pop_back();
             }
             break;
@@ -236,8 +568,8 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
                 // (x1 x2 -- x1 x2 x1 x2)
                 if (stack.size() < 2)
                     return false;
-                valtype vch1 = stacktop(-2);
-                valtype vch2 = stacktop(-1);
+                CStackValue vch1 = stacktop(-2);
+                CStackValue vch2 = stacktop(-1);
                 stack.push_back(vch1);
                 stack.push_back(vch2);
             }
@@ -248,9 +580,9 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
                 // (x1 x2 x3 -- x1 x2 x3 x1 x2 x3)
                 if (stack.size() < 3)
                     return false;
-                valtype vch1 = stacktop(-3);
-                valtype vch2 = stacktop(-2);
-                valtype vch3 = stacktop(-1);
+                CStackValue vch1 = stacktop(-3);
+                CStackValue vch2 = stacktop(-2);
+                CStackValue vch3 = stacktop(-1);
                 stack.push_back(vch1);
                 stack.push_back(vch2);
                 stack.push_back(vch3);
@@ -262,8 +594,8 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
                 // (x1 x2 x3 x4 -- x1 x2 x3 x4 x1 x2)
                 if (stack.size() < 4)
                     return false;
-                valtype vch1 = stacktop(-4);
-                valtype vch2 = stacktop(-3);
+                CStackValue vch1 = stacktop(-4);
+                CStackValue vch2 = stacktop(-3);
                 stack.push_back(vch1);
                 stack.push_back(vch2);
             }
@@ -274,8 +606,8 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
                 // (x1 x2 x3 x4 x5 x6 -- x3 x4 x5 x6 x1 x2)
                 if (stack.size() < 6)
                     return false;
-                valtype vch1 = stacktop(-6);
-                valtype vch2 = stacktop(-5);
+                CStackValue vch1 = stacktop(-6);
+                CStackValue vch2 = stacktop(-5);
                 stack.erase(stack.end()-6, stack.end()-4);
                 stack.push_back(vch1);
                 stack.push_back(vch2);
@@ -297,7 +629,7 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
                 // (x - 0 | x x)
                 if (stack.size() < 1)
                     return false;
-                valtype vch = stacktop(-1);
+                CStackValue vch = stacktop(-1);
                 if (CastToBool(vch))
                     stack.push_back(vch);
             }
@@ -306,8 +638,8 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
             case OP_DEPTH:
             {
                 // -- stacksize
-                CBigNum bn(stack.size());
-                stack.push_back(bn.getvch());
+                unsigned int nDepth = stack.size();
+                SetNativeNum(stack.push_back(), nDepth);
             }
             break;
 
@@ -325,7 +657,7 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
                 // (x -- x x)
                 if (stack.size() < 1)
                     return false;
-                valtype vch = stacktop(-1);
+                CStackValue vch = stacktop(-1);
                 stack.push_back(vch);
             }
             break;
@@ -344,7 +676,7 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
                 // (x1 x2 -- x1 x2 x1)
                 if (stack.size() < 2)
                     return false;
-                valtype vch = stacktop(-2);
+                CStackValue vch = stacktop(-2);
                 stack.push_back(vch);
             }
             break;
@@ -356,11 +688,11 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
                 // (xn ... x2 x1 x0 n - ... x2 x1 x0 xn)
                 if (stack.size() < 2)
                     return false;
-                int n = CBigNum(stacktop(-1)).getint();
+                int n = GetStackInt(stacktop(-1));
                 stack.pop_back();
                 if (n < 0 || n >= stack.size())
                     return false;
-                valtype vch = stacktop(-n-1);
+                CStackValue vch = stacktop(-n-1);
                 if (opcode == OP_ROLL)
                     stack.erase(stack.end()-n-1);
                 stack.push_back(vch);
@@ -393,7 +725,7 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
                 // (x1 x2 -- x2 x1 x2)
                 if (stack.size() < 2)
                     return false;
-                valtype vch = stacktop(-1);
+                CStackValue vch = stacktop(-1);
                 stack.insert(stack.end()-2, vch);
             }
             break;
@@ -407,8 +739,8 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
                 // (x1 x2 -- out)
                 if (stack.size() < 2)
                     return false;
-                valtype& vch1 = stacktop(-2);
-                valtype& vch2 = stacktop(-1);
+                CStackValue& vch1 = stacktop(-2);
+                CStackValue& vch2 = stacktop(-1);
                 vch1.insert(vch1.end(), vch2.begin(), vch2.end());
                 stack.pop_back();
             }
@@ -419,9 +751,9 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
                 // (in begin size -- out)
                 if (stack.size() < 3)
                     return false;
-                valtype& vch = stacktop(-3);
-                int nBegin = CBigNum(stacktop(-2)).getint();
-                int nEnd = nBegin + CBigNum(stacktop(-1)).getint();
+                CStackValue& vch = stacktop(-3);
+                int nBegin = GetStackInt(stacktop(-2));
+                int nEnd = nBegin + GetStackInt(stacktop(-1));
                 if (nBegin < 0 || nEnd < nBegin)
                     return false;
                 if (nBegin > vch.size())
@@ -441,8 +773,8 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
                 // (in size -- out)
                 if (stack.size() < 2)
                     return false;
-                valtype& vch = stacktop(-2);
-                int nSize = CBigNum(stacktop(-1)).getint();
+                CStackValue& vch = stacktop(-2);
+                int nSize = GetStackInt(stacktop(-1));
                 if (nSize < 0)
                     return false;
                 if (nSize > vch.size())
@@ -460,8 +792,8 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
                 // (in -- in size)
                 if (stack.size() < 1)
                     return false;
-                CBigNum bn(stacktop(-1).size());
-                stack.push_back(bn.getvch());
+                unsigned int nSize = stacktop(-1).size();
+                SetNativeNum(stack.push_back(), nSize);
             }
             break;
 
@@ -474,7 +806,7 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
                 // (in - out)
                 if (stack.size() < 1)
                     return false;
-                valtype& vch = stacktop(-1);
+                CStackValue& vch = stacktop(-1);
                 for (int i = 0; i < vch.size(); i++)
                     vch[i] = ~vch[i];
             }
@@ -487,8 +819,8 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
                 // (x1 x2 - out)
                 if (stack.size() < 2)
                     return false;
-                valtype& vch1 = stacktop(-2);
-                valtype& vch2 = stacktop(-1);
+                CStackValue& vch1 = stacktop(-2);
+                CStackValue& vch2 = stacktop(-1);
                 MakeSameSize(vch1, vch2);
                 if (opcode == OP_AND)
                 {
@@ -516,8 +848,8 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
                 // (x1 x2 - bool)
                 if (stack.size() < 2)
                     return false;
-                valtype& vch1 = stacktop(-2);
-                valtype& vch2 = stacktop(-1);
+                CStackValue& vch1 = stacktop(-2);
+                CStackValue& vch2 = stacktop(-1);
                 bool fEqual = (vch1 == vch2);
                 // OP_NOTEQUAL is disabled because it would be too easy to say
                 // something like n != 1 and have some wiseguy pass in 1 with extra
@@ -553,20 +885,38 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
                 // (in -- out)
                 if (stack.size() < 1)
                     return false;
-                CBigNum bn(stacktop(-1));
-                switch (opcode)
+                int64 n;
+                if (opcode != OP_2DIV && GetNativeNum(stacktop(-1), n))
                 {
-                case OP_1ADD:       bn += bnOne; break;
-                case OP_1SUB:       bn -= bnOne; break;
-                case OP_2MUL:       bn <<= 1; break;
-                case OP_2DIV:       bn >>= 1; break;
-                case OP_NEGATE:     bn = -bn; break;
-                case OP_ABS:        if (bn < bnZero) bn = -bn; break;
-                case OP_NOT:        bn = (bn == bnZero); break;
-                case OP_0NOTEQUAL:  bn = (bn != bnZero); break;
+                    switch (opcode)
+                    {
+                    case OP_1ADD:       n += 1; break;
+                    case OP_1SUB:       n -= 1; break;
+                    case OP_2MUL:       n *= 2; break;
+                    case OP_NEGATE:     n = -n; break;
+                    case OP_ABS:        if (n < 0) n = -n; break;
+                    case OP_NOT:        n = (n == 0); break;
+                    case OP_0NOTEQUAL:  n = (n != 0); break;
+                    }
+                    SetNativeNum(stacktop(-1), n);
+                }
+                else
+                {
+                    CBigNum bn(stacktop(-1).getvch());
+                    switch (opcode)
+                    {
+                    case OP_1ADD:       bn += bnOne; break;
+                    case OP_1SUB:       bn -= bnOne; break;
+                    case OP_2MUL:       bn <<= 1; break;
+                    case OP_2DIV:       bn >>= 1; break;
+                    case OP_NEGATE:     bn = -bn; break;
+                    case OP_ABS:        if (bn < bnZero) bn = -bn; break;
+                    case OP_NOT:        bn = (bn == bnZero); break;
+                    case OP_0NOTEQUAL:  bn = (bn != bnZero); break;
+                    }
+                    stack.pop_back();
+                    stack.push_back(bn.getvch());
                 }
-                stack.pop_back();
-                stack.push_back(bn.getvch());
             }
             break;
 
@@ -592,61 +942,90 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
                 // (x1 x2 -- out)
                 if (stack.size() < 2)
                     return false;
-                CBigNum bn1(stacktop(-2));
-                CBigNum bn2(stacktop(-1));
-                CBigNum bn;
-                switch (opcode)
+                int64 n1, n2;
+                if (opcode != OP_DIV && opcode != OP_MOD && opcode != OP_LSHIFT && opcode != OP_RSHIFT &&
+                    GetNativeNum(stacktop(-2), n1) && GetNativeNum(stacktop(-1), n2))
                 {
-                case OP_ADD:
-                    bn = bn1 + bn2;
-                    break;
-
-                case OP_SUB:
-                    bn = bn1 - bn2;
-                    break;
-
-                case OP_MUL:
-                    if (!BN_mul(&bn, &bn1, &bn2, pctx))
-                        return false;
-                    break;
-
-                case OP_DIV:
-                    if (!BN_div(&bn, NULL, &bn1, &bn2, pctx))
-                        return false;
-                    break;
-
-                case OP_MOD:
-                    if (!BN_mod(&bn, &bn1, &bn2, pctx))
-                        return false;
-                    break;
-
-                case OP_LSHIFT:
-                    if (bn2 < bnZero)
-                        return false;
-                    bn = bn1 << bn2.getulong();
-                    break;
-
-                case OP_RSHIFT:
-                    if (bn2 < bnZero)
-                        return false;
-                    bn = bn1 >> bn2.getulong();
-                    break;
-
-                case OP_BOOLAND:             bn = (bn1 != bnZero && bn2 != bnZero); break;
-                case OP_BOOLOR:              bn = (bn1 != bnZero || bn2 != bnZero); break;
-                case OP_NUMEQUAL:            bn = (bn1 == bn2); break;
-                case OP_NUMEQUALVERIFY:      bn = (bn1 == bn2); break;
-                case OP_NUMNOTEQUAL:         bn = (bn1 != bn2); break;
-                case OP_LESSTHAN:            bn = (bn1 < bn2); break;
-                case OP_GREATERTHAN:         bn = (bn1 > bn2); break;
-                case OP_LESSTHANOREQUAL:     bn = (bn1 <= bn2); break;
-                case OP_GREATERTHANOREQUAL:  bn = (bn1 >= bn2); break;
-                case OP_MIN:                 bn = (bn1 < bn2 ? bn1 : bn2); break;
-                case OP_MAX:                 bn = (bn1 > bn2 ? bn1 : bn2); break;
+                    int64 n = 0;
+                    switch (opcode)
+                    {
+                    case OP_ADD:                 n = n1 + n2; break;
+                    case OP_SUB:                 n = n1 - n2; break;
+                    case OP_MUL:                 n = n1 * n2; break;
+                    case OP_BOOLAND:             n = (n1 != 0 && n2 != 0); break;
+                    case OP_BOOLOR:              n = (n1 != 0 || n2 != 0); break;
+                    case OP_NUMEQUAL:            n = (n1 == n2); break;
+                    case OP_NUMEQUALVERIFY:      n = (n1 == n2); break;
+                    case OP_NUMNOTEQUAL:         n = (n1 != n2); break;
+                    case OP_LESSTHAN:            n = (n1 < n2); break;
+                    case OP_GREATERTHAN:         n = (n1 > n2); break;
+                    case OP_LESSTHANOREQUAL:     n = (n1 <= n2); break;
+                    case OP_GREATERTHANOREQUAL:  n = (n1 >= n2); break;
+                    case OP_MIN:                 n = (n1 < n2 ? n1 : n2); break;
+                    case OP_MAX:                 n = (n1 > n2 ? n1 : n2); break;
+                    }
+                    stack.pop_back();
+                    SetNativeNum(stacktop(-1), n);
+                }
+                else
+                {
+                    CAutoBN_CTX pctx;
+                    CBigNum bn1(stacktop(-2).getvch());
+                    CBigNum bn2(stacktop(-1).getvch());
+                    CBigNum bn;
+                    switch (opcode)
+                    {
+                    case OP_ADD:
+                        bn = bn1 + bn2;
+                        break;
+
+                    case OP_SUB:
+                        bn = bn1 - bn2;
+                        break;
+
+                    case OP_MUL:
+                        if (!BN_mul(&bn, &bn1, &bn2, pctx))
+                            return false;
+                        break;
+
+                    case OP_DIV:
+                        if (!BN_div(&bn, NULL, &bn1, &bn2, pctx))
+                            return false;
+                        break;
+
+                    case OP_MOD:
+                        if (!BN_mod(&bn, &bn1, &bn2, pctx))
+                            return false;
+                        break;
+
+                    case OP_LSHIFT:
+                        if (bn2 < bnZero)
+                            return false;
+                        bn = bn1 << bn2.getulong();
+                        break;
+
+                    case OP_RSHIFT:
+                        if (bn2 < bnZero)
+                            return false;
+                        bn = bn1 >> bn2.getulong();
+                        break;
+
+                    case OP_BOOLAND:             bn = (bn1 != bnZero && bn2 != bnZero); break;
+                    case OP_BOOLOR:              bn = (bn1 != bnZero || bn2 != bnZero); break;
+                    case OP_NUMEQUAL:            bn = (bn1 == bn2); break;
+                    case OP_NUMEQUALVERIFY:      bn = (bn1 == bn2); break;
+                    case OP_NUMNOTEQUAL:         bn = (bn1 != bn2); break;
+                    case OP_LESSTHAN:            bn = (bn1 < bn2); break;
+                    case OP_GREATERTHAN:         bn = (bn1 > bn2); break;
+                    case OP_LESSTHANOREQUAL:     bn = (bn1 <= bn2); break;
+                    case OP_GREATERTHANOREQUAL:  bn = (bn1 >= bn2); break;
+                    case OP_MIN:                 bn = (bn1 < bn2 ? bn1 : bn2); break;
+                    case OP_MAX:                 bn = (bn1 > bn2 ? bn1 : bn2); break;
+                    }
+                    stack.pop_back();
+                    stack.pop_back();
+                    stack.push_back(bn.getvch());
                 }
-                stack.pop_back();
-                stack.pop_back();
-                stack.push_back(bn.getvch());
 
                 if (opcode == OP_NUMEQUALVERIFY)
                 {
@@ -663,10 +1042,19 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
                 // (x min max -- out)
                 if (stack.size() < 3)
                     return false;
-                CBigNum bn1(stacktop(-3));
-                CBigNum bn2(stacktop(-2));
-                CBigNum bn3(stacktop(-1));
-                bool fValue = (bn2 <= bn1 && bn1 < bn3);
+                bool fValue;
+                int64 n1, n2, n3;
+                if (GetNativeNum(stacktop(-3), n1) && GetNativeNum(stacktop(-2), n2) && GetNativeNum(stacktop(-1), n3))
+                {
+                    fValue = (n2 <= n1 && n1 < n3);
+                }
+                else
+                {
+                    CBigNum bn1(stacktop(-3).getvch());
+                    CBigNum bn2(stacktop(-2).getvch());
+                    CBigNum bn3(stacktop(-1).getvch());
+                    fValue = (bn2 <= bn1 && bn1 < bn3);
+                }
                 stack.pop_back();
                 stack.pop_back();
                 stack.pop_back();
@@ -687,26 +1075,26 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
                 // (in -- hash)
                 if (stack.size() < 1)
                     return false;
-                valtype& vch = stacktop(-1);
-                valtype vchHash(opcode == OP_RIPEMD160 || opcode == OP_SHA1 || opcode == OP_HASH160 ? 20 : 32);
+                CStackValue& vch = stacktop(-1);
+                unsigned char pchHash[32];
+                unsigned int nHashSize = (opcode == OP_RIPEMD160 || opcode == OP_SHA1 || opcode == OP_HASH160 ? 20 : 32);
                 if (opcode == OP_RIPEMD160)
-                    RIPEMD160(&vch[0], vch.size(), &vchHash[0]);
+                    RIPEMD160(vch.begin(), vch.size(), pchHash);
                 else if (opcode == OP_SHA1)
-                    SHA1(&vch[0], vch.size(), &vchHash[0]);
+                    SHA1(vch.begin(), vch.size(), pchHash);
                 else if (opcode == OP_SHA256)
-                    SHA256(&vch[0], vch.size(), &vchHash[0]);
+                    SHA256(vch.begin(), vch.size(), pchHash);
                 else if (opcode == OP_HASH160)
                 {
-                    uint160 hash160 = Hash160(vch);
-                    memcpy(&vchHash[0], &hash160, sizeof(hash160));
+                    uint160 hash160 = Hash160(vch.begin(), vch.end());
+                    memcpy(pchHash, &hash160, sizeof(hash160));
                 }
                 else if (opcode == OP_HASH256)
                 {
                     uint256 hash = Hash(vch.begin(), vch.end());
-                    memcpy(&vchHash[0], &hash, sizeof(hash));
+                    memcpy(pchHash, &hash, sizeof(hash));
                 }
-                stack.pop_back();
-                stack.push_back(vchHash);
+                vch.assign(pchHash, pchHash + nHashSize);
             }
             break;
 
@@ -724,8 +1112,10 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
                 if (stack.size() < 2)
                     return false;
 
-                valtype& vchSig    = stacktop(-2);
-                valtype& vchPubKey = stacktop(-1);
+                // CheckSig and the script code want real vectors, signature
+                // checking allocates anyway
+                valtype vchSig    = stacktop(-2).getvch();
+                valtype vchPubKey = stacktop(-1).getvch();
 
                 ////// debug print
                 //PrintHex(vchSig.begin(), vchSig.end(), "sig: %s\n");
@@ -737,7 +1127,7 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
                 // Drop the signature, since there's no way for a signature to sign itself
                 scriptCode.FindAndDelete(CScript(vchSig));
 
-                bool fSuccess = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType);
+                bool fSuccess = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, psighashcache);
 
                 stack.pop_back();
                 stack.pop_back();
@@ -766,7 +1156,7 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
                 if (stack.size() < i)
                     return false;
 
-                int nKeysCount = CBigNum(stacktop(-i)).getint();
+                int nKeysCount = GetStackInt(stacktop(-i));
                 if (nKeysCount < 0)
                     return false;
                 int ikey = ++i;
@@ -774,7 +1164,7 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
                 if (stack.size() < i)
                     return false;
 
-                int nSigsCount = CBigNum(stacktop(-i)).getint();
+                int nSigsCount = GetStackInt(stacktop(-i));
                 if (nSigsCount < 0 || nSigsCount > nKeysCount)
                     return false;
                 int isig = ++i;
@@ -788,18 +1178,17 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
                 // Drop the signatures, since there's no way for a signature to sign itself
                 for (int i = 0; i < nSigsCount; i++)
                 {
-                    valtype& vchSig = stacktop(-isig-i);
-                    scriptCode.FindAndDelete(CScript(vchSig));
+                    scriptCode.FindAndDelete(CScript(stacktop(-isig-i).getvch()));
                 }
 
                 bool fSuccess = true;
                 while (fSuccess && nSigsCount > 0)
                 {
-                    valtype& vchSig    = stacktop(-isig);
-                    valtype& vchPubKey = stacktop(-ikey);
+                    valtype vchSig    = stacktop(-isig).getvch();
+                    valtype vchPubKey = stacktop(-ikey).getvch();
 
                     // Check signature
-                    if (CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType))
+                    if (CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, psighashcache))
                     {
                         isig++;
                         nSigsCount--;
@@ -834,7 +1223,8 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
 
 
     if (pvStackRet)
-        *pvStackRet = stack;
+        for (CScriptStack::iterator it = stack.begin(); it != stack.end(); ++it)
+            pvStackRet->push_back(it->getvch());
     return (stack.empty() ? false : CastToBool(stack.back()));
 }
 
@@ -923,20 +1313,246 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
      * Serialize and hash whatever inputs and outputs we have
      * based on the logic above.
      */
-    CDataStream ss(SER_GETHASH);
-    ss.reserve(10000);
+    CHashWriter ss(SER_GETHASH);
     ss << txTmp << nHashType;
-    return Hash(ss.begin(), ss.end());
+    return ss.GetHash();
 }
 
 
-bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode,
-              const CTransaction& txTo, unsigned int nIn, int nHashType)
+CSignatureHashCache::CSignatureHashCache(const CTransaction& txToIn) : txTo(txToIn),
+    ssBlankIn(SER_GETHASH), ssBlankInNoSeq(SER_GETHASH), ssOut(SER_GETHASH)
 {
-    CKey key;
-    if (!key.SetPubKey(vchPubKey))
-        return false;
+    unsigned int nInputs = txTo.vin.size();
+    ssBlankIn.reserve(nInputs * BLANK_TXIN_SIZE);
+    ssBlankInNoSeq.reserve(nInputs * BLANK_TXIN_SIZE);
+    foreach(const CTxIn& txin, txTo.vin)
+    {
+        ssBlankIn << txin.prevout << CScript() << txin.nSequence;
+        ssBlankInNoSeq << txin.prevout << CScript() << (unsigned int)0;
+    }
+    assert(ssBlankIn.size() == nInputs * BLANK_TXIN_SIZE);
+
+    vOutPos.reserve(txTo.vout.size() + 1);
+    foreach(const CTxOut& txout, txTo.vout)
+    {
+        vOutPos.push_back(ssOut.size());
+        ssOut << txout;
+    }
+    vOutPos.push_back(ssOut.size());
+
+    // Running hash of the SIGHASH_ALL prefix, one snapshot per input
+    CHashWriter ss(SER_GETHASH);
+    ss << txTo.nVersion;
+    WriteCompactSize(ss, nInputs);
+    vPrefix.reserve(nInputs);
+    for (unsigned int i = 0; i < nInputs; i++)
+    {
+        vPrefix.push_back(ss);
+        ss.write(&ssBlankIn.begin()[i * BLANK_TXIN_SIZE], BLANK_TXIN_SIZE);
+    }
+}
+
+/**
+ * Same result as SignatureHash(scriptCode, txTo, nIn, nHashType), built
+ * from the precomputed pieces instead of a modified copy of txTo.
+ */
+uint256 CSignatureHashCache::SignatureHash(CScript scriptCode, unsigned int nIn, int nHashType) const
+{
+    if (nIn >= txTo.vin.size())
+    {
+        printf("ERROR: SignatureHash() : nIn=%d out of range\n", nIn);
+        return 1;
+    }
+    unsigned int nInputs = txTo.vin.size();
+    int nMode = (nHashType & 0x1f);
+    bool fAnyoneCanPay = (nHashType & SIGHASH_ANYONECANPAY);
+    if (nMode == SIGHASH_SINGLE && nIn >= txTo.vout.size())
+    {
+        printf("ERROR: SignatureHash() : nOut=%d out of range\n", nIn);
+        return 1;
+    }
+
+    scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
+    const CTxIn& txin = txTo.vin[nIn];
+
+    // Inputs
+    CHashWriter ss(SER_GETHASH);
+    if (fAnyoneCanPay)
+    {
+        ss << txTo.nVersion;
+        WriteCompactSize(ss, 1);
+        ss << txin.prevout << scriptCode << txin.nSequence;
+    }
+    else if (nMode == SIGHASH_NONE || nMode == SIGHASH_SINGLE)
+    {
+        // The other inputs' nSequence is zeroed, so the prefix snapshots don't apply
+        ss << txTo.nVersion;
+        WriteCompactSize(ss, nInputs);
+        const char* pBlankInNoSeq = &ssBlankInNoSeq.begin()[0];
+        ss.write(pBlankInNoSeq, nIn * BLANK_TXIN_SIZE);
+        ss << txin.prevout << scriptCode << txin.nSequence;
+        ss.write(pBlankInNoSeq + (nIn+1) * BLANK_TXIN_SIZE, (nInputs - nIn - 1) * BLANK_TXIN_SIZE);
+    }
+    else
+    {
+        ss = vPrefix[nIn];
+        ss << txin.prevout << scriptCode << txin.nSequence;
+        ss.write(&ssBlankIn.begin()[0] + (nIn+1) * BLANK_TXIN_SIZE, (nInputs - nIn - 1) * BLANK_TXIN_SIZE);
+    }
+
+    // Outputs
+    if (nMode == SIGHASH_NONE)
+    {
+        WriteCompactSize(ss, 0);
+    }
+    else if (nMode == SIGHASH_SINGLE)
+    {
+        CTxOut txoutNull;
+        WriteCompactSize(ss, nIn + 1);
+        for (unsigned int i = 0; i < nIn; i++)
+            ss << txoutNull;
+        ss.write(&ssOut.begin()[vOutPos[nIn]], vOutPos[nIn+1] - vOutPos[nIn]);
+    }
+    else
+    {
+        WriteCompactSize(ss, txTo.vout.size());
+        if (!ssOut.empty())
+            ss.write(&ssOut.begin()[0], ssOut.size());
+    }
+
+    ss << txTo.nLockTime << nHashType;
+    return ss.GetHash();
+}
+
+
+//
+// Signature cache
+//
+// Transactions are usually verified once when they're relayed to us and
+// again when the block containing them is connected.  Every (sighash,
+// pubkey, signature) that passed ECDSA verification is remembered here so
+// the second check is a set lookup.  Only successes are stored, keyed by a
+// hash of all three, and when full a random entry is thrown out.
+//
+static const unsigned int MAX_SIGCACHE_SIZE = 50000;
+static CCriticalSection cs_setSigCache;
+static set<uint256> setSigCache;
+
+static uint256 GetSigCacheEntry(const uint256& hash, const vector<unsigned char>& vchPubKey, const vector<unsigned char>& vchSig)
+{
+    CHashWriter ss(SER_GETHASH);
+    ss << hash << vchPubKey << vchSig;
+    return ss.GetHash();
+}
+
+//
+// Public key cache
+//
+// The same pubkeys come up over and over (a miner's coinbase key, a
+// merchant's receiving key), so parsed EC_KEYs are kept around, least
+// recently used first out, along with the native secp256k1 form.  The
+// cache holds one reference to each key and every user takes another, so
+// a key evicted while it's being verified with stays valid until that
+// CKey is done with it.
+//
+struct CCachedPubKey
+{
+    EC_KEY* pkey;
+    bool fNative;
+    secp256k1::PubKey pubkeyNative;
+    list<valtype>::iterator itLRU;
+};
+
+static const unsigned int MAX_PUBKEYCACHE_SIZE = 1000;
+static CCriticalSection cs_mapPubKeyCache;
+static list<valtype> listPubKeyLRU;
+static map<valtype, CCachedPubKey> mapPubKeyCache;
+
+// Returns a new reference to the parsed key, or NULL if it doesn't parse.
+// fNativeRet says whether pubkeyNativeRet was filled in.
+static EC_KEY* GetCachedPubKey(const valtype& vchPubKey, secp256k1::PubKey& pubkeyNativeRet, bool& fNativeRet)
+{
+    CRITICAL_BLOCK(cs_mapPubKeyCache)
+    {
+        map<valtype, CCachedPubKey>::iterator mi = mapPubKeyCache.find(vchPubKey);
+        if (mi != mapPubKeyCache.end())
+        {
+            CCachedPubKey& entry = (*mi).second;
+            listPubKeyLRU.splice(listPubKeyLRU.begin(), listPubKeyLRU, entry.itLRU);
+            EC_KEY_up_ref(entry.pkey);
+            pubkeyNativeRet = entry.pubkeyNative;
+            fNativeRet = entry.fNative;
+            return entry.pkey;
+        }
+    }
+
+    // Parse it outside the lock
+    if (vchPubKey.empty())
+        return NULL;
+    EC_KEY* pkey = EC_KEY_new_by_curve_name(NID_secp256k1);
+    if (pkey == NULL)
+        return NULL;
+    const unsigned char* pbegin = &vchPubKey[0];
+    if (!o2i_ECPublicKey(&pkey, &pbegin, vchPubKey.size()))
+    {
+        EC_KEY_free(pkey);
+        return NULL;
+    }
+    // Set up OpenSSL's lazily attached ECDSA data now, before other threads share it
+    ECDSA_size(pkey);
+    fNativeRet = secp256k1::ParsePubKey(pubkeyNativeRet, &vchPubKey[0], vchPubKey.size());
+
+    CRITICAL_BLOCK(cs_mapPubKeyCache)
+    {
+        if (mapPubKeyCache.count(vchPubKey))
+            return pkey;
+        while (mapPubKeyCache.size() >= MAX_PUBKEYCACHE_SIZE)
+        {
+            map<valtype, CCachedPubKey>::iterator mi = mapPubKeyCache.find(listPubKeyLRU.back());
+            EC_KEY_free((*mi).second.pkey);
+            mapPubKeyCache.erase(mi);
+            listPubKeyLRU.pop_back();
+        }
+        listPubKeyLRU.push_front(vchPubKey);
+        EC_KEY_up_ref(pkey);
+        CCachedPubKey& entry = mapPubKeyCache[vchPubKey];
+        entry.pkey = pkey;
+        entry.fNative = fNativeRet;
+        entry.pubkeyNative = pubkeyNativeRet;
+        entry.itLRU = listPubKeyLRU.begin();
+    }
+    return pkey;
+}
+
+static bool IsSigCached(const uint256& hashEntry)
+{
+    CRITICAL_BLOCK(cs_setSigCache)
+        return setSigCache.count(hashEntry) != 0;
+    return false;
+}
+
+static void AddSigCache(const uint256& hashEntry)
+{
+    CRITICAL_BLOCK(cs_setSigCache)
+    {
+        while (setSigCache.size() >= MAX_SIGCACHE_SIZE)
+        {
+            // Evict whatever entry follows a random point
+            uint256 hashRand;
+            RAND_bytes((unsigned char*)&hashRand, sizeof(hashRand));
+            set<uint256>::iterator it = setSigCache.lower_bound(hashRand);
+            if (it == setSigCache.end())
+                it = setSigCache.begin();
+            setSigCache.erase(it);
+        }
+        setSigCache.insert(hashEntry);
+    }
+}
+
 
+bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode,
+              const CTransaction& txTo, unsigned int nIn, int nHashType, const CSignatureHashCache* psighashcache)
+{
     // Hash type is one byte tacked on to the end of the signature
     if (vchSig.empty())
         return false;
@@ -946,10 +1562,27 @@ bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CSc
         return false;
     vchSig.pop_back();
 
-    if (key.Verify(SignatureHash(scriptCode, txTo, nIn, nHashType), vchSig))
+    uint256 hash;
+    if (psighashcache)
+        hash = psighashcache->SignatureHash(scriptCode, nIn, nHashType);
+    else
+        hash = SignatureHash(scriptCode, txTo, nIn, nHashType);
+
+    uint256 hashEntry = GetSigCacheEntry(hash, vchPubKey, vchSig);
+    if (IsSigCached(hashEntry))
         return true;
 
-    return false;
+    secp256k1::PubKey pubkeyNative;
+    bool fNative = false;
+    EC_KEY* pkey = GetCachedPubKey(vchPubKey, pubkeyNative, fNative);
+    if (pkey == NULL)
+        return false;
+    CKey key(pkey, fNative ? &pubkeyNative : NULL);
+    if (!key.Verify(hash, vchSig))
+        return false;
+
+    AddSigCache(hashEntry);
+    return true;
 }
 
 
@@ -962,19 +1595,24 @@ bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CSc
 
 
 
-bool Solver(const CScript& scriptPubKey, vector<pair<opcodetype, valtype> >& vSolutionRet)
+// Templates, built during static initialization so the script check
+// threads never race to fill them in
+static vector<CScript> GetStandardTemplates()
 {
-    // Templates
-    static vector<CScript> vTemplates;
-    if (vTemplates.empty())
-    {
-        // Standard tx, sender provides pubkey, receiver adds signature
-        vTemplates.push_back(CScript() << OP_PUBKEY << OP_CHECKSIG);
+    vector<CScript> vTemplates;
 
-        // Short account number tx, sender provides hash of pubkey, receiver provides signature and pubkey
-        vTemplates.push_back(CScript() << OP_DUP << OP_HASH160 << OP_PUBKEYHASH << OP_EQUALVERIFY << OP_CHECKSIG);
-    }
+    // Standard tx, sender provides pubkey, receiver adds signature
+    vTemplates.push_back(CScript() << OP_PUBKEY << OP_CHECKSIG);
+
+    // Short account number tx, sender provides hash of pubkey, receiver provides signature and pubkey
+    vTemplates.push_back(CScript() << OP_DUP << OP_HASH160 << OP_PUBKEYHASH << OP_EQUALVERIFY << OP_CHECKSIG);
+
+    return vTemplates;
+}
+static const vector<CScript> vTemplates = GetStandardTemplates();
 
+bool Solver(const CScript& scriptPubKey, vector<pair<opcodetype, valtype> >& vSolutionRet)
+{
     // Scan templates
     const CScript& script1 = scriptPubKey;
     foreach(const CScript& script2, vTemplates)
@@ -988,15 +1626,15 @@ bool Solver(const CScript& scriptPubKey, vector<pair<opcodetype, valtype> >& vSo
         CScript::const_iterator pc2 = script2.begin();
         loop
         {
-            bool f1 = script1.GetOp(pc1, opcode1, vch1);
-            bool f2 = script2.GetOp(pc2, opcode2, vch2);
-            if (!f1 && !f2)
+            // Both used up cleanly, a truncated opcode at the end of
+            // script1 is a failed GetOp, not a match
+            if (pc1 == script1.end() && pc2 == script2.end())
             {
                 // Success
                 reverse(vSolutionRet.begin(), vSolutionRet.end());
                 return true;
             }
-            else if (f1 != f2)
+            if (!script1.GetOp(pc1, opcode1, vch1) || !script2.GetOp(pc2, opcode2, vch2))
             {
                 break;
             }
@@ -1083,8 +1721,68 @@ bool Solver(const CScript& scriptPubKey, uint256 hash, int nHashType, CScript& s
 }
 
 
+//
+// Wallet key index
+//
+// IsMine is asked about every output of every transaction we see, so
+// the two standard forms are picked out by their exact bytes and looked
+// up in hash sets of our pubkeys and pubkey hashes, kept in step with
+// mapKeys under cs_mapKeys.  Anything else still goes through Solver.
+//
+struct CPubKeyHasher
+{
+    size_t operator()(const valtype& vch) const
+    {
+        // Past the 0x04 prefix it's the x coordinate, already well mixed
+        size_t n = 0;
+        if (vch.size() > sizeof(n))
+            memcpy(&n, &vch[1], sizeof(n));
+        return n;
+    }
+};
+
+struct CHash160Hasher
+{
+    size_t operator()(const uint160& hash) const
+    {
+        size_t n;
+        memcpy(&n, &hash, sizeof(n));
+        return n;
+    }
+};
+
+static boost::unordered_set<valtype, CPubKeyHasher> setMyPubKeys;
+static boost::unordered_set<uint160, CHash160Hasher> setMyPubKeyHashes;
+
+// Caller holds cs_mapKeys
+void AddKeyToIndex(const vector<unsigned char>& vchPubKey)
+{
+    setMyPubKeys.insert(vchPubKey);
+    setMyPubKeyHashes.insert(Hash160(vchPubKey));
+}
+
 bool IsMine(const CScript& scriptPubKey)
 {
+    unsigned int nSize = scriptPubKey.size();
+
+    // <pubkey> OP_CHECKSIG, with the pubkey pushed by its length byte
+    if (nSize >= 35 && nSize <= 77 && scriptPubKey[0] == nSize - 2 && scriptPubKey[nSize - 1] == OP_CHECKSIG)
+    {
+        valtype vchPubKey(scriptPubKey.begin() + 1, scriptPubKey.end() - 1);
+        CRITICAL_BLOCK(cs_mapKeys)
+            return setMyPubKeys.count(vchPubKey) != 0;
+    }
+
+    // OP_DUP OP_HASH160 <hash160> OP_EQUALVERIFY OP_CHECKSIG
+    if (nSize == 25 && scriptPubKey[0] == OP_DUP && scriptPubKey[1] == OP_HASH160 && scriptPubKey[2] == sizeof(uint160) &&
+        scriptPubKey[23] == OP_EQUALVERIFY && scriptPubKey[24] == OP_CHECKSIG)
+    {
+        uint160 hash160;
+        memcpy(&hash160, &scriptPubKey[3], sizeof(hash160));
+        CRITICAL_BLOCK(cs_mapKeys)
+            return setMyPubKeyHashes.count(hash160) != 0;
+    }
+
     CScript scriptSig;
     return Solver(scriptPubKey, 0, 0, scriptSig);
 }
@@ -1172,6 +1870,7 @@ bool SignSignature(const CTransaction& txFrom, CTransaction& txTo, unsigned int
         return false;
 
     txin.scriptSig = scriptPrereq + txin.scriptSig;
+    txTo.ClearCache();
 
     // Test solution to ensure that it's correct.
     if (scriptPrereq.empty())
@@ -1182,7 +1881,88 @@ bool SignSignature(const CTransaction& txFrom, CTransaction& txTo, unsigned int
 }
 
 
-bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, int nHashType)
+/**
+ * Checks a scriptSig against one of the two standard scriptPubKeys Solver
+ * knows directly, with no interpreter stack or bignums.  Only handles
+ * scriptSigs that are nothing but the pushes the template needs, and then
+ * gives exactly the result EvalScript would have:
+ *
+ *   <sig> | <pubkey> OP_CHECKSIG
+ *   <sig> <pubkey> | OP_DUP OP_HASH160 <hash160> OP_EQUALVERIFY OP_CHECKSIG
+ *
+ * The scriptPubKey has to be exactly the standard bytes, the same match
+ * IsMine does.  Anything with a trailing or truncated opcode fails in
+ * EvalScript and has to be left to it.
+ *
+ * Returns false if the scripts aren't one of these, with fResultRet unset.
+ */
+bool VerifyStandardScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, int nHashType,
+                          const CSignatureHashCache* psighashcache, bool& fResultRet)
+{
+    unsigned int nSize = scriptPubKey.size();
+    opcodetype opcodeTemplate;
+    valtype vchSolution;
+    if ((nSize == 35 || nSize == 67) && scriptPubKey[0] == nSize - 2 && scriptPubKey[nSize - 1] == OP_CHECKSIG)
+    {
+        // <pubkey> OP_CHECKSIG
+        opcodeTemplate = OP_PUBKEY;
+        vchSolution.assign(scriptPubKey.begin() + 1, scriptPubKey.end() - 1);
+    }
+    else if (nSize == 25 && scriptPubKey[0] == OP_DUP && scriptPubKey[1] == OP_HASH160 && scriptPubKey[2] == sizeof(uint160) &&
+             scriptPubKey[23] == OP_EQUALVERIFY && scriptPubKey[24] == OP_CHECKSIG)
+    {
+        // OP_DUP OP_HASH160 <hash160> OP_EQUALVERIFY OP_CHECKSIG
+        opcodeTemplate = OP_PUBKEYHASH;
+        vchSolution.assign(scriptPubKey.begin() + 3, scriptPubKey.begin() + 23);
+    }
+    else
+    {
+        return false;
+    }
+
+    // The scriptSig has to be plain pushes, as many as the template takes
+    unsigned int nPushesNeeded = (opcodeTemplate == OP_PUBKEY ? 1 : 2);
+    valtype vchPush[2];
+    unsigned int nPushes = 0;
+    CScript::const_iterator pc = scriptSig.begin();
+    while (pc < scriptSig.end())
+    {
+        opcodetype opcode;
+        valtype vch;
+        if (!scriptSig.GetOp(pc, opcode, vch) || opcode > OP_PUSHDATA4 || nPushes == nPushesNeeded)
+            return false;
+        vchPush[nPushes++].swap(vch);
+    }
+    if (nPushes != nPushesNeeded)
+        return false;
+
+    const valtype& vchSig = vchPush[0];
+    const valtype& vchPubKey = (opcodeTemplate == OP_PUBKEY ? vchSolution : vchPush[1]);
+    if (opcodeTemplate == OP_PUBKEYHASH && Hash160(vchPubKey) != uint160(vchSolution))
+    {
+        // OP_EQUALVERIFY fails
+        fResultRet = false;
+        return true;
+    }
+
+    // Same scriptCode OP_CHECKSIG would use, the code after the codeseparator
+    CScript scriptCode(scriptPubKey);
+    scriptCode.FindAndDelete(CScript(vchSig));
+    fResultRet = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, psighashcache);
+    return true;
+}
+
+bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, int nHashType,
+                  const CSignatureHashCache* psighashcache)
+{
+    bool fResult;
+    if (VerifyStandardScript(scriptSig, scriptPubKey, txTo, nIn, nHashType, psighashcache, fResult))
+        return fResult;
+    return EvalScript(scriptSig + CScript(OP_CODESEPARATOR) + scriptPubKey, txTo, nIn, nHashType, NULL, psighashcache);
+}
+
+
+bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, int nHashType, const CSignatureHashCache* psighashcache)
 {
     assert(nIn < txTo.vin.size());
     const CTxIn& txin = txTo.vin[nIn];
@@ -1193,5 +1973,77 @@ bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsig
     if (txin.prevout.hash != txFrom.GetHash())
         return false;
 
-    return EvalScript(txin.scriptSig + CScript(OP_CODESEPARATOR) + txout.scriptPubKey, txTo, nIn, nHashType);
+    return VerifyScript(txin.scriptSig, txout.scriptPubKey, txTo, nIn, nHashType, psighashcache);
+}
+
+
+
+
+//
+// CScriptCheckQueue
+//
+
+const CSignatureHashCache* CScriptCheckQueue::AddSigHashCache(const CTransaction& txTo)
+{
+    listSigHashCache.push_back(CSignatureHashCache(txTo));
+    return &listSigHashCache.back();
+}
+
+/**
+ * Does the cheap part of VerifySignature now and queues the script
+ * evaluation for Run().  Returns false if the input doesn't even point
+ * at txFrom.
+ */
+bool CScriptCheckQueue::Add(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, const CSignatureHashCache* psighashcache)
+{
+    assert(nIn < txTo.vin.size());
+    const CTxIn& txin = txTo.vin[nIn];
+    if (txin.prevout.n >= txFrom.vout.size())
+        return false;
+    if (txin.prevout.hash != txFrom.GetHash())
+        return false;
+
+    vChecks.push_back(CScriptCheck());
+    CScriptCheck& check = vChecks.back();
+    check.scriptPubKey = txFrom.vout[txin.prevout.n].scriptPubKey;
+    check.ptxTo = &txTo;
+    check.nIn = nIn;
+    check.psighashcache = psighashcache;
+    return true;
+}
+
+// Each thread takes the next unclaimed check until they're all done or one fails
+void CScriptCheckQueue::RunChecks()
+{
+    while (!fFailed)
+    {
+        unsigned int i = InterlockedIncrement(&nNext) - 1;
+        if (i >= vChecks.size())
+            break;
+        const CScriptCheck& check = vChecks[i];
+        const CTxIn& txin = check.ptxTo->vin[check.nIn];
+        if (!VerifyScript(txin.scriptSig, check.scriptPubKey, *check.ptxTo, check.nIn, 0, check.psighashcache))
+            InterlockedExchange(&fFailed, 1);
+    }
+}
+
+static void RunChecksOnPool(void* parg)
+{
+    ((CScriptCheckQueue*)parg)->RunChecks();
+}
+
+/**
+ * Runs every queued check, on the calling thread plus up to nThreads-1
+ * threads of the worker pool, and returns true if they all passed.
+ * Small batches aren't worth waking the pool for.
+ */
+bool CScriptCheckQueue::Run(int nThreads)
+{
+    nNext = 0;
+    fFailed = 0;
+    if (nThreads <= 1 || vChecks.size() < SCRIPTCHECK_PARALLEL_MIN_CHECKS)
+        RunChecks();
+    else
+        RunOnWorkerPool(RunChecksOnPool, this, min(nThreads - 1, (int)vChecks.size() - 1));
+    return !fFailed;
 }
@@ -533,8 +533,22 @@ public:
 
     bool GetOp(const_iterator& pc, opcodetype& opcodeRet, vector<unsigned char>& vchRet) const
     {
-        opcodeRet = OP_INVALIDOPCODE;
+        const_iterator pvch;
+        unsigned int nSize;
         vchRet.clear();
+        if (!GetOp(pc, opcodeRet, pvch, nSize))
+            return false;
+        vchRet.assign(pvch, pvch + nSize);
+        return true;
+    }
+
+    // Same as above, but points pvchRet at the pushed data in the script
+    // instead of copying it out.  nSizeRet is 0 for anything but a push.
+    bool GetOp(const_iterator& pc, opcodetype& opcodeRet, const_iterator& pvchRet, unsigned int& nSizeRet) const
+    {
+        opcodeRet = OP_INVALIDOPCODE;
+        pvchRet = pc;
+        nSizeRet = 0;
         if (pc >= end())
             return false;
 
@@ -578,7 +592,8 @@ public:
             }
             if (pc + nSize > end())
                 return false;
-            vchRet.assign(pc, pc + nSize);
+            pvchRet = pc;
+            nSizeRet = nSize;
             pc += nSize;
         }
 
@@ -642,11 +657,79 @@ public:
 
 
 
+/**
+ * Precomputed pieces of a transaction's signature hashes.
+ *
+ * SignatureHash copies and reserializes the whole transaction for every
+ * input, so checking all N inputs hashes O(N^2) bytes and copies just as
+ * much.  This serializes the parts that don't depend on which input is
+ * being checked once: every input with its scriptSig blanked (with and
+ * without its nSequence), and the outputs.  It also keeps the SHA-256
+ * state after the version and the first i blanked inputs, so the SIGHASH_ALL
+ * hash of input i only has to run over the inputs after it and the outputs.
+ *
+ * Gives exactly the same hashes as SignatureHash.  Read-only once built,
+ * and the transaction must not change while it's in use.
+ */
+class CSignatureHashCache
+{
+public:
+    const CTransaction& txTo;
+
+    CSignatureHashCache(const CTransaction& txToIn);
+    uint256 SignatureHash(CScript scriptCode, unsigned int nIn, int nHashType) const;
+
+protected:
+    // An input with its scriptSig blanked always serializes to this many bytes:
+    // 32 byte hash + 4 byte n, 1 byte empty script, 4 byte nSequence
+    enum { BLANK_TXIN_SIZE = 41 };
+
+    CDataStream ssBlankIn;       // every input with an empty scriptSig, back to back
+    CDataStream ssBlankInNoSeq;  // the same with nSequence zeroed too
+    CDataStream ssOut;           // every output, back to back, without the count
+    vector<unsigned int> vOutPos;  // start of output i in ssOut, plus the end
+    vector<CHashWriter> vPrefix;   // state after nVersion, vin.size() and blank inputs [0,i)
+};
+
+/**
+ * The signature checks of a whole block.  ConnectInputs queues them here
+ * while it does the txindex bookkeeping, then Run() works through them all
+ * on several threads at once, using a pool of threads that's kept between
+ * blocks.  The transactions must not move or change
+ * until Run() returns.
+ */
+class CScriptCheckQueue
+{
+protected:
+    struct CScriptCheck
+    {
+        CScript scriptPubKey;
+        const CTransaction* ptxTo;
+        unsigned int nIn;
+        const CSignatureHashCache* psighashcache;
+    };
+
+    list<CSignatureHashCache> listSigHashCache;
+    vector<CScriptCheck> vChecks;
+    volatile LONG nNext;
+    volatile LONG fFailed;
+
+public:
+    const CSignatureHashCache* AddSigHashCache(const CTransaction& txTo);
+    bool Add(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, const CSignatureHashCache* psighashcache);
+    unsigned int size() const { return vChecks.size(); }
+    bool Run(int nThreads);
+    void RunChecks();
+};
+
 bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType=0,
-                vector<vector<unsigned char> >* pvStackRet=NULL);
+                vector<vector<unsigned char> >* pvStackRet=NULL, const CSignatureHashCache* psighashcache=NULL);
 uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+void AddKeyToIndex(const vector<unsigned char>& vchPubKey);
 bool IsMine(const CScript& scriptPubKey);
 bool ExtractPubKey(const CScript& scriptPubKey, bool fMineOnly, vector<unsigned char>& vchPubKeyRet);
 bool ExtractHash160(const CScript& scriptPubKey, uint160& hash160Ret);
 bool SignSignature(const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL, CScript scriptPrereq=CScript());
-bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, int nHashType=0);
+bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, int nHashType=0,
+                  const CSignatureHashCache* psighashcache=NULL);
+bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, int nHashType=0, const CSignatureHashCache* psighashcache=NULL);
@@ -0,0 +1,1302 @@
+// Copyright (c) 2009 Satoshi Nakamoto
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+
+#include <string.h>
+#include "secp256k1.h"
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#endif
+
+// Building with SECP256K1_NO_INT128 forces the portable code for 64x64
+// bit multiplies even where the compiler has something faster, so that
+// path can be tested too
+#if defined(__SIZEOF_INT128__) && !defined(SECP256K1_NO_INT128)
+#define SECP256K1_INT128
+#endif
+
+namespace secp256k1
+{
+
+//
+// 64x64->128 bit multiply and the accumulators built on it
+//
+
+static inline void Mul64(word64 a, word64 b, word64& lo, word64& hi)
+{
+#if defined(SECP256K1_INT128)
+    unsigned __int128 r = (unsigned __int128)a * b;
+    lo = (word64)r;
+    hi = (word64)(r >> 64);
+#elif defined(_MSC_VER) && defined(_M_X64) && !defined(SECP256K1_NO_INT128)
+    lo = _umul128(a, b, &hi);
+#else
+    word64 a0 = a & 0xFFFFFFFF, a1 = a >> 32;
+    word64 b0 = b & 0xFFFFFFFF, b1 = b >> 32;
+    word64 p00 = a0 * b0, p01 = a0 * b1, p10 = a1 * b0, p11 = a1 * b1;
+    word64 mid = (p00 >> 32) + (p01 & 0xFFFFFFFF) + (p10 & 0xFFFFFFFF);
+    lo = (mid << 32) | (p00 & 0xFFFFFFFF);
+    hi = p11 + (p01 >> 32) + (p10 >> 32) + (mid >> 32);
+#endif
+}
+
+#if defined(SECP256K1_INT128)
+struct Acc128
+{
+    unsigned __int128 v;
+};
+
+static inline void AccClear(Acc128& c)
+{
+    c.v = 0;
+}
+
+static inline void AccAdd(Acc128& c, word64 a)
+{
+    c.v += a;
+}
+
+static inline void AccMulAdd(Acc128& c, word64 a, word64 b)
+{
+    c.v += (unsigned __int128)a * b;
+}
+
+static inline word64 AccExtract52(Acc128& c)
+{
+    word64 r = (word64)c.v & 0xFFFFFFFFFFFFFULL;
+    c.v >>= 52;
+    return r;
+}
+
+static inline word64 AccLow(const Acc128& c)
+{
+    return (word64)c.v;
+}
+#else
+struct Acc128
+{
+    word64 lo, hi;
+};
+
+static inline void AccClear(Acc128& c)
+{
+    c.lo = c.hi = 0;
+}
+
+static inline void AccAdd(Acc128& c, word64 a)
+{
+    c.lo += a;
+    c.hi += (c.lo < a);
+}
+
+static inline void AccMulAdd(Acc128& c, word64 a, word64 b)
+{
+    word64 lo, hi;
+    Mul64(a, b, lo, hi);
+    c.lo += lo;
+    c.hi += hi + (c.lo < lo);
+}
+
+static inline word64 AccExtract52(Acc128& c)
+{
+    word64 r = c.lo & 0xFFFFFFFFFFFFFULL;
+    c.lo = (c.lo >> 52) | (c.hi << 12);
+    c.hi >>= 52;
+    return r;
+}
+
+static inline word64 AccLow(const Acc128& c)
+{
+    return c.lo;
+}
+#endif
+
+struct Acc192
+{
+    word64 c0, c1, c2;
+};
+
+static inline void AccAdd(Acc192& c, word64 a)
+{
+    c.c0 += a;
+    word64 carry = (c.c0 < a);
+    c.c1 += carry;
+    c.c2 += (c.c1 < carry);
+}
+
+static inline void AccMulAdd(Acc192& c, word64 a, word64 b)
+{
+    word64 lo, hi;
+    Mul64(a, b, lo, hi);
+    c.c0 += lo;
+    hi += (c.c0 < lo);
+    c.c1 += hi;
+    c.c2 += (c.c1 < hi);
+}
+
+static inline word64 AccExtract64(Acc192& c)
+{
+    word64 r = c.c0;
+    c.c0 = c.c1;
+    c.c1 = c.c2;
+    c.c2 = 0;
+    return r;
+}
+
+
+
+
+//
+// Field arithmetic mod p = 2^256 - 2^32 - 977
+//
+// Every function leaves its result weakly normalized: limbs 0-3 below
+// 2^52 and limb 4 below 2^49, so the value is under 2^257 but not
+// necessarily fully reduced.  FeNormalize reduces it to [0, p).
+//
+
+static const word64 M52 = 0xFFFFFFFFFFFFFULL;
+static const word64 M48 = 0xFFFFFFFFFFFFULL;
+static const word64 R256 = 0x1000003D1ULL;     // 2^256 mod p
+static const word64 R260 = 0x1000003D10ULL;    // 2^260 mod p
+
+static const FieldElem feP4 = {{ 0x3FFFFBFFFFF0BCULL, 0x3FFFFFFFFFFFFCULL, 0x3FFFFFFFFFFFFCULL, 0x3FFFFFFFFFFFFCULL, 0x3FFFFFFFFFFFCULL }};
+static const FieldElem feBeta = {{ 0x96C28719501EEULL, 0x7512F58995C13ULL, 0xC3434E99CF049ULL, 0x07106E64479EAULL, 0x07AE96A2B657CULL }};
+static const FieldElem feN = {{ 0x25E8CD0364141ULL, 0xE6AF48A03BBFDULL, 0xFFFFFFEBAAEDCULL, 0xFFFFFFFFFFFFFULL, 0x0FFFFFFFFFFFFULL }};
+static const FieldElem feGx = {{ 0x2815B16F81798ULL, 0xDB2DCE28D959FULL, 0xE870B07029BFCULL, 0xBBAC55A06295CULL, 0x079BE667EF9DCULL }};
+static const FieldElem feGy = {{ 0x7D08FFB10D4B8ULL, 0x48A68554199C4ULL, 0xE1108A8FD17B4ULL, 0xC4655DA4FBFC0ULL, 0x0483ADA7726A3ULL }};
+
+// p - 2 and (p + 1) / 4, big endian
+static const unsigned char pchPMinus2[32] =
+{
+    0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
+    0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xfe,0xff,0xff,0xfc,0x2d,
+};
+static const unsigned char pchPPlus1Div4[32] =
+{
+    0x3f,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
+    0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xbf,0xff,0xff,0x0c,
+};
+
+static inline void FeSetInt(FieldElem& r, int a)
+{
+    r.n[0] = a;
+    r.n[1] = r.n[2] = r.n[3] = r.n[4] = 0;
+}
+
+static inline void FeNormalizeWeak(FieldElem& r)
+{
+    word64 t0 = r.n[0], t1 = r.n[1], t2 = r.n[2], t3 = r.n[3], t4 = r.n[4];
+    word64 x = t4 >> 48;
+    t4 &= M48;
+    t0 += x * R256;
+    t1 += t0 >> 52; t0 &= M52;
+    t2 += t1 >> 52; t1 &= M52;
+    t3 += t2 >> 52; t2 &= M52;
+    t4 += t3 >> 52; t3 &= M52;
+    r.n[0] = t0; r.n[1] = t1; r.n[2] = t2; r.n[3] = t3; r.n[4] = t4;
+}
+
+static void FeNormalize(FieldElem& r)
+{
+    FeNormalizeWeak(r);
+    while (r.n[4] >> 48)
+        FeNormalizeWeak(r);
+
+    // Now below 2^256 < 2p, so at most one subtraction of p
+    if (r.n[4] == M48 && r.n[3] == M52 && r.n[2] == M52 && r.n[1] == M52 && r.n[0] >= 0xFFFFEFFFFFC2FULL)
+    {
+        r.n[0] -= 0xFFFFEFFFFFC2FULL;
+        r.n[1] = r.n[2] = r.n[3] = r.n[4] = 0;
+    }
+}
+
+static bool FeIsZero(const FieldElem& a)
+{
+    FieldElem t = a;
+    FeNormalize(t);
+    return (t.n[0] | t.n[1] | t.n[2] | t.n[3] | t.n[4]) == 0;
+}
+
+// All ones if a is zero mod p, else 0, without branching on a.  A weakly
+// normalized value is below 2^257 and its limbs are unique, so it's zero
+// only if it's exactly 0, p or 2p.
+static inline word64 FeIsZeroMask(const FieldElem& a)
+{
+    word64 z0 = a.n[0] | a.n[1] | a.n[2] | a.n[3] | a.n[4];
+    word64 z1 = (a.n[0] ^ 0xFFFFEFFFFFC2FULL) | (a.n[1] ^ M52) | (a.n[2] ^ M52) | (a.n[3] ^ M52) | (a.n[4] ^ M48);
+    word64 z2 = (a.n[0] ^ 0xFFFFDFFFFF85EULL) | (a.n[1] ^ M52) | (a.n[2] ^ M52) | (a.n[3] ^ M52) | (a.n[4] ^ 0x1FFFFFFFFFFFFULL);
+    return ((((z0 | (0 - z0)) >> 63) - 1) | (((z1 | (0 - z1)) >> 63) - 1) | (((z2 | (0 - z2)) >> 63) - 1));
+}
+
+// r = a where mask is all ones, left alone where it's 0
+static inline void FeCmov(FieldElem& r, const FieldElem& a, word64 mask)
+{
+    for (int i = 0; i < 5; i++)
+        r.n[i] = (r.n[i] & ~mask) | (a.n[i] & mask);
+}
+
+static bool FeIsOdd(const FieldElem& a)
+{
+    FieldElem t = a;
+    FeNormalize(t);
+    return (t.n[0] & 1) != 0;
+}
+
+// Returns false if the 32 byte big endian value isn't below p
+static bool FeSetB32(FieldElem& r, const unsigned char* pch)
+{
+    word64 w[4];
+    for (int i = 0; i < 4; i++)
+    {
+        const unsigned char* p = pch + 24 - 8 * i;
+        w[i] = ((word64)p[0] << 56) | ((word64)p[1] << 48) | ((word64)p[2] << 40) | ((word64)p[3] << 32) |
+               ((word64)p[4] << 24) | ((word64)p[5] << 16) | ((word64)p[6] << 8) | (word64)p[7];
+    }
+    r.n[0] = w[0] & M52;
+    r.n[1] = ((w[0] >> 52) | (w[1] << 12)) & M52;
+    r.n[2] = ((w[1] >> 40) | (w[2] << 24)) & M52;
+    r.n[3] = ((w[2] >> 28) | (w[3] << 36)) & M52;
+    r.n[4] = w[3] >> 16;
+    return !(r.n[4] == M48 && r.n[3] == M52 && r.n[2] == M52 && r.n[1] == M52 && r.n[0] >= 0xFFFFEFFFFFC2FULL);
+}
+
+// a must be normalized
+static void FeGetB32(unsigned char* pch, const FieldElem& a)
+{
+    word64 w[4];
+    w[0] = a.n[0] | (a.n[1] << 52);
+    w[1] = (a.n[1] >> 12) | (a.n[2] << 40);
+    w[2] = (a.n[2] >> 24) | (a.n[3] << 28);
+    w[3] = (a.n[3] >> 36) | (a.n[4] << 16);
+    for (int i = 0; i < 4; i++)
+    {
+        unsigned char* p = pch + 24 - 8 * i;
+        for (int j = 0; j < 8; j++)
+            p[j] = (unsigned char)(w[i] >> (56 - 8 * j));
+    }
+}
+
+static inline void FeAdd(FieldElem& r, const FieldElem& a)
+{
+    for (int i = 0; i < 5; i++)
+        r.n[i] += a.n[i];
+    FeNormalizeWeak(r);
+}
+
+static inline void FeMulInt(FieldElem& r, int a)
+{
+    for (int i = 0; i < 5; i++)
+        r.n[i] *= a;
+    FeNormalizeWeak(r);
+}
+
+// r = -a, computed as 4p - a so no limb goes negative
+static inline void FeNegate(FieldElem& r, const FieldElem& a)
+{
+    for (int i = 0; i < 5; i++)
+        r.n[i] = feP4.n[i] - a.n[i];
+    FeNormalizeWeak(r);
+}
+
+// r = a - b
+static inline void FeSub(FieldElem& r, const FieldElem& a, const FieldElem& b)
+{
+    for (int i = 0; i < 5; i++)
+        r.n[i] = a.n[i] + feP4.n[i] - b.n[i];
+    FeNormalizeWeak(r);
+}
+
+static bool FeEqual(const FieldElem& a, const FieldElem& b)
+{
+    FieldElem t;
+    FeSub(t, a, b);
+    return FeIsZero(t);
+}
+
+static void FeMul(FieldElem& r, const FieldElem& a, const FieldElem& b)
+{
+    // Schoolbook product into ten 52 bit digits
+    word64 d[10];
+    Acc128 c;
+    AccClear(c);
+    for (int k = 0; k < 9; k++)
+    {
+        for (int i = (k > 4 ? k - 4 : 0); i <= (k < 4 ? k : 4); i++)
+            AccMulAdd(c, a.n[i], b.n[k - i]);
+        d[k] = AccExtract52(c);
+    }
+    d[9] = AccLow(c);
+
+    // Fold the top five digits down, digit k+5 weighs 2^260 times digit k
+    word64 t[5];
+    AccClear(c);
+    for (int k = 0; k < 5; k++)
+    {
+        AccAdd(c, d[k]);
+        AccMulAdd(c, d[k + 5], R260);
+        t[k] = AccExtract52(c);
+    }
+
+    // What's left is the carry past 2^260 and the bits of t[4] past 2^256
+    Acc128 c2;
+    AccClear(c2);
+    AccAdd(c2, t[0]);
+    AccMulAdd(c2, t[4] >> 48, R256);
+    AccMulAdd(c2, AccLow(c), R260);
+    t[4] &= M48;
+    r.n[0] = AccExtract52(c2);
+    AccAdd(c2, t[1]);
+    r.n[1] = AccExtract52(c2);
+    AccAdd(c2, t[2]);
+    r.n[2] = AccExtract52(c2);
+    AccAdd(c2, t[3]);
+    r.n[3] = AccExtract52(c2);
+    r.n[4] = t[4] + AccLow(c2);
+}
+
+static inline void FeSqr(FieldElem& r, const FieldElem& a)
+{
+    FeMul(r, a, a);
+}
+
+// r = a^e, e 32 bytes big endian
+static void FePow(FieldElem& r, const FieldElem& a, const unsigned char* pchExp)
+{
+    FieldElem x = a;
+    FieldElem t;
+    FeSetInt(t, 1);
+    for (int i = 0; i < 256; i++)
+    {
+        FeSqr(t, t);
+        if (pchExp[i / 8] & (0x80 >> (i % 8)))
+            FeMul(t, t, x);
+    }
+    r = t;
+}
+
+static inline void FeInv(FieldElem& r, const FieldElem& a)
+{
+    FePow(r, a, pchPMinus2);
+}
+
+// p = 3 mod 4, so a^((p+1)/4) is a square root if there is one
+static bool FeSqrt(FieldElem& r, const FieldElem& a)
+{
+    FieldElem t;
+    FePow(t, a, pchPPlus1Div4);
+    FieldElem t2;
+    FeSqr(t2, t);
+    if (!FeEqual(t2, a))
+        return false;
+    r = t;
+    return true;
+}
+
+
+
+
+//
+// Scalar arithmetic mod the group order n
+//
+
+struct Scalar
+{
+    word64 d[4];
+};
+
+static const word64 N[4] = { 0xBFD25E8CD0364141ULL, 0xBAAEDCE6AF48A03BULL, 0xFFFFFFFFFFFFFFFEULL, 0xFFFFFFFFFFFFFFFFULL };
+static const word64 NC[3] = { 0x402DA1732FC9BEBFULL, 0x4551231950B75FC4ULL, 1 };  // 2^256 - n
+static const word64 NHalf[4] = { 0xDFE92F46681B20A0ULL, 0x5D576E7357A4501DULL, 0xFFFFFFFFFFFFFFFFULL, 0x7FFFFFFFFFFFFFFFULL };
+static const word64 PMinusN[4] = { 0x402DA1722FC9BAEEULL, 0x4551231950B75FC4ULL, 1, 0 };
+
+// GLV endomorphism: lambda*(x,y) = (beta*x,y), and the constants for
+// splitting k into k1 + k2*lambda with k1, k2 about 128 bits each
+static const Scalar scLambda = {{ 0xDF02967C1B23BD72ULL, 0x122E22EA20816678ULL, 0xA5261C028812645AULL, 0x5363AD4CC05C30E0ULL }};
+static const Scalar scMinusB1 = {{ 0x6F547FA90ABFE4C3ULL, 0xE4437ED6010E8828ULL, 0, 0 }};
+static const Scalar scMinusB2 = {{ 0xD765CDA83DB1562CULL, 0x8A280AC50774346DULL, 0xFFFFFFFFFFFFFFFEULL, 0xFFFFFFFFFFFFFFFFULL }};
+static const Scalar scG1 = {{ 0xE893209A45DBB031ULL, 0x3DAA8A1471E8CA7FULL, 0xE86C90E49284EB15ULL, 0x3086D221A7D46BCDULL }};
+static const Scalar scG2 = {{ 0x1571B4AE8AC47F71ULL, 0x221208AC9DF506C6ULL, 0x6F547FA90ABFE4C4ULL, 0xE4437ED6010E8828ULL }};
+
+// -1, 0 or 1 as a <, = or > b
+static int Compare(const word64* a, const word64* b)
+{
+    for (int i = 3; i >= 0; i--)
+    {
+        if (a[i] < b[i])
+            return -1;
+        if (a[i] > b[i])
+            return 1;
+    }
+    return 0;
+}
+
+// a -= b, returns the borrow
+static word64 Sub(word64* a, const word64* b)
+{
+    word64 borrow = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        word64 t = a[i] - b[i];
+        word64 borrow2 = (a[i] < b[i]) | (t < borrow);
+        a[i] = t - borrow;
+        borrow = borrow2;
+    }
+    return borrow;
+}
+
+static inline bool ScIsZero(const Scalar& a)
+{
+    return (a.d[0] | a.d[1] | a.d[2] | a.d[3]) == 0;
+}
+
+// Returns true if the 32 byte big endian value was n or more, in which
+// case it's been reduced
+static bool ScSetB32(Scalar& r, const unsigned char* pch)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        const unsigned char* p = pch + 24 - 8 * i;
+        r.d[i] = ((word64)p[0] << 56) | ((word64)p[1] << 48) | ((word64)p[2] << 40) | ((word64)p[3] << 32) |
+                 ((word64)p[4] << 24) | ((word64)p[5] << 16) | ((word64)p[6] << 8) | (word64)p[7];
+    }
+    if (Compare(r.d, N) < 0)
+        return false;
+    Sub(r.d, N);
+    return true;
+}
+
+static void ScAdd(Scalar& r, const Scalar& a, const Scalar& b)
+{
+    word64 carry = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        word64 t = a.d[i] + carry;
+        carry = (t < carry);
+        r.d[i] = t + b.d[i];
+        carry += (r.d[i] < t);
+    }
+    if (carry || Compare(r.d, N) >= 0)
+        Sub(r.d, N);
+}
+
+static void ScNegate(Scalar& r, const Scalar& a)
+{
+    if (ScIsZero(a))
+    {
+        r = a;
+        return;
+    }
+    word64 t[4] = { N[0], N[1], N[2], N[3] };
+    Sub(t, a.d);
+    memcpy(r.d, t, sizeof(t));
+}
+
+static void Mul256(word64* l, const Scalar& a, const Scalar& b)
+{
+    Acc192 c = { 0, 0, 0 };
+    for (int k = 0; k < 7; k++)
+    {
+        for (int i = (k > 3 ? k - 3 : 0); i <= (k < 3 ? k : 3); i++)
+            AccMulAdd(c, a.d[i], b.d[k - i]);
+        l[k] = AccExtract64(c);
+    }
+    l[7] = c.c0;
+}
+
+// Reduce an 8 limb product mod n by repeatedly folding the limbs above
+// 2^256 back down as hi * (2^256 - n)
+static void ScReduce512(Scalar& r, const word64* l)
+{
+    word64 x[9], y[9];
+    int nLen = 8;
+    memcpy(x, l, 8 * sizeof(word64));
+    while (nLen > 4)
+    {
+        int nHi = nLen - 4;
+        int nOut = (nHi + 3 > 4 ? nHi + 3 : 4);
+        Acc192 c = { 0, 0, 0 };
+        for (int k = 0; k < nOut; k++)
+        {
+            if (k < 4)
+                AccAdd(c, x[k]);
+            for (int i = 0; i < nHi; i++)
+                if (k - i >= 0 && k - i < 3)
+                    AccMulAdd(c, x[4 + i], NC[k - i]);
+            y[k] = AccExtract64(c);
+        }
+        y[nOut] = c.c0;
+        nLen = nOut + 1;
+        while (nLen > 4 && y[nLen - 1] == 0)
+            nLen--;
+        memcpy(x, y, nLen * sizeof(word64));
+    }
+    memcpy(r.d, x, 4 * sizeof(word64));
+    if (Compare(r.d, N) >= 0)
+        Sub(r.d, N);
+}
+
+static void ScMul(Scalar& r, const Scalar& a, const Scalar& b)
+{
+    word64 l[8];
+    Mul256(l, a, b);
+    ScReduce512(r, l);
+}
+
+// x = x/2 mod n
+static void ScHalve(word64* x)
+{
+    word64 carry = 0;
+    if (x[0] & 1)
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            word64 t = x[i] + carry;
+            carry = (t < carry);
+            x[i] = t + N[i];
+            carry += (x[i] < t);
+        }
+    }
+    for (int i = 0; i < 3; i++)
+        x[i] = (x[i] >> 1) | (x[i + 1] << 63);
+    x[3] = (x[3] >> 1) | (carry << 63);
+}
+
+// Binary extended Euclid.  It's variable time, which is fine for the
+// public s of a signature and several times quicker than a^(n-2).
+static void ScInverse(Scalar& r, const Scalar& a)
+{
+    static const word64 ONE[4] = { 1, 0, 0, 0 };
+    word64 u[4], v[4];
+    Scalar x1 = {{ 1, 0, 0, 0 }};
+    Scalar x2 = {{ 0, 0, 0, 0 }};
+    memcpy(u, a.d, sizeof(u));
+    memcpy(v, N, sizeof(v));
+    if (ScIsZero(a))
+    {
+        r = x2;
+        return;
+    }
+    while (Compare(u, ONE) != 0 && Compare(v, ONE) != 0)
+    {
+        while (!(u[0] & 1))
+        {
+            for (int i = 0; i < 3; i++)
+                u[i] = (u[i] >> 1) | (u[i + 1] << 63);
+            u[3] >>= 1;
+            ScHalve(x1.d);
+        }
+        while (!(v[0] & 1))
+        {
+            for (int i = 0; i < 3; i++)
+                v[i] = (v[i] >> 1) | (v[i + 1] << 63);
+            v[3] >>= 1;
+            ScHalve(x2.d);
+        }
+        Scalar t;
+        if (Compare(u, v) >= 0)
+        {
+            Sub(u, v);
+            ScNegate(t, x2);
+            ScAdd(x1, x1, t);
+        }
+        else
+        {
+            Sub(v, u);
+            ScNegate(t, x1);
+            ScAdd(x2, x2, t);
+        }
+    }
+    r = (Compare(u, ONE) == 0 ? x1 : x2);
+}
+
+// r = round(a * b / 2^384)
+static void ScMulShift384(Scalar& r, const Scalar& a, const Scalar& b)
+{
+    word64 l[8];
+    Mul256(l, a, b);
+    r.d[0] = l[6];
+    r.d[1] = l[7];
+    r.d[2] = r.d[3] = 0;
+    if (l[5] >> 63)
+    {
+        r.d[0]++;
+        if (r.d[0] == 0)
+            r.d[1]++;
+    }
+}
+
+// k = k1 + k2*lambda (mod n)
+static void ScSplitLambda(Scalar& k1, Scalar& k2, const Scalar& k)
+{
+    Scalar c1, c2;
+    ScMulShift384(c1, k, scG1);
+    ScMulShift384(c2, k, scG2);
+    ScMul(c1, c1, scMinusB1);
+    ScMul(c2, c2, scMinusB2);
+    ScAdd(k2, c1, c2);
+    ScMul(k1, k2, scLambda);
+    ScNegate(k1, k1);
+    ScAdd(k1, k1, k);
+}
+
+
+
+
+//
+// Group arithmetic in Jacobian coordinates, (X, Y, Z) is (X/Z^2, Y/Z^3)
+//
+
+struct GePoint
+{
+    FieldElem x, y;
+};
+
+struct GejPoint
+{
+    FieldElem x, y, z;
+    bool fInfinity;
+};
+
+static inline void GejSetGe(GejPoint& r, const GePoint& a)
+{
+    r.x = a.x;
+    r.y = a.y;
+    FeSetInt(r.z, 1);
+    r.fInfinity = false;
+}
+
+// r = 2a, ignoring a.fInfinity
+static void GejDoubleNoCheck(GejPoint& r, const GejPoint& a)
+{
+    FieldElem A, B, C, D, E, F, t;
+    FeSqr(A, a.x);
+    FeSqr(B, a.y);
+    FeSqr(C, B);
+    t = a.x;
+    FeAdd(t, B);
+    FeSqr(D, t);
+    FeSub(D, D, A);
+    FeSub(D, D, C);
+    FeMulInt(D, 2);
+    E = A;
+    FeMulInt(E, 3);
+    FeSqr(F, E);
+
+    FeMul(r.z, a.y, a.z);
+    FeMulInt(r.z, 2);
+    t = D;
+    FeMulInt(t, 2);
+    FeSub(r.x, F, t);
+    FeSub(t, D, r.x);
+    FeMul(r.y, E, t);
+    FeMulInt(C, 8);
+    FeSub(r.y, r.y, C);
+    r.fInfinity = false;
+}
+
+static void GejDouble(GejPoint& r, const GejPoint& a)
+{
+    // secp256k1 has no point of order 2, so y is never zero here
+    if (a.fInfinity)
+    {
+        r.fInfinity = true;
+        return;
+    }
+    GejDoubleNoCheck(r, a);
+}
+
+// r = a + b with b affine
+static void GejAddGe(GejPoint& r, const GejPoint& a, const GePoint& b)
+{
+    if (a.fInfinity)
+    {
+        GejSetGe(r, b);
+        return;
+    }
+    FieldElem Z1Z1, U2, S2, H, HH, I, J, rr, V, t;
+    FeSqr(Z1Z1, a.z);
+    FeMul(U2, b.x, Z1Z1);
+    FeMul(S2, b.y, a.z);
+    FeMul(S2, S2, Z1Z1);
+    FeSub(H, U2, a.x);
+    FeSub(rr, S2, a.y);
+    if (FeIsZero(H))
+    {
+        if (FeIsZero(rr))
+            GejDouble(r, a);
+        else
+            r.fInfinity = true;
+        return;
+    }
+    FeMulInt(rr, 2);
+    FeSqr(HH, H);
+    I = HH;
+    FeMulInt(I, 4);
+    FeMul(J, H, I);
+    FeMul(V, a.x, I);
+
+    t = a.z;
+    FeAdd(t, H);
+    FeSqr(r.z, t);
+    FeSub(r.z, r.z, Z1Z1);
+    FeSub(r.z, r.z, HH);
+    FieldElem Y1J;
+    FeMul(Y1J, a.y, J);
+    FeMulInt(Y1J, 2);
+    FeSqr(r.x, rr);
+    FeSub(r.x, r.x, J);
+    t = V;
+    FeMulInt(t, 2);
+    FeSub(r.x, r.x, t);
+    FeSub(t, V, r.x);
+    FeMul(r.y, rr, t);
+    FeSub(r.y, r.y, Y1J);
+    r.fInfinity = false;
+}
+
+// r = a + b with b affine, the same result as GejAddGe but without any
+// branch on the points.  The general sum and 2a are both computed every
+// time and the answer, including the infinity cases, is picked with masks.
+// For key generation, where a and b come from the private key.
+static void GejAddGeConst(GejPoint& r, const GejPoint& a, const GePoint& b)
+{
+    FieldElem Z1Z1, U2, S2, H, HH, I, J, rr, V, t, Y1J;
+    FeSqr(Z1Z1, a.z);
+    FeMul(U2, b.x, Z1Z1);
+    FeMul(S2, b.y, a.z);
+    FeMul(S2, S2, Z1Z1);
+    FeSub(H, U2, a.x);
+    FeSub(rr, S2, a.y);
+    word64 maskHZero = FeIsZeroMask(H);
+    word64 maskRZero = FeIsZeroMask(rr);
+
+    GejPoint sum;
+    FeMulInt(rr, 2);
+    FeSqr(HH, H);
+    I = HH;
+    FeMulInt(I, 4);
+    FeMul(J, H, I);
+    FeMul(V, a.x, I);
+    t = a.z;
+    FeAdd(t, H);
+    FeSqr(sum.z, t);
+    FeSub(sum.z, sum.z, Z1Z1);
+    FeSub(sum.z, sum.z, HH);
+    FeMul(Y1J, a.y, J);
+    FeMulInt(Y1J, 2);
+    FeSqr(sum.x, rr);
+    FeSub(sum.x, sum.x, J);
+    t = V;
+    FeMulInt(t, 2);
+    FeSub(sum.x, sum.x, t);
+    FeSub(t, V, sum.x);
+    FeMul(sum.y, rr, t);
+    FeSub(sum.y, sum.y, Y1J);
+
+    // a == b, the general formula gives 0/0
+    GejPoint dbl;
+    GejDoubleNoCheck(dbl, a);
+
+    word64 maskAInf = (word64)0 - (word64)a.fInfinity;
+    word64 maskDouble = maskHZero & maskRZero & ~maskAInf;
+    word64 maskInf = maskHZero & ~maskRZero & ~maskAInf;
+    FieldElem one;
+    FeSetInt(one, 1);
+    FeCmov(sum.x, dbl.x, maskDouble);
+    FeCmov(sum.y, dbl.y, maskDouble);
+    FeCmov(sum.z, dbl.z, maskDouble);
+    FeCmov(sum.x, b.x, maskAInf);
+    FeCmov(sum.y, b.y, maskAInf);
+    FeCmov(sum.z, one, maskAInf);
+    r.x = sum.x;
+    r.y = sum.y;
+    r.z = sum.z;
+    r.fInfinity = (maskInf & 1) != 0;
+}
+
+// r = a + b, both Jacobian
+static void GejAdd(GejPoint& r, const GejPoint& a, const GejPoint& b)
+{
+    if (a.fInfinity)
+    {
+        r = b;
+        return;
+    }
+    if (b.fInfinity)
+    {
+        r = a;
+        return;
+    }
+    FieldElem Z1Z1, Z2Z2, U1, U2, S1, S2, H, I, J, rr, V, t;
+    FeSqr(Z1Z1, a.z);
+    FeSqr(Z2Z2, b.z);
+    FeMul(U1, a.x, Z2Z2);
+    FeMul(U2, b.x, Z1Z1);
+    FeMul(S1, a.y, b.z);
+    FeMul(S1, S1, Z2Z2);
+    FeMul(S2, b.y, a.z);
+    FeMul(S2, S2, Z1Z1);
+    FeSub(H, U2, U1);
+    FeSub(rr, S2, S1);
+    if (FeIsZero(H))
+    {
+        if (FeIsZero(rr))
+            GejDouble(r, a);
+        else
+            r.fInfinity = true;
+        return;
+    }
+    FeMulInt(rr, 2);
+    I = H;
+    FeMulInt(I, 2);
+    FeSqr(I, I);
+    FeMul(J, H, I);
+    FeMul(V, U1, I);
+
+    t = a.z;
+    FeAdd(t, b.z);
+    FeSqr(t, t);
+    FeSub(t, t, Z1Z1);
+    FeSub(t, t, Z2Z2);
+    FeMul(r.z, t, H);
+    FeMul(S1, S1, J);
+    FeMulInt(S1, 2);
+    FeSqr(r.x, rr);
+    FeSub(r.x, r.x, J);
+    t = V;
+    FeMulInt(t, 2);
+    FeSub(r.x, r.x, t);
+    FeSub(t, V, r.x);
+    FeMul(r.y, rr, t);
+    FeSub(r.y, r.y, S1);
+    r.fInfinity = false;
+}
+
+
+
+
+//
+// u1*G + u2*P
+//
+// Both scalars are split by the endomorphism into two ~128 bit halves,
+// so the four half-scalars share one run of ~128 doublings.  G's odd
+// multiples come from a table built once at startup, P's are worked out
+// per call with a smaller window.
+//
+
+static const int WINDOW_A = 5;
+static const int WINDOW_G = 12;
+static const int TABLE_SIZE_A = 1 << (WINDOW_A - 2);
+static const int TABLE_SIZE_G = 1 << (WINDOW_G - 2);
+static const int WNAF_SIZE = 258;
+
+static GePoint preG[TABLE_SIZE_G];          // (2i+1)*G
+static GePoint preGLambda[TABLE_SIZE_G];    // (2i+1)*lambda*G
+
+// Key generation adds one entry from each of these rows, picked by the
+// private key's nibbles.  Every row carries an offset and the offsets sum
+// to zero, so no entry is the point at infinity and the work is the same
+// 63 additions whatever the key.
+static GePoint preGen[64][16];
+
+// Width w NAF of a, every nonzero digit odd and under 2^(w-1) in
+// absolute value, least significant first.  Returns the length.
+static int ScToWNAF(int* wnaf, const Scalar& a, int w)
+{
+    word64 x[5] = { a.d[0], a.d[1], a.d[2], a.d[3], 0 };
+    int nLen = 0;
+    while (x[0] | x[1] | x[2] | x[3] | x[4])
+    {
+        int nDigit = 0;
+        if (x[0] & 1)
+        {
+            nDigit = (int)(x[0] & ((1 << w) - 1));
+            if (nDigit >= (1 << (w - 1)))
+                nDigit -= (1 << w);
+
+            // x -= nDigit, which clears the low w bits
+            word64 v = (nDigit > 0 ? nDigit : -nDigit);
+            if (nDigit > 0)
+            {
+                word64 borrow = (x[0] < v);
+                x[0] -= v;
+                for (int i = 1; i < 5 && borrow; i++)
+                    borrow = (x[i]-- == 0);
+            }
+            else
+            {
+                x[0] += v;
+                word64 carry = (x[0] < v);
+                for (int i = 1; i < 5 && carry; i++)
+                    carry = (++x[i] == 0);
+            }
+        }
+        wnaf[nLen++] = nDigit;
+        for (int i = 0; i < 4; i++)
+            x[i] = (x[i] >> 1) | (x[i + 1] << 63);
+        x[4] >>= 1;
+    }
+    return nLen;
+}
+
+// wNAF of the half-scalar a, negated if a is closer to n than to zero
+static int ScToSignedWNAF(int* wnaf, const Scalar& a, int w)
+{
+    bool fNegate = (Compare(a.d, NHalf) > 0);
+    Scalar t = a;
+    if (fNegate)
+        ScNegate(t, a);
+    int nLen = ScToWNAF(wnaf, t, w);
+    if (fNegate)
+        for (int i = 0; i < nLen; i++)
+            wnaf[i] = -wnaf[i];
+    return nLen;
+}
+
+static void GejAddTableJ(GejPoint& r, const GejPoint* pre, int nDigit)
+{
+    if (nDigit > 0)
+    {
+        GejAdd(r, r, pre[(nDigit - 1) / 2]);
+    }
+    else
+    {
+        GejPoint t = pre[(-nDigit - 1) / 2];
+        FeNegate(t.y, t.y);
+        GejAdd(r, r, t);
+    }
+}
+
+static void GejAddTableGe(GejPoint& r, const GePoint* pre, int nDigit)
+{
+    if (nDigit > 0)
+    {
+        GejAddGe(r, r, pre[(nDigit - 1) / 2]);
+    }
+    else
+    {
+        GePoint t = pre[(-nDigit - 1) / 2];
+        FeNegate(t.y, t.y);
+        GejAddGe(r, r, t);
+    }
+}
+
+static void EcMult(GejPoint& r, const GePoint& a, const Scalar& u1, const Scalar& u2)
+{
+    Scalar na1, na2, ng1, ng2;
+    ScSplitLambda(na1, na2, u2);
+    ScSplitLambda(ng1, ng2, u1);
+
+    int wnafA1[WNAF_SIZE], wnafA2[WNAF_SIZE], wnafG1[WNAF_SIZE], wnafG2[WNAF_SIZE];
+    int nLenA1 = ScToSignedWNAF(wnafA1, na1, WINDOW_A);
+    int nLenA2 = ScToSignedWNAF(wnafA2, na2, WINDOW_A);
+    int nLenG1 = ScToSignedWNAF(wnafG1, ng1, WINDOW_G);
+    int nLenG2 = ScToSignedWNAF(wnafG2, ng2, WINDOW_G);
+    int nLen = nLenA1;
+    if (nLenA2 > nLen) nLen = nLenA2;
+    if (nLenG1 > nLen) nLen = nLenG1;
+    if (nLenG2 > nLen) nLen = nLenG2;
+
+    // Odd multiples of a and of lambda*a
+    GejPoint preA[TABLE_SIZE_A], preALambda[TABLE_SIZE_A];
+    GejPoint a2;
+    GejSetGe(preA[0], a);
+    GejDouble(a2, preA[0]);
+    for (int i = 1; i < TABLE_SIZE_A; i++)
+        GejAdd(preA[i], preA[i - 1], a2);
+    for (int i = 0; i < TABLE_SIZE_A; i++)
+    {
+        preALambda[i] = preA[i];
+        FeMul(preALambda[i].x, preA[i].x, feBeta);
+    }
+
+    r.fInfinity = true;
+    for (int i = nLen - 1; i >= 0; i--)
+    {
+        GejDouble(r, r);
+        if (i < nLenA1 && wnafA1[i])
+            GejAddTableJ(r, preA, wnafA1[i]);
+        if (i < nLenA2 && wnafA2[i])
+            GejAddTableJ(r, preALambda, wnafA2[i]);
+        if (i < nLenG1 && wnafG1[i])
+            GejAddTableGe(r, preG, wnafG1[i]);
+        if (i < nLenG2 && wnafG2[i])
+            GejAddTableGe(r, preGLambda, wnafG2[i]);
+    }
+}
+
+// Convert to affine with a single inversion: invert the product of all
+// the Z's, then peel each one off
+static void GejToGeBatch(GePoint* r, const GejPoint* a, int nCount)
+{
+    FieldElem* pprod = new FieldElem[nCount];
+    pprod[0] = a[0].z;
+    for (int i = 1; i < nCount; i++)
+        FeMul(pprod[i], pprod[i - 1], a[i].z);
+    FieldElem inv;
+    FeInv(inv, pprod[nCount - 1]);
+    for (int i = nCount - 1; i >= 0; i--)
+    {
+        FieldElem zinv, zinv2, zinv3;
+        if (i > 0)
+        {
+            FeMul(zinv, inv, pprod[i - 1]);
+            FeMul(inv, inv, a[i].z);
+        }
+        else
+        {
+            zinv = inv;
+        }
+        FeSqr(zinv2, zinv);
+        FeMul(zinv3, zinv2, zinv);
+        FeMul(r[i].x, a[i].x, zinv2);
+        FeMul(r[i].y, a[i].y, zinv3);
+        FeNormalize(r[i].x);
+        FeNormalize(r[i].y);
+    }
+    delete[] pprod;
+}
+
+static bool BuildGeneratorTables()
+{
+    GePoint g = { feGx, feGy };
+    GejPoint gj;
+    GejSetGe(gj, g);
+
+    // Odd multiples for verification
+    GejPoint* pgej = new GejPoint[TABLE_SIZE_G];
+    GejPoint g2;
+    pgej[0] = gj;
+    GejDouble(g2, gj);
+    for (int i = 1; i < TABLE_SIZE_G; i++)
+        GejAdd(pgej[i], pgej[i - 1], g2);
+    GejToGeBatch(preG, pgej, TABLE_SIZE_G);
+    for (int i = 0; i < TABLE_SIZE_G; i++)
+    {
+        FeMul(preGLambda[i].x, preG[i].x, feBeta);
+        preGLambda[i].y = preG[i].y;
+    }
+    delete[] pgej;
+
+    // Rows for key generation, preGen[i][d] = (d*16^i + c_i)*G with c_i = 1
+    // for the first 63 rows and -63 for the last
+    pgej = new GejPoint[64 * 16];
+    GejPoint base = gj;     // 16^i * G
+    GejPoint g63;
+    g63.fInfinity = true;
+    for (int i = 0; i < 63; i++)
+        GejAdd(g63, g63, gj);
+    FeNegate(g63.y, g63.y);
+    for (int i = 0; i < 64; i++)
+    {
+        GejPoint* prow = &pgej[i * 16];
+        prow[0] = (i < 63 ? gj : g63);
+        for (int d = 1; d < 16; d++)
+            GejAdd(prow[d], prow[d - 1], base);
+        for (int j = 0; j < 4; j++)
+            GejDouble(base, base);
+    }
+    GejToGeBatch(&preGen[0][0], pgej, 64 * 16);
+    delete[] pgej;
+    return true;
+}
+
+static bool fGeneratorTables = BuildGeneratorTables();
+
+
+
+
+// r = k*G for key generation, one masked table row scan per nibble.  The
+// row lookups and the additions are both masked, so which entries are used
+// and whether a partial sum meets a table point (which happens for real
+// keys, k with two low zero nibbles doubles at row 1) don't show in which
+// code runs.
+static void EcMultGen(GejPoint& r, const Scalar& k)
+{
+    for (int i = 0; i < 64; i++)
+    {
+        int nNibble = (int)((k.d[i / 16] >> (4 * (i % 16))) & 0xf);
+        GePoint t;
+        memset(&t, 0, sizeof(t));
+        for (int d = 0; d < 16; d++)
+        {
+            word64 mask = (word64)0 - (word64)(d == nNibble);
+            for (int j = 0; j < 5; j++)
+            {
+                t.x.n[j] |= preGen[i][d].x.n[j] & mask;
+                t.y.n[j] |= preGen[i][d].y.n[j] & mask;
+            }
+        }
+        if (i == 0)
+            GejSetGe(r, t);
+        else
+            GejAddGeConst(r, r, t);
+    }
+}
+
+
+
+
+//
+// Encodings
+//
+
+bool ParsePubKey(PubKey& pubkey, const unsigned char* pch, size_t nSize)
+{
+    FieldElem x, y, y2, x3;
+    if (nSize == 65 && pch[0] == 0x04)
+    {
+        if (!FeSetB32(x, pch + 1) || !FeSetB32(y, pch + 33))
+            return false;
+        FeSqr(y2, y);
+        FeSqr(x3, x);
+        FeMul(x3, x3, x);
+        FieldElem seven;
+        FeSetInt(seven, 7);
+        FeAdd(x3, seven);
+        if (!FeEqual(y2, x3))
+            return false;
+    }
+    else if (nSize == 33 && (pch[0] == 0x02 || pch[0] == 0x03))
+    {
+        if (!FeSetB32(x, pch + 1))
+            return false;
+        FeSqr(x3, x);
+        FeMul(x3, x3, x);
+        FieldElem seven;
+        FeSetInt(seven, 7);
+        FeAdd(x3, seven);
+        if (!FeSqrt(y, x3))
+            return false;
+        if (FeIsOdd(y) != (pch[0] == 0x03))
+            FeNegate(y, y);
+    }
+    else
+    {
+        return false;
+    }
+    FeNormalize(x);
+    FeNormalize(y);
+    pubkey.x = x;
+    pubkey.y = y;
+    return true;
+}
+
+bool GetPubKey(unsigned char* pchPubKey, const unsigned char* pchPrivKey)
+{
+    Scalar k;
+    if (ScSetB32(k, pchPrivKey) || ScIsZero(k))
+        return false;
+    GejPoint r;
+    EcMultGen(r, k);
+    memset(&k, 0, sizeof(k));
+
+    FieldElem zinv, zinv2, zinv3, x, y;
+    FeInv(zinv, r.z);
+    FeSqr(zinv2, zinv);
+    FeMul(zinv3, zinv2, zinv);
+    FeMul(x, r.x, zinv2);
+    FeMul(y, r.y, zinv3);
+    FeNormalize(x);
+    FeNormalize(y);
+    pchPubKey[0] = 0x04;
+    FeGetB32(pchPubKey + 1, x);
+    FeGetB32(pchPubKey + 33, y);
+    return true;
+}
+
+// One INTEGER of a DER signature, minimally encoded and non-negative.
+// Values too big to fit in 32 bytes set fOverflow.
+static bool ParseDERInteger(const unsigned char*& p, const unsigned char* pend, unsigned char* pch32, bool& fOverflow)
+{
+    if (pend - p < 2 || p[0] != 0x02)
+        return false;
+    size_t nLen = p[1];
+    p += 2;
+    if (nLen == 0 || nLen >= 0x80 || nLen > (size_t)(pend - p))
+        return false;
+    if (p[0] & 0x80)
+        return false;
+    if (nLen > 1 && p[0] == 0x00 && !(p[1] & 0x80))
+        return false;
+    const unsigned char* pbegin = p;
+    p += nLen;
+    while (nLen > 0 && *pbegin == 0)
+    {
+        pbegin++;
+        nLen--;
+    }
+    memset(pch32, 0, 32);
+    if (nLen > 32)
+        fOverflow = true;
+    else
+        memcpy(pch32 + 32 - nLen, pbegin, nLen);
+    return true;
+}
+
+static bool ParseDERSignature(const unsigned char* pch, size_t nSize, unsigned char* pchR, unsigned char* pchS, bool& fOverflow)
+{
+    if (nSize < 2 || pch[0] != 0x30 || pch[1] >= 0x80 || pch[1] != nSize - 2)
+        return false;
+    const unsigned char* p = pch + 2;
+    const unsigned char* pend = pch + nSize;
+    if (!ParseDERInteger(p, pend, pchR, fOverflow))
+        return false;
+    if (!ParseDERInteger(p, pend, pchS, fOverflow))
+        return false;
+    return (p == pend);
+}
+
+
+
+
+//
+// ECDSA
+//
+
+int Verify(const PubKey& pubkey, const unsigned char* pchHash, const unsigned char* pchSig, size_t nSigSize)
+{
+    unsigned char pchR[32], pchS[32];
+    bool fOverflow = false;
+    if (!ParseDERSignature(pchSig, nSigSize, pchR, pchS, fOverflow))
+        return VERIFY_UNSUPPORTED;
+    if (fOverflow)
+        return VERIFY_INVALID;
+
+    // r and s must be in [1, n-1]
+    Scalar r, s, e;
+    if (ScSetB32(r, pchR) || ScIsZero(r))
+        return VERIFY_INVALID;
+    if (ScSetB32(s, pchS) || ScIsZero(s))
+        return VERIFY_INVALID;
+    ScSetB32(e, pchHash);
+
+    Scalar w, u1, u2;
+    ScInverse(w, s);
+    ScMul(u1, e, w);
+    ScMul(u2, r, w);
+
+    GePoint a = { pubkey.x, pubkey.y };
+    GejPoint R;
+    EcMult(R, a, u1, u2);
+    if (R.fInfinity)
+        return VERIFY_INVALID;
+
+    // Compare without leaving Jacobian coordinates: x(R) mod n == r means
+    // X == r*Z^2, or X == (r+n)*Z^2 when r+n is still below p
+    FieldElem xr, zz, t;
+    FeSetB32(xr, pchR);
+    FeSqr(zz, R.z);
+    FeMul(t, xr, zz);
+    if (FeEqual(t, R.x))
+        return VERIFY_VALID;
+    if (Compare(r.d, PMinusN) >= 0)
+        return VERIFY_INVALID;
+    FeAdd(xr, feN);
+    FeMul(t, xr, zz);
+    if (FeEqual(t, R.x))
+        return VERIFY_VALID;
+    return VERIFY_INVALID;
+}
+
+}
@@ -0,0 +1,65 @@
+// Copyright (c) 2009 Satoshi Nakamoto
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+#ifndef SECP256K1_H
+#define SECP256K1_H
+#include <stddef.h>
+
+//
+// ECDSA signature verification specialized for secp256k1, standalone like
+// sha.cpp.  Field elements are 5 limbs of 52 bits, the generator has a
+// precomputed table of odd multiples, and u1*G + u2*P is one interleaved
+// wNAF pass with both scalars split in half by the GLV endomorphism.
+//
+// Verification works on public data (keys, hashes and signatures off the
+// network) so it's free to take shortcuts that depend on the values.
+// GetPubKey handles a private key, so its table reads and point additions
+// are masked rather than branched on and every key runs the same code.
+// Signing stays with OpenSSL.
+//
+namespace secp256k1
+{
+
+#if defined(_MSC_VER) || defined(__BORLANDC__)
+typedef unsigned __int64 word64;
+#else
+typedef unsigned long long word64;
+#endif
+
+// Element of the field mod p, value = n[0] + n[1]*2^52 + ... + n[4]*2^208
+struct FieldElem
+{
+    word64 n[5];
+};
+
+// Public key, an affine point on the curve
+struct PubKey
+{
+    FieldElem x;
+    FieldElem y;
+};
+
+enum
+{
+    VERIFY_INVALID = 0,
+    VERIFY_VALID = 1,
+    VERIFY_UNSUPPORTED = -1,    // encoding we leave to OpenSSL
+};
+
+// Parses a 65 byte uncompressed or 33 byte compressed key.  Returns false
+// for anything else, including points not on the curve.
+bool ParsePubKey(PubKey& pubkey, const unsigned char* pch, size_t nSize);
+
+// Computes the 65 byte uncompressed public key for a 32 byte big endian
+// private key.  Returns false if the key isn't in [1, n-1].
+bool GetPubKey(unsigned char* pchPubKey, const unsigned char* pchPrivKey);
+
+// pchHash is the 32 byte digest in the byte order it's handed to
+// ECDSA_verify.  Only strict DER signatures are handled, for any other
+// encoding the result is VERIFY_UNSUPPORTED so the caller can fall back to
+// OpenSSL, whose lenience there varies between versions.
+int Verify(const PubKey& pubkey, const unsigned char* pchHash, const unsigned char* pchSig, size_t nSigSize);
+
+}
+
+#endif
@@ -16,7 +16,7 @@ typedef unsigned long long  uint64;
 #define for  if (false) ; else for
 #endif
 class CScript;
-class CDataStream;
+template<typename Alloc> class CBaseDataStream;
 class CAutoFile;
 
 static const int VERSION = 105;
@@ -267,6 +267,38 @@ public:
 
 
 
+//
+// Wrapper for serializing an unsigned int in the variable length format
+// used for vector and string sizes
+//
+#define COMPACTSIZE(obj)    REF(CCompactSize(REF(obj)))
+class CCompactSize
+{
+protected:
+    unsigned int& n;
+public:
+    explicit CCompactSize(unsigned int& nIn) : n(nIn) { }
+
+    unsigned int GetSerializeSize(int, int=0) const
+    {
+        return GetSizeOfCompactSize(n);
+    }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int, int=0) const
+    {
+        WriteCompactSize(s, n);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s, int, int=0)
+    {
+        n = ReadCompactSize(s);
+    }
+};
+
+
+
 //
 // string stored as a fixed length field
 //
@@ -703,12 +735,14 @@ struct secure_allocator : public std::allocator<T>
 // Double ended buffer combining vector and stream-like interfaces.
 // >> and << read and write unformatted data using the above serialization templates.
 // Fills with data in linear time; some stringstream implementations take N^2 time.
+// Alloc is what the buffer is allocated with, see the typedefs below.
 //
-class CDataStream
+template<typename Alloc>
+class CBaseDataStream
 {
 protected:
     // This vector type can store characters
-    typedef vector<char, secure_allocator<char> > vector_type;
+    typedef vector<char, Alloc> vector_type;
     // The actual data:
     vector_type vch;
     // The starting position to read the data in `vch`:
@@ -724,44 +758,40 @@ public:
     // The verson number
     int nVersion;
 
-    typedef vector_type::allocator_type   allocator_type;
-    typedef vector_type::size_type        size_type;
-    typedef vector_type::difference_type  difference_type;
-    typedef vector_type::reference        reference;
-    typedef vector_type::const_reference  const_reference;
-    typedef vector_type::value_type       value_type;
-    typedef vector_type::iterator         iterator;
-    typedef vector_type::const_iterator   const_iterator;
-    typedef vector_type::reverse_iterator reverse_iterator;
-
-    explicit CDataStream(int nTypeIn=0, int nVersionIn=VERSION)
+    typedef typename vector_type::allocator_type   allocator_type;
+    typedef typename vector_type::size_type        size_type;
+    typedef typename vector_type::difference_type  difference_type;
+    typedef typename vector_type::reference        reference;
+    typedef typename vector_type::const_reference  const_reference;
+    typedef typename vector_type::value_type       value_type;
+    typedef typename vector_type::iterator         iterator;
+    typedef typename vector_type::const_iterator   const_iterator;
+    typedef typename vector_type::reverse_iterator reverse_iterator;
+
+    explicit CBaseDataStream(int nTypeIn=0, int nVersionIn=VERSION)
     {
         Init(nTypeIn, nVersionIn);
     }
 
-    CDataStream(const_iterator pbegin, const_iterator pend, int nTypeIn=0, int nVersionIn=VERSION) : vch(pbegin, pend)
+    CBaseDataStream(const_iterator pbegin, const_iterator pend, int nTypeIn=0, int nVersionIn=VERSION) : vch(pbegin, pend)
     {
         Init(nTypeIn, nVersionIn);
     }
 
 #if !defined(_MSC_VER) || _MSC_VER >= 1300
-    CDataStream(const char* pbegin, const char* pend, int nTypeIn=0, int nVersionIn=VERSION) : vch(pbegin, pend)
+    CBaseDataStream(const char* pbegin, const char* pend, int nTypeIn=0, int nVersionIn=VERSION) : vch(pbegin, pend)
     {
         Init(nTypeIn, nVersionIn);
     }
 #endif
 
-    CDataStream(const vector_type& vchIn, int nTypeIn=0, int nVersionIn=VERSION) : vch(vchIn.begin(), vchIn.end())
+    template<typename A>
+    CBaseDataStream(const vector<char, A>& vchIn, int nTypeIn=0, int nVersionIn=VERSION) : vch(vchIn.begin(), vchIn.end())
     {
         Init(nTypeIn, nVersionIn);
     }
 
-    CDataStream(const vector<char>& vchIn, int nTypeIn=0, int nVersionIn=VERSION) : vch(vchIn.begin(), vchIn.end())
-    {
-        Init(nTypeIn, nVersionIn);
-    }
-
-    CDataStream(const vector<unsigned char>& vchIn, int nTypeIn=0, int nVersionIn=VERSION) : vch((char*)&vchIn.begin()[0], (char*)&vchIn.end()[0])
+    CBaseDataStream(const vector<unsigned char>& vchIn, int nTypeIn=0, int nVersionIn=VERSION) : vch((char*)&vchIn.begin()[0], (char*)&vchIn.end()[0])
     {
         Init(nTypeIn, nVersionIn);
     }
@@ -775,15 +805,15 @@ public:
         exceptmask = ios::badbit | ios::failbit;
     }
 
-    CDataStream& operator+=(const CDataStream& b)
+    CBaseDataStream& operator+=(const CBaseDataStream& b)
     {
         vch.insert(vch.end(), b.begin(), b.end());
         return *this;
     }
 
-    friend CDataStream operator+(const CDataStream& a, const CDataStream& b)
+    friend CBaseDataStream operator+(const CBaseDataStream& a, const CBaseDataStream& b)
     {
-        CDataStream ret = a;
+        CBaseDataStream ret = a;
         ret += b;
         return (ret);
     }
@@ -906,7 +936,7 @@ public:
     void clear(short n)          { state = n; }  // name conflict with vector clear()
     short exceptions()           { return exceptmask; }
     short exceptions(short mask) { short prev = exceptmask; exceptmask = mask; setstate(0, "CDataStream"); return prev; }
-    CDataStream* rdbuf()         { return this; }
+    CBaseDataStream* rdbuf()     { return this; }
     int in_avail()               { return size(); }
 
     void SetType(int n)          { nType = n; }
@@ -923,7 +953,7 @@ public:
      * a preallocated piece of memory pointed by
      * `char* pch`.
      */
-    CDataStream& read(char* pch, int nSize)
+    CBaseDataStream& read(char* pch, int nSize)
     {
         // Read from the beginning of the buffer
         assert(nSize >= 0);
@@ -960,7 +990,7 @@ public:
      * Go to the position in the stream specified
      * by nSize.
      */
-    CDataStream& ignore(int nSize)
+    CBaseDataStream& ignore(int nSize)
     {
         // Ignore from the beginning of the buffer
         assert(nSize >= 0);
@@ -980,7 +1010,7 @@ public:
         return (*this);
     }
 
-    CDataStream& write(const char* pch, int nSize)
+    CBaseDataStream& write(const char* pch, int nSize)
     {
         // Write to the end of the buffer
         assert(nSize >= 0);
@@ -1005,7 +1035,7 @@ public:
 
     // Overload the << operator
     template<typename T>
-    CDataStream& operator<<(const T& obj)
+    CBaseDataStream& operator<<(const T& obj)
     {
         // Serialize to this stream
         ::Serialize(*this, obj, nType, nVersion);
@@ -1014,7 +1044,7 @@ public:
 
     // Overload the >> operator
     template<typename T>
-    CDataStream& operator>>(T& obj)
+    CBaseDataStream& operator>>(T& obj)
     {
         // Unserialize from this stream
         ::Unserialize(*this, obj, nType, nVersion);
@@ -1022,6 +1052,449 @@ public:
     }
 };
 
+// Network messages, block and index records and hashing go through plain
+// memory.  Anything holding a private key uses CSecureDataStream, which
+// wipes its buffers when they're freed.
+typedef CBaseDataStream<std::allocator<char> > CDataStream;
+typedef CBaseDataStream<secure_allocator<char> > CSecureDataStream;
+
+
+
+/**
+ * Read-only stream over bytes that belong to someone else, so a message
+ * can be deserialized straight out of the buffer it arrived in instead
+ * of being copied into its own CDataStream first.  Has the reading half
+ * of CDataStream's interface.  The bytes must stay put while it's used.
+ */
+class CDataStreamView
+{
+protected:
+    const char* pbegin;
+    const char* pend;
+    short state;
+    short exceptmask;
+public:
+    int nType;
+    int nVersion;
+
+    typedef unsigned int size_type;
+    typedef const char* const_iterator;
+
+    CDataStreamView(const char* pbeginIn, const char* pendIn, int nTypeIn=0, int nVersionIn=VERSION)
+    {
+        pbegin = pbeginIn;
+        pend = pendIn;
+        state = 0;
+        exceptmask = ios::badbit | ios::failbit;
+        nType = nTypeIn;
+        nVersion = nVersionIn;
+    }
+
+    const_iterator begin() const                    { return pbegin; }
+    const_iterator end() const                      { return pend; }
+    size_type size() const                          { return pend - pbegin; }
+    bool empty() const                              { return pbegin == pend; }
+    const char& operator[](size_type pos) const     { return pbegin[pos]; }
+
+    void setstate(short bits, const char* psz)
+    {
+        state |= bits;
+        if (state & exceptmask)
+            throw std::ios_base::failure(psz);
+    }
+
+    bool eof() const             { return size() == 0; }
+    bool fail() const            { return state & (ios::badbit | ios::failbit); }
+    bool good() const            { return !eof() && (state == 0); }
+    void clear(short n)          { state = n; }
+    short exceptions()           { return exceptmask; }
+    short exceptions(short mask) { short prev = exceptmask; exceptmask = mask; setstate(0, "CDataStreamView"); return prev; }
+    int in_avail()               { return size(); }
+
+    void SetType(int n)          { nType = n; }
+    int GetType()                { return nType; }
+    void SetVersion(int n)       { nVersion = n; }
+    int GetVersion()             { return nVersion; }
+
+    CDataStreamView& read(char* pch, int nSize)
+    {
+        assert(nSize >= 0);
+        if (nSize > pend - pbegin)
+        {
+            setstate(ios::failbit, "CDataStreamView::read() : end of data");
+            memset(pch, 0, nSize);
+            nSize = pend - pbegin;
+        }
+        memcpy(pch, pbegin, nSize);
+        pbegin += nSize;
+        return (*this);
+    }
+
+    CDataStreamView& ignore(int nSize)
+    {
+        assert(nSize >= 0);
+        if (nSize > pend - pbegin)
+        {
+            setstate(ios::failbit, "CDataStreamView::ignore() : end of data");
+            nSize = pend - pbegin;
+        }
+        pbegin += nSize;
+        return (*this);
+    }
+
+    template<typename T>
+    CDataStreamView& operator>>(T& obj)
+    {
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
+
+
+//
+// Byte queue for socket buffers, with the stream interface of CDataStream.
+// The bytes live in a deque of chunks, so taking them off the front frees
+// whole chunks instead of moving everything queued behind them, and adding
+// to the back never reallocates and copies what's already there.  Writes
+// only ever go into the back chunk.
+//
+class CDataQueue
+{
+protected:
+    typedef std::allocator<char> allocator_type;
+    enum { CHUNK_SIZE = 0x10000 };
+
+    struct CChunk
+    {
+        char* pch;
+        unsigned int nCapacity;
+        unsigned int nBegin;
+        unsigned int nEnd;
+    };
+
+    deque<CChunk> vChunks;
+    // An empty CHUNK_SIZE chunk kept around so a busy queue isn't
+    // allocating and freeing one all the time
+    CChunk chunkSpare;
+    unsigned int nQueueSize;
+    short state;
+    short exceptmask;
+public:
+    int nType;
+    int nVersion;
+
+    typedef unsigned int size_type;
+
+    explicit CDataQueue(int nTypeIn=0, int nVersionIn=VERSION)
+    {
+        chunkSpare.pch = NULL;
+        nQueueSize = 0;
+        nType = nTypeIn;
+        nVersion = nVersionIn;
+        state = 0;
+        exceptmask = ios::badbit | ios::failbit;
+    }
+
+    ~CDataQueue()
+    {
+        clear();
+        if (chunkSpare.pch)
+            allocator_type().deallocate(chunkSpare.pch, chunkSpare.nCapacity);
+    }
+
+private:
+    // Not copyable
+    CDataQueue(const CDataQueue&);
+    CDataQueue& operator=(const CDataQueue&);
+
+protected:
+    CChunk NewChunk(unsigned int nCapacity)
+    {
+        CChunk chunk;
+        if (nCapacity <= CHUNK_SIZE && chunkSpare.pch)
+        {
+            chunk = chunkSpare;
+            chunkSpare.pch = NULL;
+            return chunk;
+        }
+        chunk.nCapacity = max(nCapacity, (unsigned int)CHUNK_SIZE);
+        chunk.pch = allocator_type().allocate(chunk.nCapacity);
+        chunk.nBegin = 0;
+        chunk.nEnd = 0;
+        return chunk;
+    }
+
+    void FreeChunk(const CChunk& chunk)
+    {
+        if (chunk.nCapacity == CHUNK_SIZE && !chunkSpare.pch)
+        {
+            chunkSpare = chunk;
+            chunkSpare.nBegin = 0;
+            chunkSpare.nEnd = 0;
+            return;
+        }
+        allocator_type().deallocate(chunk.pch, chunk.nCapacity);
+    }
+
+    void Consume(char* pch, size_type n)
+    {
+        // Take n bytes off the front, copying them to pch if it isn't NULL
+        while (n > 0)
+        {
+            CChunk& chunk = vChunks.front();
+            unsigned int nCopy = min(n, chunk.nEnd - chunk.nBegin);
+            if (pch)
+            {
+                memcpy(pch, chunk.pch + chunk.nBegin, nCopy);
+                pch += nCopy;
+            }
+            chunk.nBegin += nCopy;
+            nQueueSize -= nCopy;
+            n -= nCopy;
+            if (chunk.nBegin == chunk.nEnd)
+            {
+                FreeChunk(chunk);
+                vChunks.pop_front();
+            }
+        }
+        while (!vChunks.empty() && vChunks.front().nBegin == vChunks.front().nEnd)
+        {
+            FreeChunk(vChunks.front());
+            vChunks.pop_front();
+        }
+    }
+
+public:
+    //
+    // Vector subset
+    //
+    size_type size() const                           { return nQueueSize; }
+    bool empty() const                               { return nQueueSize == 0; }
+
+    void clear()
+    {
+        while (!vChunks.empty())
+        {
+            FreeChunk(vChunks.front());
+            vChunks.pop_front();
+        }
+        nQueueSize = 0;
+    }
+
+    char& operator[](size_type pos)
+    {
+        // Walk in from whichever end is closer, EndMessage patches
+        // headers near the back of a long send queue
+        assert(pos < nQueueSize);
+        if (pos < nQueueSize / 2)
+        {
+            for (deque<CChunk>::iterator it = vChunks.begin(); ; ++it)
+            {
+                unsigned int n = (*it).nEnd - (*it).nBegin;
+                if (pos < n)
+                    return (*it).pch[(*it).nBegin + pos];
+                pos -= n;
+            }
+        }
+        else
+        {
+            unsigned int nFromEnd = nQueueSize - pos;
+            for (deque<CChunk>::reverse_iterator it = vChunks.rbegin(); ; ++it)
+            {
+                unsigned int n = (*it).nEnd - (*it).nBegin;
+                if (nFromEnd <= n)
+                    return (*it).pch[(*it).nEnd - nFromEnd];
+                nFromEnd -= n;
+            }
+        }
+    }
+
+    const char& operator[](size_type pos) const
+    {
+        return (*const_cast<CDataQueue*>(this))[pos];
+    }
+
+    void resize(size_type n)
+    {
+        while (nQueueSize < n)
+        {
+            unsigned int nFree;
+            char* pch = GetWriteBuffer(1, nFree);
+            nFree = min(nFree, n - nQueueSize);
+            memset(pch, 0, nFree);
+            CommitWrite(nFree);
+        }
+        while (nQueueSize > n)
+        {
+            CChunk& chunk = vChunks.back();
+            unsigned int nDrop = min(nQueueSize - n, chunk.nEnd - chunk.nBegin);
+            chunk.nEnd -= nDrop;
+            nQueueSize -= nDrop;
+            if (chunk.nBegin == chunk.nEnd)
+            {
+                FreeChunk(chunk);
+                vChunks.pop_back();
+            }
+        }
+    }
+
+    void reserve(size_type n)
+    {
+        // Have the first n bytes end up contiguous as they're written, so
+        // a message still arriving can be read in place when it's done
+        if (n <= nQueueSize)
+            return;
+        if (vChunks.size() == 1 && vChunks.front().nCapacity - vChunks.front().nBegin >= n)
+            return;
+        CChunk chunkNew = NewChunk(n);
+        unsigned int nMoved = nQueueSize;
+        Consume(chunkNew.pch, nMoved);
+        chunkNew.nEnd = nMoved;
+        nQueueSize = nMoved;
+        vChunks.push_back(chunkNew);
+    }
+
+
+    //
+    // Direct access to the chunks, for send and recv
+    //
+    const char* GetFront(unsigned int& nSizeRet) const
+    {
+        // Bytes at the front that are contiguous in memory
+        if (vChunks.empty())
+        {
+            nSizeRet = 0;
+            return NULL;
+        }
+        const CChunk& chunk = vChunks.front();
+        nSizeRet = chunk.nEnd - chunk.nBegin;
+        return chunk.pch + chunk.nBegin;
+    }
+
+    const char* Linearize(size_type n)
+    {
+        // Make the first n bytes contiguous, copying only if they span chunks
+        assert(n <= nQueueSize);
+        if (n == 0)
+            return NULL;
+        if (vChunks.front().nEnd - vChunks.front().nBegin < n)
+        {
+            CChunk chunkNew = NewChunk(n);
+            Consume(chunkNew.pch, n);
+            chunkNew.nEnd = n;
+            nQueueSize += n;
+            vChunks.push_front(chunkNew);
+        }
+        return vChunks.front().pch + vChunks.front().nBegin;
+    }
+
+    char* GetWriteBuffer(unsigned int nMin, unsigned int& nFreeRet)
+    {
+        // Free space at the back, at least nMin bytes of it, to be filled
+        // and then added to the queue by CommitWrite
+        nMin = max(nMin, 1U);
+        if (vChunks.empty() || vChunks.back().nCapacity - vChunks.back().nEnd < nMin)
+            vChunks.push_back(NewChunk(nMin));
+        CChunk& chunk = vChunks.back();
+        nFreeRet = chunk.nCapacity - chunk.nEnd;
+        return chunk.pch + chunk.nEnd;
+    }
+
+    void CommitWrite(unsigned int n)
+    {
+        CChunk& chunk = vChunks.back();
+        assert(n <= chunk.nCapacity - chunk.nEnd);
+        chunk.nEnd += n;
+        nQueueSize += n;
+    }
+
+
+    //
+    // Stream subset
+    //
+    void setstate(short bits, const char* psz)
+    {
+        state |= bits;
+        if (state & exceptmask)
+            throw std::ios_base::failure(psz);
+    }
+
+    bool eof() const             { return size() == 0; }
+    bool fail() const            { return state & (ios::badbit | ios::failbit); }
+    bool good() const            { return !eof() && (state == 0); }
+    void clear(short n)          { state = n; }  // name conflict with vector clear()
+    short exceptions()           { return exceptmask; }
+    short exceptions(short mask) { short prev = exceptmask; exceptmask = mask; setstate(0, "CDataQueue"); return prev; }
+    int in_avail()               { return size(); }
+
+    void SetType(int n)          { nType = n; }
+    int GetType()                { return nType; }
+    void SetVersion(int n)       { nVersion = n; }
+    int GetVersion()             { return nVersion; }
+
+    CDataQueue& read(char* pch, int nSize)
+    {
+        assert(nSize >= 0);
+        if ((unsigned int)nSize > size())
+        {
+            setstate(ios::failbit, "CDataQueue::read() : end of data");
+            memset(pch, 0, nSize);
+            nSize = size();
+        }
+        Consume(pch, nSize);
+        return (*this);
+    }
+
+    CDataQueue& ignore(int nSize)
+    {
+        assert(nSize >= 0);
+        if ((unsigned int)nSize > size())
+        {
+            setstate(ios::failbit, "CDataQueue::ignore() : end of data");
+            nSize = size();
+        }
+        Consume(NULL, nSize);
+        return (*this);
+    }
+
+    CDataQueue& write(const char* pch, int nSize)
+    {
+        assert(nSize >= 0);
+        while (nSize > 0)
+        {
+            unsigned int nFree;
+            char* pchBuf = GetWriteBuffer(1, nFree);
+            nFree = min(nFree, (unsigned int)nSize);
+            memcpy(pchBuf, pch, nFree);
+            CommitWrite(nFree);
+            pch += nFree;
+            nSize -= nFree;
+        }
+        return (*this);
+    }
+
+    template<typename T>
+    unsigned int GetSerializeSize(const T& obj)
+    {
+        return ::GetSerializeSize(obj, nType, nVersion);
+    }
+
+    template<typename T>
+    CDataQueue& operator<<(const T& obj)
+    {
+        ::Serialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+
+    template<typename T>
+    CDataQueue& operator>>(T& obj)
+    {
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
 #ifdef TESTCDATASTREAM
 // VC6sp6
 // CDataStream:
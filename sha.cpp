@@ -13,6 +13,30 @@
 #include <memory.h>
 #include "sha.h"
 
+#if (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)) && (defined(__i386__) || defined(__x86_64__))) || \
+    (defined(_MSC_VER) && _MSC_VER >= 1700 && (defined(_M_IX86) || defined(_M_X64)))
+#define SHA256_X86_SIMD 1
+#endif
+#if SHA256_X86_SIMD && (defined(__GNUC__) || _MSC_VER >= 1900)
+#define SHA256_X86_SHANI 1
+#endif
+
+#if SHA256_X86_SIMD
+#ifdef _MSC_VER
+#include <intrin.h>
+#define SHA256_TARGET_SSE2
+#define SHA256_TARGET_AVX2
+#define SHA256_TARGET_SHANI
+#else
+#include <cpuid.h>
+#define SHA256_TARGET_SSE2 __attribute__((target("sse2")))
+#define SHA256_TARGET_AVX2 __attribute__((target("avx2")))
+#define SHA256_TARGET_SHANI __attribute__((target("sse4.1,sha")))
+#endif
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif
+
 namespace CryptoPP
 {
 
@@ -138,7 +162,8 @@ static const word32 SHA256_K[64] = {
 #define s0(x) (rotrFixed(x,7)^rotrFixed(x,18)^(x>>3))
 #define s1(x) (rotrFixed(x,17)^rotrFixed(x,19)^(x>>10))
 
-void SHA256::Transform(word32 *state, const word32 *data)
+// portable version, used when the CPU has nothing faster
+static void SHA256_Transform_Portable(word32 *state, const word32 *data)
 {
     word32 W[16];
     word32 T[8];
@@ -246,6 +271,378 @@ void SHA256_Transform(word32 *state, const word32 *data)
 
 // *************************************************************
 
+// Multi-buffer SHA-256.  Each SIMD lane carries a different message through
+// the same rounds, so hashing a batch of nonces costs about one scalar
+// transform per vector width.  Kernels are compiled with per function
+// target attributes and chosen by CPUID at runtime, so the rest of the
+// file and its callers still run on plain x86.
+
+
+#if SHA256_X86_SIMD
+
+static void CPUID(word32 leaf, word32 subleaf, word32& a, word32& b, word32& c, word32& d)
+{
+#ifdef _MSC_VER
+    int regs[4];
+    __cpuidex(regs, leaf, subleaf);
+    a = regs[0]; b = regs[1]; c = regs[2]; d = regs[3];
+#else
+    __cpuid_count(leaf, subleaf, a, b, c, d);
+#endif
+}
+
+static word64 XGETBV()
+{
+#ifdef _MSC_VER
+    return _xgetbv(0);
+#else
+    word32 a, d;
+    __asm__ ("xgetbv" : "=a" (a), "=d" (d) : "c" (0));
+    return ((word64)d << 32) | a;
+#endif
+}
+
+#define V4_ADD(a,b)         _mm_add_epi32(a,b)
+#define V4_ROTR(x,n)        _mm_or_si128(_mm_srli_epi32(x,n), _mm_slli_epi32(x,32-(n)))
+#define V4_CH(x,y,z)        _mm_xor_si128(z, _mm_and_si128(x, _mm_xor_si128(y, z)))
+#define V4_MAJ(x,y,z)       _mm_or_si128(_mm_and_si128(x, y), _mm_and_si128(z, _mm_or_si128(x, y)))
+#define V4_S0(x)            _mm_xor_si128(V4_ROTR(x,2), _mm_xor_si128(V4_ROTR(x,13), V4_ROTR(x,22)))
+#define V4_S1(x)            _mm_xor_si128(V4_ROTR(x,6), _mm_xor_si128(V4_ROTR(x,11), V4_ROTR(x,25)))
+#define V4_s0(x)            _mm_xor_si128(V4_ROTR(x,7), _mm_xor_si128(V4_ROTR(x,18), _mm_srli_epi32(x,3)))
+#define V4_s1(x)            _mm_xor_si128(V4_ROTR(x,17), _mm_xor_si128(V4_ROTR(x,19), _mm_srli_epi32(x,10)))
+#define V4_R(a,b,c,d,e,f,g,h,i) \
+    { __m128i t1 = V4_ADD(V4_ADD(V4_ADD(h, V4_S1(e)), V4_ADD(V4_CH(e,f,g), _mm_set1_epi32(SHA256_K[i]))), W[i]); \
+      d = V4_ADD(d, t1); h = V4_ADD(t1, V4_ADD(V4_S0(a), V4_MAJ(a,b,c))); }
+
+SHA256_TARGET_SSE2 static void SHA256_Transform_SSE2_4way(word32 *const *state, const word32 *const *data)
+{
+    __m128i W[64];
+    __m128i T[8];
+    for (int i = 0; i < 16; i++)
+        W[i] = _mm_set_epi32(data[3][i], data[2][i], data[1][i], data[0][i]);
+    for (int i = 16; i < 64; i++)
+        W[i] = V4_ADD(V4_ADD(V4_s1(W[i-2]), W[i-7]), V4_ADD(V4_s0(W[i-15]), W[i-16]));
+    for (int i = 0; i < 8; i++)
+        T[i] = _mm_set_epi32(state[3][i], state[2][i], state[1][i], state[0][i]);
+
+    __m128i a = T[0], b = T[1], c = T[2], d = T[3], e = T[4], f = T[5], g = T[6], h = T[7];
+    for (int i = 0; i < 64; i += 8)
+    {
+        V4_R(a,b,c,d,e,f,g,h,i+0);
+        V4_R(h,a,b,c,d,e,f,g,i+1);
+        V4_R(g,h,a,b,c,d,e,f,i+2);
+        V4_R(f,g,h,a,b,c,d,e,i+3);
+        V4_R(e,f,g,h,a,b,c,d,i+4);
+        V4_R(d,e,f,g,h,a,b,c,i+5);
+        V4_R(c,d,e,f,g,h,a,b,i+6);
+        V4_R(b,c,d,e,f,g,h,a,i+7);
+    }
+    T[0] = V4_ADD(T[0], a); T[1] = V4_ADD(T[1], b); T[2] = V4_ADD(T[2], c); T[3] = V4_ADD(T[3], d);
+    T[4] = V4_ADD(T[4], e); T[5] = V4_ADD(T[5], f); T[6] = V4_ADD(T[6], g); T[7] = V4_ADD(T[7], h);
+
+    for (int i = 0; i < 8; i++)
+    {
+        word32 out[4];
+        _mm_storeu_si128((__m128i*)out, T[i]);
+        for (int lane = 0; lane < 4; lane++)
+            state[lane][i] = out[lane];
+    }
+}
+
+#define V8_ADD(a,b)         _mm256_add_epi32(a,b)
+#define V8_ROTR(x,n)        _mm256_or_si256(_mm256_srli_epi32(x,n), _mm256_slli_epi32(x,32-(n)))
+#define V8_CH(x,y,z)        _mm256_xor_si256(z, _mm256_and_si256(x, _mm256_xor_si256(y, z)))
+#define V8_MAJ(x,y,z)       _mm256_or_si256(_mm256_and_si256(x, y), _mm256_and_si256(z, _mm256_or_si256(x, y)))
+#define V8_S0(x)            _mm256_xor_si256(V8_ROTR(x,2), _mm256_xor_si256(V8_ROTR(x,13), V8_ROTR(x,22)))
+#define V8_S1(x)            _mm256_xor_si256(V8_ROTR(x,6), _mm256_xor_si256(V8_ROTR(x,11), V8_ROTR(x,25)))
+#define V8_s0(x)            _mm256_xor_si256(V8_ROTR(x,7), _mm256_xor_si256(V8_ROTR(x,18), _mm256_srli_epi32(x,3)))
+#define V8_s1(x)            _mm256_xor_si256(V8_ROTR(x,17), _mm256_xor_si256(V8_ROTR(x,19), _mm256_srli_epi32(x,10)))
+#define V8_R(a,b,c,d,e,f,g,h,i) \
+    { __m256i t1 = V8_ADD(V8_ADD(V8_ADD(h, V8_S1(e)), V8_ADD(V8_CH(e,f,g), _mm256_set1_epi32(SHA256_K[i]))), W[i]); \
+      d = V8_ADD(d, t1); h = V8_ADD(t1, V8_ADD(V8_S0(a), V8_MAJ(a,b,c))); }
+
+SHA256_TARGET_AVX2 static void SHA256_Transform_AVX2_8way(word32 *const *state, const word32 *const *data)
+{
+    __m256i W[64];
+    __m256i T[8];
+    for (int i = 0; i < 16; i++)
+        W[i] = _mm256_set_epi32(data[7][i], data[6][i], data[5][i], data[4][i], data[3][i], data[2][i], data[1][i], data[0][i]);
+    for (int i = 16; i < 64; i++)
+        W[i] = V8_ADD(V8_ADD(V8_s1(W[i-2]), W[i-7]), V8_ADD(V8_s0(W[i-15]), W[i-16]));
+    for (int i = 0; i < 8; i++)
+        T[i] = _mm256_set_epi32(state[7][i], state[6][i], state[5][i], state[4][i], state[3][i], state[2][i], state[1][i], state[0][i]);
+
+    __m256i a = T[0], b = T[1], c = T[2], d = T[3], e = T[4], f = T[5], g = T[6], h = T[7];
+    for (int i = 0; i < 64; i += 8)
+    {
+        V8_R(a,b,c,d,e,f,g,h,i+0);
+        V8_R(h,a,b,c,d,e,f,g,i+1);
+        V8_R(g,h,a,b,c,d,e,f,i+2);
+        V8_R(f,g,h,a,b,c,d,e,i+3);
+        V8_R(e,f,g,h,a,b,c,d,i+4);
+        V8_R(d,e,f,g,h,a,b,c,i+5);
+        V8_R(c,d,e,f,g,h,a,b,i+6);
+        V8_R(b,c,d,e,f,g,h,a,i+7);
+    }
+    T[0] = V8_ADD(T[0], a); T[1] = V8_ADD(T[1], b); T[2] = V8_ADD(T[2], c); T[3] = V8_ADD(T[3], d);
+    T[4] = V8_ADD(T[4], e); T[5] = V8_ADD(T[5], f); T[6] = V8_ADD(T[6], g); T[7] = V8_ADD(T[7], h);
+
+    for (int i = 0; i < 8; i++)
+    {
+        word32 out[8];
+        _mm256_storeu_si256((__m256i*)out, T[i]);
+        for (int lane = 0; lane < 8; lane++)
+            state[lane][i] = out[lane];
+    }
+}
+
+#endif  // SHA256_X86_SIMD
+
+#if SHA256_X86_SHANI
+
+// Single message transform on the SHA extensions.  The rounds instructions
+// want the state split as ABEF/CDGH, and take two rounds per call with the
+// message words plus round constants packed four to a register.
+SHA256_TARGET_SHANI static void SHA256_Transform_SHANI(word32 *state, const word32 *data)
+{
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[0]), 0xB1);     // CDAB
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[4]), 0x1B);  // EFGH
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);                                      // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);                                           // CDGH
+    __m128i save0 = state0;
+    __m128i save1 = state1;
+
+    __m128i M[4];
+    for (int i = 0; i < 16; i++)
+    {
+        if (i < 4)
+            M[i] = _mm_loadu_si128((const __m128i*)&data[4*i]);
+        else
+        {
+            // W[t] = s1(W[t-2]) + W[t-7] + s0(W[t-15]) + W[t-16], four at a time
+            tmp = _mm_sha256msg1_epu32(M[(i-4)&3], M[(i-3)&3]);
+            tmp = _mm_add_epi32(tmp, _mm_alignr_epi8(M[(i-1)&3], M[(i-2)&3], 4));
+            M[i&3] = _mm_sha256msg2_epu32(tmp, M[(i-1)&3]);
+        }
+        __m128i msg = _mm_add_epi32(M[i&3], _mm_loadu_si128((const __m128i*)&SHA256_K[4*i]));
+        state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+        state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+    }
+
+    state0 = _mm_add_epi32(state0, save0);
+    state1 = _mm_add_epi32(state1, save1);
+    tmp = _mm_shuffle_epi32(state0, 0x1B);                  // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xB1);               // DCHG
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);            // DCBA
+    state1 = _mm_alignr_epi8(state1, tmp, 8);               // HGFE
+    _mm_storeu_si128((__m128i*)&state[0], state0);
+    _mm_storeu_si128((__m128i*)&state[4], state1);
+}
+
+#endif  // SHA256_X86_SHANI
+
+static SHA256Dispatch DetectSHA256Dispatch()
+{
+    SHA256Dispatch dispatch;
+    dispatch.pfnTransform = SHA256_Transform_Portable;
+    dispatch.pszTransform = "portable";
+    dispatch.nLanes = 1;
+    dispatch.pszLanes = "scalar";
+#if SHA256_X86_SIMD
+    word32 a, b, c, d;
+    CPUID(0, 0, a, b, c, d);
+    word32 nMaxLeaf = a;
+    CPUID(1, 0, a, b, c, d);
+    bool fSSE2 = (d & (1 << 26)) != 0;
+    bool fSSSE3 = (c & (1 << 9)) != 0;
+    bool fSSE41 = (c & (1 << 19)) != 0;
+    // AVX2 needs the OS to save the ymm registers across context switches
+    bool fOSXSAVE = (c & (1 << 27)) != 0;
+    bool fAVX = (c & (1 << 28)) != 0;
+    word32 nLeaf7EBX = 0;
+    if (nMaxLeaf >= 7)
+        CPUID(7, 0, a, nLeaf7EBX, c, d);
+
+    if (fSSE2)
+    {
+        dispatch.nLanes = 4;
+        dispatch.pszLanes = "sse2 4-way";
+    }
+    if (fOSXSAVE && fAVX && (XGETBV() & 6) == 6 && (nLeaf7EBX & (1 << 5)))
+    {
+        dispatch.nLanes = 8;
+        dispatch.pszLanes = "avx2 8-way";
+    }
+#if SHA256_X86_SHANI
+    if (fSSSE3 && fSSE41 && (nLeaf7EBX & (1 << 29)))
+    {
+        dispatch.pfnTransform = SHA256_Transform_SHANI;
+        dispatch.pszTransform = "shani";
+    }
+#endif
+#endif
+    return dispatch;
+}
+
+const SHA256Dispatch& GetSHA256Dispatch()
+{
+    static const SHA256Dispatch dispatch = DetectSHA256Dispatch();
+    return dispatch;
+}
+
+// make the choice at startup rather than on the first hash
+static const SHA256Dispatch& dispatchSHA256Startup = GetSHA256Dispatch();
+
+void SHA256::Transform(word32 *state, const word32 *data)
+{
+    GetSHA256Dispatch().pfnTransform(state, data);
+}
+
+static inline word32 ReadBigEndian32(const byte *p)
+{
+    return ((word32)p[0] << 24) | ((word32)p[1] << 16) | ((word32)p[2] << 8) | (word32)p[3];
+}
+
+static inline void WriteBigEndian32(byte *p, word32 x)
+{
+    p[0] = (byte)(x >> 24);
+    p[1] = (byte)(x >> 16);
+    p[2] = (byte)(x >> 8);
+    p[3] = (byte)x;
+}
+
+static inline void TransformBytes(word32 *state, const byte *chunk)
+{
+    word32 W[16];
+    for (int i = 0; i < 16; i++)
+        W[i] = ReadBigEndian32(chunk + 4*i);
+    SHA256::Transform(state, W);
+}
+
+void SHA256Context::Init()
+{
+    SHA256::InitState(state);
+    nBytes = 0;
+}
+
+void SHA256Context::Update(const void *input, size_t length)
+{
+    const byte *p = (const byte*)input;
+    size_t nBuffered = (size_t)(nBytes % 64);
+    nBytes += length;
+    if (nBuffered != 0)
+    {
+        size_t n = 64 - nBuffered;
+        if (n > length)
+            n = length;
+        memcpy(buf + nBuffered, p, n);
+        p += n;
+        length -= n;
+        if (nBuffered + n < 64)
+            return;
+        TransformBytes(state, buf);
+    }
+    for (; length >= 64; p += 64, length -= 64)
+        TransformBytes(state, p);
+    if (length != 0)
+        memcpy(buf, p, length);
+}
+
+void SHA256Context::Final(byte *digest)
+{
+    static const byte pad[64] = {0x80};
+    byte sizedesc[8];
+    word64 nBits = nBytes << 3;
+    WriteBigEndian32(sizedesc, (word32)(nBits >> 32));
+    WriteBigEndian32(sizedesc + 4, (word32)nBits);
+    // pad to 56 mod 64, then the 64-bit length fills out the last block
+    Update(pad, 1 + ((119 - (size_t)(nBytes % 64)) % 64));
+    Update(sizedesc, 8);
+    for (int i = 0; i < 8; i++)
+        WriteBigEndian32(digest + 4*i, state[i]);
+}
+
+void SHA256Context::CalculateDigest(byte *digest, const void *input, size_t length)
+{
+    SHA256Context ctx;
+    ctx.Update(input, length);
+    ctx.Final(digest);
+}
+
+unsigned int SHA256Lanes::Count()
+{
+    return GetSHA256Dispatch().nLanes;
+}
+
+const char * SHA256Lanes::ImplementationName()
+{
+    return GetSHA256Dispatch().pszLanes;
+}
+
+void SHA256Lanes::Transform(word32 *const *state, const word32 *const *data, unsigned int nLanes)
+{
+    unsigned int nWidth = Count();
+    unsigned int i = 0;
+#if SHA256_X86_SIMD
+    if (nWidth >= 8)
+        for (; i + 8 <= nLanes; i += 8)
+            SHA256_Transform_AVX2_8way(state + i, data + i);
+    if (nWidth >= 4)
+        for (; i + 4 <= nLanes; i += 4)
+            SHA256_Transform_SSE2_4way(state + i, data + i);
+#endif
+    for (; i < nLanes; i++)
+        SHA256::Transform(state[i], data[i]);
+}
+
+void SHA256Lanes::DoubleHash64(byte *digest, const byte *data, size_t nMessages)
+{
+    // padding blocks for a 64 byte and a 32 byte message, already in words
+    static const word32 pad64[16] = {0x80000000, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 512};
+    static const word32 pad32[8] = {0x80000000, 0, 0, 0, 0, 0, 0, 256};
+
+    word32 state[MAX_LANES][8];
+    word32 W[MAX_LANES][16];
+    word32 *pstate[MAX_LANES];
+    const word32 *pdata[MAX_LANES];
+    const word32 *ppad[MAX_LANES];
+
+    while (nMessages > 0)
+    {
+        unsigned int n = (nMessages < MAX_LANES ? (unsigned int)nMessages : MAX_LANES);
+        for (unsigned int l = 0; l < n; l++)
+        {
+            SHA256::InitState(state[l]);
+            for (int i = 0; i < 16; i++)
+                W[l][i] = ReadBigEndian32(data + 64*l + 4*i);
+            pstate[l] = state[l];
+            pdata[l] = W[l];
+            ppad[l] = pad64;
+        }
+        Transform(pstate, pdata, n);
+        Transform(pstate, ppad, n);
+
+        // the first digest goes straight back in as words, no byte swapping
+        for (unsigned int l = 0; l < n; l++)
+        {
+            memcpy(W[l], state[l], sizeof(state[l]));
+            memcpy(W[l] + 8, pad32, sizeof(pad32));
+            SHA256::InitState(state[l]);
+        }
+        Transform(pstate, pdata, n);
+
+        for (unsigned int l = 0; l < n; l++)
+            for (int i = 0; i < 8; i++)
+                WriteBigEndian32(digest + 32*l + 4*i, state[l][i]);
+
+        data += 64 * n;
+        digest += 32 * n;
+        nMessages -= n;
+    }
+}
+
+// *************************************************************
+
 #ifdef WORD64_AVAILABLE
 
 void SHA384::InitState(HashWordType *state)
@@ -148,6 +148,58 @@ public:
     static const char * StaticAlgorithmName() {return "SHA-224";}
 };
 
+// multi-buffer SHA-256, runs the compression function over several
+// independent messages at once with one message per SIMD lane
+class SHA256Lanes
+{
+public:
+    enum { MAX_LANES = 8 };
+
+    // lanes per call the best kernel for this CPU handles natively,
+    // picked once at runtime: 8 with AVX2, 4 with SSE2, otherwise 1
+    static unsigned int Count();
+    static const char * ImplementationName();
+
+    // state[i] and data[i] are the chaining state and 16 word block of
+    // lane i, in the same word order SHA256::Transform takes.  Any number
+    // of lanes may be passed, they are run in chunks of the widest kernel.
+    static void Transform(word32 *const *state, const word32 *const *data, unsigned int nLanes);
+
+    // double SHA-256 of nMessages independent 64 byte messages laid out
+    // back to back, 32 byte digests written back to back to digest.
+    // This is exactly one merkle tree node per message.
+    static void DoubleHash64(byte *digest, const byte *data, size_t nMessages);
+};
+
+// the SHA-256 backends picked for this CPU by CPUID, chosen once at startup.
+// SHA256::Transform, SHA256Lanes and SHA256Context all go through it.
+struct SHA256Dispatch
+{
+    void (*pfnTransform)(word32 *state, const word32 *data);
+    const char *pszTransform;
+    unsigned int nLanes;
+    const char *pszLanes;
+};
+
+const SHA256Dispatch& GetSHA256Dispatch();
+
+// incremental SHA-256 over bytes, same shape as OpenSSL's
+// SHA256_Init/Update/Final but running on the dispatched transform
+class SHA256Context
+{
+public:
+    SHA256Context() { Init(); }
+    void Init();
+    void Update(const void *input, size_t length);
+    void Final(byte *digest);
+    static void CalculateDigest(byte *digest, const void *input, size_t length);
+
+private:
+    word32 state[8];
+    byte buf[64];
+    word64 nBytes;
+};
+
 #ifdef WORD64_AVAILABLE
 
 // implements the SHA-512 standard
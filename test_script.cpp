@@ -0,0 +1,142 @@
+// Copyright (c) 2009 Satoshi Nakamoto
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+
+//
+// Checks that VerifyScript, with its shortcut for the standard scripts,
+// gives the same answer as running the whole thing through EvalScript the
+// way every other node does.  A script the shortcut accepts and EvalScript
+// doesn't would split the chain.
+//
+//   test_script [iterations]
+//
+
+#include "headers.h"
+
+// The wallet globals script.cpp links against, empty here
+map<vector<unsigned char>, CPrivKey> mapKeys;
+map<uint160, vector<unsigned char> > mapPubKeys;
+CCriticalSection cs_mapKeys;
+
+static int nChecks = 0;
+static int nFailed = 0;
+
+static void Check(const char* pszCase, const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, bool fExpected)
+{
+    nChecks++;
+    bool fEval = EvalScript(scriptSig + CScript(OP_CODESEPARATOR) + scriptPubKey, txTo, 0);
+    bool fVerify = VerifyScript(scriptSig, scriptPubKey, txTo, 0);
+    if (fEval != fExpected || fVerify != fExpected)
+    {
+        nFailed++;
+        printf("FAILED %s: EvalScript %d, VerifyScript %d, expected %d\n", pszCase, fEval, fVerify, fExpected);
+        printf("  scriptPubKey %s\n", HexStr(scriptPubKey.begin(), scriptPubKey.end()).c_str());
+    }
+}
+
+static void CheckNotSolved(const char* pszCase, const CScript& scriptPubKey)
+{
+    nChecks++;
+    vector<unsigned char> vchPubKey;
+    uint160 hash160;
+    if (ExtractPubKey(scriptPubKey, false, vchPubKey) || ExtractHash160(scriptPubKey, hash160))
+    {
+        nFailed++;
+        printf("FAILED %s: matched a standard template\n", pszCase);
+        printf("  scriptPubKey %s\n", HexStr(scriptPubKey.begin(), scriptPubKey.end()).c_str());
+    }
+}
+
+// A transaction spending output 0 of a made up previous transaction,
+// signed for scriptPubKey.  vchSigRet gets the signature.
+static CTransaction MakeSpend(CKey& key, const CScript& scriptPubKey, bool fPubKeyHash, vector<unsigned char>& vchSigRet)
+{
+    CTransaction txTo;
+    txTo.vin.push_back(CTxIn(uint256(1), 0));
+    txTo.vout.push_back(CTxOut(1, CScript() << OP_TRUE));
+
+    uint256 hash = SignatureHash(scriptPubKey, txTo, 0, SIGHASH_ALL);
+    key.Sign(hash, vchSigRet);
+    vchSigRet.push_back((unsigned char)SIGHASH_ALL);
+
+    txTo.vin[0].scriptSig << vchSigRet;
+    if (fPubKeyHash)
+        txTo.vin[0].scriptSig << key.GetPubKey();
+    return txTo;
+}
+
+static void TestScripts(int nIteration)
+{
+    CKey key;
+    key.MakeNewKey();
+    vector<unsigned char> vchPubKey = key.GetPubKey();
+    bool fPubKeyHash = (nIteration & 1);
+
+    CScript scriptPubKey;
+    if (fPubKeyHash)
+        scriptPubKey << OP_DUP << OP_HASH160 << Hash160(vchPubKey) << OP_EQUALVERIFY << OP_CHECKSIG;
+    else
+        scriptPubKey << vchPubKey << OP_CHECKSIG;
+
+    vector<unsigned char> vchSig;
+    CTransaction txTo = MakeSpend(key, scriptPubKey, fPubKeyHash, vchSig);
+    const CScript& scriptSig = txTo.vin[0].scriptSig;
+    Check("standard", scriptSig, scriptPubKey, txTo, true);
+
+    // Tampered signature
+    vector<unsigned char> vchSig2 = vchSig;
+    vchSig2[vchSig2.size() / 2] ^= 1;
+    CScript scriptSig2;
+    scriptSig2 << vchSig2;
+    if (fPubKeyHash)
+        scriptSig2 << vchPubKey;
+    Check("tampered signature", scriptSig2, scriptPubKey, txTo, false);
+
+    // Somebody else's key
+    if (fPubKeyHash)
+    {
+        CKey keyOther;
+        keyOther.MakeNewKey();
+        CScript scriptSig3;
+        scriptSig3 << vchSig << keyOther.GetPubKey();
+        Check("wrong pubkey", scriptSig3, scriptPubKey, txTo, false);
+    }
+
+    // Standard scripts followed by an opcode GetOp can't read.  Signed for
+    // the whole scriptPubKey so OP_CHECKSIG itself succeeds, EvalScript
+    // then fails on the next read and the shortcut has to agree.
+    static const unsigned char pchTrailing[][3] =
+    {
+        { 1, OP_PUSHDATA1 },            // PUSHDATA1 with no length
+        { 2, OP_PUSHDATA2, 0x01 },      // PUSHDATA2 with half a length
+        { 2, 0x05, 0xab },              // 5 byte push with 1 byte of data
+        { 1, OP_SINGLEBYTE_END },       // two byte opcode cut in half
+    };
+    for (unsigned int i = 0; i < ARRAYLEN(pchTrailing); i++)
+    {
+        CScript scriptBad = scriptPubKey;
+        scriptBad.insert(scriptBad.end(), &pchTrailing[i][1], &pchTrailing[i][1] + pchTrailing[i][0]);
+        vector<unsigned char> vchSigBad;
+        CTransaction txBad = MakeSpend(key, scriptBad, fPubKeyHash, vchSigBad);
+        Check("trailing truncated opcode", txBad.vin[0].scriptSig, scriptBad, txBad, false);
+        CheckNotSolved("trailing truncated opcode", scriptBad);
+    }
+
+    // Anything else after the standard script isn't standard, but has to
+    // get the same answer as EvalScript all the same
+    CScript scriptExtra = scriptPubKey;
+    scriptExtra << OP_NOP;
+    vector<unsigned char> vchSigExtra;
+    CTransaction txExtra = MakeSpend(key, scriptExtra, fPubKeyHash, vchSigExtra);
+    Check("trailing OP_NOP", txExtra.vin[0].scriptSig, scriptExtra, txExtra, true);
+}
+
+int main(int argc, char* argv[])
+{
+    int nIterations = (argc > 1 ? atoi(argv[1]) : 200);
+    for (int i = 0; i < nIterations; i++)
+        TestScripts(i);
+
+    printf("%d checks, %d failed\n", nChecks, nFailed);
+    return (nFailed == 0 ? 0 : 1);
+}
@@ -0,0 +1,287 @@
+// Copyright (c) 2009 Satoshi Nakamoto
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+
+//
+// Differential test of secp256k1.cpp against OpenSSL.  Every signature and
+// public key is checked both ways and any disagreement is a failure.  Run
+// it against both multiply paths (make test) after any change to
+// secp256k1.cpp.
+//
+//   test_secp256k1 [iterations]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
+#include <openssl/obj_mac.h>
+#include <openssl/rand.h>
+#include <openssl/bn.h>
+#include "secp256k1.h"
+using namespace std;
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+static void ECDSA_SIG_get0(const ECDSA_SIG* sig, const BIGNUM** pr, const BIGNUM** ps)
+{
+    *pr = sig->r;
+    *ps = sig->s;
+}
+#endif
+
+static int nChecks = 0;
+static int nFailed = 0;
+static int nUnsupported = 0;
+
+static void PrintHex(const char* pszName, const unsigned char* pch, int nSize)
+{
+    printf("  %s ", pszName);
+    for (int i = 0; i < nSize; i++)
+        printf("%02x", pch[i]);
+    printf("\n");
+}
+
+static void Fail(const char* pszCase, const vector<unsigned char>& vchPubKey, const unsigned char* pchHash, const vector<unsigned char>& vchSig)
+{
+    nFailed++;
+    if (nFailed > 20)
+        return;
+    printf("FAILED %s\n", pszCase);
+    PrintHex("pubkey", &vchPubKey[0], vchPubKey.size());
+    PrintHex("hash  ", pchHash, 32);
+    if (!vchSig.empty())
+        PrintHex("sig   ", &vchSig[0], vchSig.size());
+}
+
+// Both have to give the same answer.  Signatures that came straight out of
+// ECDSA_sign or der() are strict DER and mustn't be left to OpenSSL.
+static void CheckVerify(const char* pszCase, EC_KEY* pkey, const vector<unsigned char>& vchPubKey, const unsigned char* pchHash, const vector<unsigned char>& vchSig, bool fStrictDER=true)
+{
+    nChecks++;
+    int nOpenSSL = (ECDSA_verify(0, pchHash, 32, &vchSig[0], vchSig.size(), pkey) == 1);
+
+    secp256k1::PubKey pubkey;
+    if (!secp256k1::ParsePubKey(pubkey, &vchPubKey[0], vchPubKey.size()))
+    {
+        Fail(pszCase, vchPubKey, pchHash, vchSig);
+        return;
+    }
+    int nRet = secp256k1::Verify(pubkey, pchHash, &vchSig[0], vchSig.size());
+    if (nRet == secp256k1::VERIFY_UNSUPPORTED)
+    {
+        nUnsupported++;
+        if (fStrictDER)
+            Fail(pszCase, vchPubKey, pchHash, vchSig);
+        return;
+    }
+    if (nRet != nOpenSSL)
+        Fail(pszCase, vchPubKey, pchHash, vchSig);
+}
+
+// Minimal big endian encoding of a positive integer, as DER wants it
+static vector<unsigned char> DERInteger(const BIGNUM* bn)
+{
+    vector<unsigned char> vch(BN_num_bytes(bn) + 1, 0);
+    BN_bn2bin(bn, &vch[1]);
+    if (vch.size() == 1 || !(vch[1] & 0x80))
+        vch.erase(vch.begin());
+    if (vch.empty())
+        vch.push_back(0);
+    return vch;
+}
+
+static vector<unsigned char> DERSig(const BIGNUM* r, const BIGNUM* s)
+{
+    vector<unsigned char> vchR = DERInteger(r);
+    vector<unsigned char> vchS = DERInteger(s);
+    vector<unsigned char> vch;
+    vch.push_back(0x30);
+    vch.push_back(4 + vchR.size() + vchS.size());
+    vch.push_back(0x02);
+    vch.push_back(vchR.size());
+    vch.insert(vch.end(), vchR.begin(), vchR.end());
+    vch.push_back(0x02);
+    vch.push_back(vchS.size());
+    vch.insert(vch.end(), vchS.begin(), vchS.end());
+    return vch;
+}
+
+static vector<unsigned char> GetPubKeyBytes(EC_KEY* pkey)
+{
+    int nSize = i2o_ECPublicKey(pkey, NULL);
+    vector<unsigned char> vch(nSize);
+    unsigned char* pch = &vch[0];
+    i2o_ECPublicKey(pkey, &pch);
+    return vch;
+}
+
+static int Random(int n)
+{
+    unsigned int r;
+    RAND_bytes((unsigned char*)&r, sizeof(r));
+    return r % n;
+}
+
+static void TestSignatures(const EC_GROUP* group, const BIGNUM* order, int nIteration)
+{
+    EC_KEY* pkey = EC_KEY_new_by_curve_name(NID_secp256k1);
+    EC_KEY_generate_key(pkey);
+    EC_KEY_set_conv_form(pkey, (nIteration & 1) ? POINT_CONVERSION_COMPRESSED : POINT_CONVERSION_UNCOMPRESSED);
+    vector<unsigned char> vchPubKey = GetPubKeyBytes(pkey);
+
+    unsigned char hash[32];
+    RAND_bytes(hash, sizeof(hash));
+    if (nIteration % 7 == 0)
+        memset(hash, 0xff, sizeof(hash));
+    if (nIteration % 11 == 0)
+        memset(hash, 0, sizeof(hash));
+
+    unsigned char pchSig[128];
+    unsigned int nSigSize = 0;
+    ECDSA_sign(0, hash, sizeof(hash), pchSig, &nSigSize, pkey);
+    vector<unsigned char> vchSig(pchSig, pchSig + nSigSize);
+    CheckVerify("valid", pkey, vchPubKey, hash, vchSig);
+
+    // Tampered hash and signature
+    unsigned char hash2[32];
+    memcpy(hash2, hash, sizeof(hash));
+    hash2[Random(32)] ^= 1 << Random(8);
+    CheckVerify("tampered hash", pkey, vchPubKey, hash2, vchSig);
+
+    vector<unsigned char> vchSig2 = vchSig;
+    vchSig2[Random(vchSig2.size())] ^= 1 << Random(8);
+    CheckVerify("tampered signature", pkey, vchPubKey, hash, vchSig2, false);
+
+    ECDSA_SIG* psig = ECDSA_SIG_new();
+    const unsigned char* pchSigIn = &vchSig[0];
+    d2i_ECDSA_SIG(&psig, &pchSigIn, vchSig.size());
+    const BIGNUM* r;
+    const BIGNUM* s;
+    ECDSA_SIG_get0(psig, &r, &s);
+
+    BIGNUM* bnZero = BN_new();
+    BIGNUM* bnHighS = BN_new();
+    BIGNUM* bnROver = BN_new();
+    BIGNUM* bnSOver = BN_new();
+    BIGNUM* bnRandR = BN_new();
+    BIGNUM* bnRandS = BN_new();
+    BN_zero(bnZero);
+    BN_sub(bnHighS, order, s);
+    BN_add(bnROver, r, order);
+    BN_add(bnSOver, s, order);
+    BN_rand(bnRandR, 256, -1, 0);
+    BN_rand(bnRandS, 256, -1, 0);
+
+    // n - s is just as valid
+    CheckVerify("high S", pkey, vchPubKey, hash, DERSig(r, bnHighS));
+
+    // Out of range values have to be rejected, not reduced mod n
+    CheckVerify("r + n", pkey, vchPubKey, hash, DERSig(bnROver, s));
+    CheckVerify("s + n", pkey, vchPubKey, hash, DERSig(r, bnSOver));
+    CheckVerify("r = n", pkey, vchPubKey, hash, DERSig(order, s));
+    CheckVerify("s = n", pkey, vchPubKey, hash, DERSig(r, order));
+    CheckVerify("r = 0", pkey, vchPubKey, hash, DERSig(bnZero, s));
+    CheckVerify("s = 0", pkey, vchPubKey, hash, DERSig(r, bnZero));
+    CheckVerify("r s swapped", pkey, vchPubKey, hash, DERSig(s, r));
+    CheckVerify("random r s", pkey, vchPubKey, hash, DERSig(bnRandR, bnRandS));
+
+    // Somebody else's key
+    EC_KEY* pkeyOther = EC_KEY_new_by_curve_name(NID_secp256k1);
+    EC_KEY_generate_key(pkeyOther);
+    EC_KEY_set_conv_form(pkeyOther, (nIteration & 2) ? POINT_CONVERSION_COMPRESSED : POINT_CONVERSION_UNCOMPRESSED);
+    CheckVerify("wrong key", pkeyOther, GetPubKeyBytes(pkeyOther), hash, vchSig);
+
+    // A point that's off the curve mustn't parse
+    if (vchPubKey.size() == 65)
+    {
+        vector<unsigned char> vchBadKey = vchPubKey;
+        vchBadKey[33 + Random(32)] ^= 1 << Random(8);
+        secp256k1::PubKey pubkey;
+        nChecks++;
+        if (secp256k1::ParsePubKey(pubkey, &vchBadKey[0], vchBadKey.size()))
+            Fail("off curve key parsed", vchBadKey, hash, vector<unsigned char>());
+    }
+
+    BN_free(bnZero);
+    BN_free(bnHighS);
+    BN_free(bnROver);
+    BN_free(bnSOver);
+    BN_free(bnRandR);
+    BN_free(bnRandS);
+    ECDSA_SIG_free(psig);
+    EC_KEY_free(pkeyOther);
+    EC_KEY_free(pkey);
+}
+
+// GetPubKey has to agree with OpenSSL's point multiply, and refuse 0 and n
+static void TestGetPubKey(const EC_GROUP* group, const BIGNUM* order, const BIGNUM* bnPriv, bool fValid)
+{
+    unsigned char pchPriv[32];
+    memset(pchPriv, 0, sizeof(pchPriv));
+    BN_bn2bin(bnPriv, pchPriv + 32 - BN_num_bytes(bnPriv));
+
+    unsigned char pchPubKey[65];
+    bool fRet = secp256k1::GetPubKey(pchPubKey, pchPriv);
+    nChecks++;
+    if (fRet != fValid)
+    {
+        Fail("GetPubKey range", vector<unsigned char>(pchPriv, pchPriv + 32), pchPriv, vector<unsigned char>());
+        return;
+    }
+    if (!fValid)
+        return;
+
+    EC_POINT* point = EC_POINT_new(group);
+    EC_POINT_mul(group, point, bnPriv, NULL, NULL, NULL);
+    unsigned char pchExpected[65];
+    EC_POINT_point2oct(group, point, POINT_CONVERSION_UNCOMPRESSED, pchExpected, sizeof(pchExpected), NULL);
+    if (memcmp(pchPubKey, pchExpected, sizeof(pchExpected)) != 0)
+        Fail("GetPubKey", vector<unsigned char>(pchPubKey, pchPubKey + 65), pchPriv, vector<unsigned char>());
+    EC_POINT_free(point);
+}
+
+int main(int argc, char* argv[])
+{
+    int nIterations = (argc > 1 ? atoi(argv[1]) : 2000);
+
+    EC_GROUP* group = EC_GROUP_new_by_curve_name(NID_secp256k1);
+    BIGNUM* order = BN_new();
+    EC_GROUP_get_order(group, order, NULL);
+
+    for (int i = 0; i < nIterations; i++)
+        TestSignatures(group, order, i);
+
+    // Edges of the private key range, then random keys
+    BIGNUM* bn = BN_new();
+    BN_zero(bn);
+    TestGetPubKey(group, order, bn, false);
+    BN_one(bn);
+    TestGetPubKey(group, order, bn, true);
+    BN_copy(bn, order);
+    TestGetPubKey(group, order, bn, false);
+    BN_sub_word(bn, 1);
+    TestGetPubKey(group, order, bn, true);
+    for (int i = 0; i < nIterations; i++)
+    {
+        BN_rand_range(bn, order);
+        TestGetPubKey(group, order, bn, !BN_is_zero(bn));
+    }
+
+    // A low byte of zero makes the partial sum equal the next table entry,
+    // so the key generation addition has to double
+    for (int i = 0; i < nIterations; i++)
+    {
+        BN_rand_range(bn, order);
+        BN_rshift(bn, bn, 8 * (1 + i % 4));
+        BN_lshift(bn, bn, 8 * (1 + i % 4));
+        TestGetPubKey(group, order, bn, !BN_is_zero(bn));
+    }
+    BN_free(bn);
+    BN_free(order);
+    EC_GROUP_free(group);
+
+    printf("%d checks, %d failed, %d left to OpenSSL\n", nChecks, nFailed, nUnsupported);
+    return (nFailed == 0 ? 0 : 1);
+}
@@ -324,7 +324,7 @@ CMainFrame::CMainFrame(wxWindow* parent) : CMainFrameBase(parent)
     //m_listCtrlOrdersReceived->InsertColumn(4, "",                wxLIST_FORMAT_LEFT,  100);
 
     // Init status bar
-    int pnWidths[3] = { -100, 81, 286 };
+    int pnWidths[3] = { -100, 150, 286 };
     m_statusBar->SetFieldsCount(3, pnWidths);
 
     // Fill your address text box
@@ -784,7 +784,7 @@ void CMainFrame::OnPaintListCtrl(wxPaintEvent& event)
     // Update status bar
     string strGen = "";
     if (fGenerateBitcoins)
-        strGen = "    Generating";
+        strGen = strprintf("    Generating  %.0f khash/s", GetHashesPerSec() / 1000);
     if (fGenerateBitcoins && vNodes.empty())
         strGen = "(not connected)";
     m_statusBar->SetStatusText(strGen, 1);
@@ -843,8 +843,7 @@ void CMainFrame::OnMenuOptionsGenerate(wxCommandEvent& event)
     CWalletDB().WriteSetting("fGenerateBitcoins", fGenerateBitcoins);
 
     if (fGenerateBitcoins)
-        if (_beginthread(ThreadBitcoinMiner, 0, NULL) == -1)
-            printf("Error: _beginthread(ThreadBitcoinMiner) failed\n");
+        StartBitcoinMiner();
 
     Refresh();
     wxPaintEvent eventPaint;
@@ -3046,6 +3045,7 @@ bool CMyApp::OnInit2()
     //// debug print
     printf("\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n");
     printf("Bitcoin version %d, Windows version %08x\n", VERSION, GetVersion());
+    printf("SHA-256 transform %s, lanes %s\n", CryptoPP::GetSHA256Dispatch().pszTransform, CryptoPP::GetSHA256Dispatch().pszLanes);
 
     //
     // Limit to single instance per user
@@ -3179,6 +3179,21 @@ bool CMyApp::OnInit2()
             fGenerateBitcoins = atoi(mapArgs["/gen"].c_str());
     }
 
+    if (mapArgs.count("/genthreads"))
+        nMinerThreads = atoi(mapArgs["/genthreads"]);
+
+    if (mapArgs.count("/genpin"))
+        fMinerPinThreads = true;
+
+    if (mapArgs.count("/par"))
+        nScriptCheckThreads = atoi(mapArgs["/par"]);
+
+    if (mapArgs.count("/keypool"))
+        nKeyPoolSize = min(max(atoi(mapArgs["/keypool"]), 0), MAX_KEY_POOL_SIZE);
+
+    if (mapArgs.count("/dbcache"))
+        nDbCacheSize = min(max(atoi(mapArgs["/dbcache"]), MIN_DB_CACHE_SIZE), MAX_DB_CACHE_SIZE);
+
     //
     // Create the main frame window
     //
@@ -3195,9 +3210,11 @@ bool CMyApp::OnInit2()
         if (!StartNode(strErrors))
             wxMessageBox(strErrors, "Bitcoin");
 
+        if (_beginthread(ThreadKeyPool, 0, NULL) == -1)
+            printf("Error: _beginthread(ThreadKeyPool) failed\n");
+
         if (fGenerateBitcoins)
-            if (_beginthread(ThreadBitcoinMiner, 0, NULL) == -1)
-                printf("Error: _beginthread(ThreadBitcoinMiner) failed\n");
+            StartBitcoinMiner();
 
         //
         // Tests
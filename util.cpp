@@ -295,6 +295,87 @@ int GetFilesize(FILE* file)
     return nFilesize;
 }
 
+int GetNumProcessors()
+{
+    SYSTEM_INFO sysinfo;
+    GetSystemInfo(&sysinfo);
+    return max(1, (int)sysinfo.dwNumberOfProcessors);
+}
+
+
+//
+// Worker pool shared by the script checks and the merkle leaf hashing.
+// The threads are started the first time they're needed and then stay
+// blocked on hPoolWork between jobs.  Each one woken up calls the job
+// once and releases hPoolDone.  cs_WorkerPool keeps it to one job at a
+// time.
+//
+static const int MAX_POOL_THREADS = 64;
+static CCriticalSection cs_WorkerPool;
+static HANDLE hPoolWork = NULL;
+static HANDLE hPoolDone = NULL;
+static void (* volatile pfnPoolJob)(void*) = NULL;
+static void* volatile pPoolJobArg = NULL;
+static int nPoolThreads = 0;
+
+void ThreadWorkerPool(void* parg)
+{
+    loop
+    {
+        WaitForSingleObject(hPoolWork, INFINITE);
+        pfnPoolJob(pPoolJobArg);
+        ReleaseSemaphore(hPoolDone, 1, NULL);
+    }
+}
+
+/**
+ * Calls pfn(parg) on the calling thread and on up to nHelpers pool
+ * threads at the same time, and returns once every call has returned.
+ * pfn has to share the work out itself, a helper can wake up after the
+ * others have already done it all.
+ */
+void RunOnWorkerPool(void (*pfn)(void*), void* parg, int nHelpers)
+{
+    nHelpers = min(nHelpers, MAX_POOL_THREADS);
+    if (nHelpers <= 0)
+    {
+        pfn(parg);
+        return;
+    }
+
+    CRITICAL_BLOCK(cs_WorkerPool)
+    {
+        if (hPoolWork == NULL)
+        {
+            hPoolWork = CreateSemaphore(NULL, 0, MAX_POOL_THREADS, NULL);
+            hPoolDone = CreateSemaphore(NULL, 0, MAX_POOL_THREADS, NULL);
+        }
+        while (nPoolThreads < nHelpers && hPoolWork && hPoolDone)
+        {
+            if (_beginthread(ThreadWorkerPool, 0, NULL) == -1)
+            {
+                printf("Error: _beginthread(ThreadWorkerPool) failed\n");
+                break;
+            }
+            nPoolThreads++;
+        }
+
+        nHelpers = min(nHelpers, nPoolThreads);
+        pfnPoolJob = pfn;
+        pPoolJobArg = parg;
+        if (nHelpers > 0)
+            ReleaseSemaphore(hPoolWork, nHelpers, NULL);
+        pfn(parg);
+
+        // Every helper woken signals once it's out of pfn, so nobody is
+        // still looking at parg when this returns
+        for (int i = 0; i < nHelpers; i++)
+            WaitForSingleObject(hPoolDone, INFINITE);
+        pfnPoolJob = NULL;
+        pPoolJobArg = NULL;
+    }
+}
+
 
 
 
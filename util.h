@@ -78,10 +78,12 @@ string FormatMoney(int64 n, bool fPlus=false);
 bool ParseMoney(const char* pszIn, int64& nRet);
 bool FileExists(const char* psz);
 int GetFilesize(FILE* file);
+int GetNumProcessors();
 uint64 GetRand(uint64 nMax);
 int64 GetTime();
 int64 GetAdjustedTime();
 void AddTimeData(unsigned int ip, int64 nTime);
+void RunOnWorkerPool(void (*pfn)(void*), void* parg, int nHelpers);
 
 
 
@@ -335,13 +337,15 @@ inline void heapchk()
 
 
 
+// All the double-SHA256 helpers run on CryptoPP::SHA256Context, which
+// uses whichever SHA-256 transform sha.cpp picked for this CPU at startup.
 template<typename T1>
 inline uint256 Hash(const T1 pbegin, const T1 pend)
 {
     uint256 hash1;
-    SHA256((unsigned char*)&pbegin[0], (pend - pbegin) * sizeof(pbegin[0]), (unsigned char*)&hash1);
+    CryptoPP::SHA256Context::CalculateDigest((unsigned char*)&hash1, (unsigned char*)&pbegin[0], (pend - pbegin) * sizeof(pbegin[0]));
     uint256 hash2;
-    SHA256((unsigned char*)&hash1, sizeof(hash1), (unsigned char*)&hash2);
+    CryptoPP::SHA256Context::CalculateDigest((unsigned char*)&hash2, (unsigned char*)&hash1, sizeof(hash1));
     return hash2;
 }
 
@@ -350,13 +354,12 @@ inline uint256 Hash(const T1 p1begin, const T1 p1end,
                     const T2 p2begin, const T2 p2end)
 {
     uint256 hash1;
-    SHA256_CTX ctx;
-    SHA256_Init(&ctx);
-    SHA256_Update(&ctx, (unsigned char*)&p1begin[0], (p1end - p1begin) * sizeof(p1begin[0]));
-    SHA256_Update(&ctx, (unsigned char*)&p2begin[0], (p2end - p2begin) * sizeof(p2begin[0]));
-    SHA256_Final((unsigned char*)&hash1, &ctx);
+    CryptoPP::SHA256Context ctx;
+    ctx.Update((unsigned char*)&p1begin[0], (p1end - p1begin) * sizeof(p1begin[0]));
+    ctx.Update((unsigned char*)&p2begin[0], (p2end - p2begin) * sizeof(p2begin[0]));
+    ctx.Final((unsigned char*)&hash1);
     uint256 hash2;
-    SHA256((unsigned char*)&hash1, sizeof(hash1), (unsigned char*)&hash2);
+    CryptoPP::SHA256Context::CalculateDigest((unsigned char*)&hash2, (unsigned char*)&hash1, sizeof(hash1));
     return hash2;
 }
 
@@ -366,33 +369,87 @@ inline uint256 Hash(const T1 p1begin, const T1 p1end,
                     const T3 p3begin, const T3 p3end)
 {
     uint256 hash1;
-    SHA256_CTX ctx;
-    SHA256_Init(&ctx);
-    SHA256_Update(&ctx, (unsigned char*)&p1begin[0], (p1end - p1begin) * sizeof(p1begin[0]));
-    SHA256_Update(&ctx, (unsigned char*)&p2begin[0], (p2end - p2begin) * sizeof(p2begin[0]));
-    SHA256_Update(&ctx, (unsigned char*)&p3begin[0], (p3end - p3begin) * sizeof(p3begin[0]));
-    SHA256_Final((unsigned char*)&hash1, &ctx);
+    CryptoPP::SHA256Context ctx;
+    ctx.Update((unsigned char*)&p1begin[0], (p1end - p1begin) * sizeof(p1begin[0]));
+    ctx.Update((unsigned char*)&p2begin[0], (p2end - p2begin) * sizeof(p2begin[0]));
+    ctx.Update((unsigned char*)&p3begin[0], (p3end - p3begin) * sizeof(p3begin[0]));
+    ctx.Final((unsigned char*)&hash1);
     uint256 hash2;
-    SHA256((unsigned char*)&hash1, sizeof(hash1), (unsigned char*)&hash2);
+    CryptoPP::SHA256Context::CalculateDigest((unsigned char*)&hash2, (unsigned char*)&hash1, sizeof(hash1));
     return hash2;
 }
 
+/**
+ * Write-only stream that feeds whatever is serialized into it straight
+ * into SHA-256, so hashing an object never builds its serialized bytes
+ * in memory.  GetHash() returns the same double SHA-256 that Hash()
+ * would give over the equivalent CDataStream.
+ */
+class CHashWriter
+{
+private:
+    CryptoPP::SHA256Context ctx;
+    unsigned int nSize;
+
+public:
+    int nType;
+    int nVersion;
+
+    CHashWriter(int nTypeIn=SER_GETHASH, int nVersionIn=VERSION) : nSize(0), nType(nTypeIn), nVersion(nVersionIn) { }
+
+    CHashWriter& write(const char* pch, int nSizeIn)
+    {
+        ctx.Update(pch, nSizeIn);
+        nSize += nSizeIn;
+        return (*this);
+    }
+
+    // Number of bytes written so far
+    unsigned int size() const
+    {
+        return nSize;
+    }
+
+    // Finishes the hash, the writer can't be used after this
+    uint256 GetHash()
+    {
+        uint256 hash1;
+        ctx.Final((unsigned char*)&hash1);
+        uint256 hash2;
+        CryptoPP::SHA256Context::CalculateDigest((unsigned char*)&hash2, (unsigned char*)&hash1, sizeof(hash1));
+        return hash2;
+    }
+
+    template<typename T>
+    CHashWriter& operator<<(const T& obj)
+    {
+        ::Serialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
 template<typename T>
 uint256 SerializeHash(const T& obj, int nType=SER_GETHASH, int nVersion=VERSION)
 {
-    // Most of the time is spent allocating and deallocating CDataStream's
-    // buffer.  If this ever needs to be optimized further, make a CStaticStream
-    // class with its buffer on the stack.
-    CDataStream ss(nType, nVersion);
-    ss.reserve(10000);
+    CHashWriter ss(nType, nVersion);
     ss << obj;
-    return Hash(ss.begin(), ss.end());
+    return ss.GetHash();
+}
+
+template<typename T1>
+inline uint160 Hash160(const T1 pbegin, const T1 pend)
+{
+    uint256 hash1;
+    CryptoPP::SHA256Context::CalculateDigest((unsigned char*)&hash1, (unsigned char*)&pbegin[0], (pend - pbegin) * sizeof(pbegin[0]));
+    uint160 hash2;
+    RIPEMD160((unsigned char*)&hash1, sizeof(hash1), (unsigned char*)&hash2);
+    return hash2;
 }
 
 inline uint160 Hash160(const vector<unsigned char>& vch)
 {
     uint256 hash1;
-    SHA256(&vch[0], vch.size(), (unsigned char*)&hash1);
+    CryptoPP::SHA256Context::CalculateDigest((unsigned char*)&hash1, &vch[0], vch.size());
     uint160 hash2;
     RIPEMD160((unsigned char*)&hash1, sizeof(hash1), (unsigned char*)&hash2);
     return hash2;